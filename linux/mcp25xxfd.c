@@ -19,22 +19,32 @@
 #include <linux/delay.h>
 #include <linux/device.h>
 #include <linux/dma-mapping.h>
+#include <linux/ethtool.h>
 #include <linux/freezer.h>
 #include <linux/gpio/driver.h>
 #include <linux/interrupt.h>
 #include <linux/io.h>
 #include <linux/jiffies.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
 #include <linux/module.h>
+#include <linux/net_tstamp.h>
 #include <linux/netdevice.h>
 #include <linux/of.h>
 #include <linux/of_device.h>
+#include <linux/pkt_sched.h>
 #include <linux/platform_device.h>
+#include <linux/ptp_clock_kernel.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/sort.h>
 #include <linux/spi/spi.h>
+#include <linux/timecounter.h>
 #include <linux/uaccess.h>
+#include <linux/workqueue.h>
 #include <linux/regulator/consumer.h>
+#include <net/pkt_sched.h>
 
 #define DEVICE_NAME "mcp25xxfd"
 
@@ -88,8 +98,12 @@
  *   (especially for spi_write_then_read cases) - this only applies to
  *   4 wire SPI busses.
  * * Due to the fact that the TXQ does reorder Can-Frames we do not make
- *   use of it to avoid unexpected behaviour (say when running a
- *   firmware upgrade via Can)
+ *   use of it by default to avoid unexpected behaviour (say when running
+ *   a firmware upgrade via Can)
+ *   It can get enabled per device (device tree: microchip,use-txq) for
+ *   workloads that prefer throughput and can id priority over the order
+ *   of submission - it then gets used as tx ring (see below) where the
+ *   slots complete out of order.
  * * this means we use individual TX-fifos with a given priority and
  *   we have to wait until all the TX fifos have been transmitted before
  *   we can restart the networking queue to avoid reordering the frames on
@@ -102,6 +116,59 @@
  *   * CPU speed + SPI implementation - reduces latencies between transfers
  * * There is a module parameter that allows the modification of the
  *   number of tx_fifos, which is by default 7.
+ * * Optionally (module parameter) a single TX fifo with multiple slots
+ *   gets used as a ring instead: frames get filled into the next slot
+ *   and triggered in order, so the controller transmits them back to
+ *   back, and the queue keeps running as long as a slot is free.
+ *   The slot is encoded in the SEQ field and is freed when its TEF entry
+ *   has been processed. On an abort the fifo gets reset and all the
+ *   frames still in the ring get dropped.
+ * * With multiple netdev tx queues (module parameter tx_queues) each
+ *   queue gets its own tx ring/fifo with its own TXPRI, so frames stay
+ *   in order within a queue while a stalled low priority queue does not
+ *   block the others. The queue gets selected by skb->priority or via
+ *   the mqprio qdisc (hw offload), where a higher traffic class gets a
+ *   higher TXPRI.
+ * * Optionally (module parameter) frames the stack submits in a burst
+ *   (xmit_more) get staged and sent in a single spi_message: one write
+ *   of the adjacent tx objects and the UINC + TXREQ of each slot.
+ * * Optionally (module parameter) the payload of frames that do not get
+ *   batched is sent straight from the skb (the spi core takes care of
+ *   the dma mapping), so there is no copy and no oversized transfer.
+ * * The tx queues report to byte queue limits (BQL), with the size of a
+ *   frame being the bits it occupies on the bus, so the qdisc keeps the
+ *   backlog in the controller small.
+ * * The time stamps of the TEF get extended to ns by a timecounter and
+ *   get attached to the echo skbs as hardware time stamps (and reported
+ *   as tx time stamps via SO_TIMESTAMPING when enabled with
+ *   SIOCSHWTSTAMP). The same goes for the rx skbs (unless the rx filter
+ *   is HWTSTAMP_FILTER_NONE), which get the time the frame was received
+ *   on the bus. Unless disabled (module parameter) or adjusted via the
+ *   PHC the timecounter gets steered towards the host clock.
+ * * The timecounter is exposed as a PTP hardware clock, so userspace
+ *   (phc2sys) can discipline the clocks of all channels against the
+ *   system time. Reading it brackets the spi read of the TBC with system
+ *   time stamps, adjusting it is done in software on top of the TBC.
+ * * With the tx rings frames can get sent at their launch time
+ *   (SO_TXTIME via the etf qdisc with offload): the frame gets written
+ *   to its slot ahead of time and only the trigger (UINC + TXREQ) is
+ *   sent from an hrtimer at the launch time. The deviation of the time
+ *   stamp in the TEF from the launch time is collected in the stats.
+ * * Optionally (module parameters) frames aborted due to lost
+ *   arbitration (one-shot) or errors get requested again with a single
+ *   TXREQ write, as they are still in the fifo - up to a number of times
+ *   and/or until a deadline after the first abort.
+ * * Each interface has a tx shaper (configured via debugfs) that limits
+ *   the frames of some netdev tx queues to a share of the bus time: a
+ *   token bucket of bus time charged with the stuffed length of each
+ *   frame (the data phase at the data bitrate), with the queues stopped
+ *   while in debt and woken by an hrtimer. It may raise TXBWS as well.
+ * * Periodic frames can get sent by the driver itself (cyclic tx table
+ *   via debugfs - so only with CONFIG_DEBUG_FS, module parameter
+ *   tx_cyclic_depth, not with spi crc): an hrtimer writes
+ *   the frames due to a tx fifo of their own as a batch - no skbs and
+ *   no pass through the stack per cycle. Their TEF entries (marked in
+ *   SEQ) free the slots and give the achieved jitter of each entry.
  * * The driver offers some module parameters that allow to control the use
  *   of some optimizations (prefer reading more data than necessary instead
  *   of multiple SPI transfers - the idea here is that this way we may
@@ -121,6 +188,15 @@
  * * we use TEF + time stamping to record the transmitted frames
  *   including their timestamp - we use this to order TX and RX frames
  *   when submitting them to the network stack.
+ *   It can get disabled per device (device tree: microchip,no-tef) for
+ *   interfaces that need neither tx time stamps nor this ordering: the
+ *   frames then complete via the fifo empty interrupt (TXIF) and the
+ *   TXREQ bits of the status read, which saves the TEF read and UINC
+ *   per frame, and the memory of the TEF goes to the rx fifos.
+ *   This does not work with the tx ring.
+ *   When the number of TEF entries is known (without the tx ring) they
+ *   get read with a single transfer (two if they wrap around the end of
+ *   the TEF) and released with one spi_message of UINC writes.
  * * due to the inability to "filter" based on DLC sizes we have to use
  *   a common FIFO size. This is 8 bytes for Can2.0 and 64 bytes for CanFD.
  * * the driver tries to detect the Controller only by reading registers,
@@ -134,6 +210,48 @@
  *   in such a situation the driver tries to enable the PLL, which will
  *   never synchronize and the controller becomes unresponsive to further
  *   spi requests until a POR.
+ * * Optionally (module parameter) the interrupt handling can get driven
+ *   by spi_async: the hard irq handler submits a prebuilt status read
+ *   and the completion callbacks decide on the next spi_message to
+ *   submit - reading and releasing the RX fifos in a single message.
+ *   This avoids the wakeup of the irq thread for the pure RX case,
+ *   all other interrupt sources are handed over to the irq thread.
+ * * Optionally (module parameter) the register writes of the irq thread
+ *   (fifo releases, interrupt flag clearing) get queued and submitted
+ *   as a single spi_message before the state they modify is read again.
+ * * Optionally (module parameter) the spi transfers of the running
+ *   interface are crc protected: reads get retried on crc mismatch,
+ *   single byte writes use WRITE_SAFE and longer writes WRITE_CRC.
+ *   This allows running the spi bus closer to its limits without the
+ *   risk of silently corrupted frames.
+ * * Optionally (module parameter) the spi clock gets calibrated per
+ *   device during probe, as the signal quality differs between boards
+ *   and chip selects.
+ * * Optionally (module parameter) the irq thread reads the status
+ *   registers together with TEFSTA/TEFUA (and the FIFOSTA of aborted
+ *   tx fifos) as a single spi_message of cs_change transfers, which
+ *   saves round trips through the spi controller driver.
+ * * Optionally (module parameter) the irq thread holds the spi bus lock
+ *   while it services the controller, so that the sibling controller on
+ *   the same bus can not interleave its transfers. The lock is released
+ *   after a time/byte budget to keep the latency of the sibling bounded.
+ * * Each execution context (irq thread, setup, debugfs/gpio) has its
+ *   own spi transfer buffers, so the irq thread never has to wait on a
+ *   lock held by a sleeping debugfs or gpio access.
+ * * Fifo SRAM gets read straight into the (cacheline aligned) fifo
+ *   memory image, with the command bytes in a transfer of their own,
+ *   which avoids copying every received frame.
+ *
+ * Device tree properties (besides compatible, reg, clocks, interrupts,
+ * spi-max-frequency and the vdd-supply/xceiver-supply regulators):
+ * * microchip,clock-div2: divide the oscillator by 2 for SYSCLK
+ * * microchip,clock-out-div = <n>: CLKO divider (0, 1, 2, 4 or 10)
+ * * microchip,gpio-open-drain: INT and GPIO pins as open drain
+ * * microchip,use-txq: use the TXQ as tx ring, trading the order of
+ *   submission for throughput (see above)
+ * * microchip,no-tef: complete tx frames without the TEF - no tx time
+ *   stamps and no ordering against rx, not with the tx ring or the
+ *   cyclic tx fifo (see above)
  */
 
 #define MCP25XXFD_OST_DELAY_MS		3
@@ -578,6 +696,12 @@
 #define CAN_FIFOCON_RXTSEN		BIT(5)
 #define CAN_FIFOCON_RTREN		BIT(6)
 #define CAN_FIFOCON_TXEN		BIT(7)
+/* the lowest byte of the FIFOCON of the tx fifos (without the fifo
+ * empty interrupt, which gets used without the TEF)
+ */
+#define MCP25XXFD_TX_FIFOCON_IE						\
+	(CAN_FIFOCON_TXEN |						\
+	 CAN_FIFOCON_TXATIE) /* show up txatie flags in txatif reg */
 #define CAN_FIFOCON_UINC		BIT(8)
 #define CAN_FIFOCON_TXREQ		BIT(9)
 #define CAN_FIFOCON_FRESET		BIT(10)
@@ -728,6 +852,11 @@ struct mcp25xxfd_obj_tef {
 	struct mcp25xxfd_obj_ts header;
 };
 
+/* only the lower 24 bits of the time stamps of the objects are valid,
+ * as the last byte does not get read (see the TEF)
+ */
+#define MCP25XXFD_TIMESTAMP_BITS	24
+
 struct mcp25xxfd_obj_rx {
 	struct mcp25xxfd_obj_ts header;
 	u8 data[];
@@ -779,16 +908,320 @@ enum mcp25xxfd_gpio_mode {
 	gpio_mode_in		= MCP25XXFD_IOCON_PM0 | MCP25XXFD_IOCON_TRIS0
 };
 
+/* the large buffers used for spi transfers - these are allocated
+ * separately from the netdev private data and each buffer starts on its
+ * own cacheline, so that DMA into them never shares a cacheline with
+ * data the CPU modifies while the transfer is running
+ */
+/* the execution contexts that get their own spi transfer buffers
+ * the tx path is not listed, as it only uses the prebuilt spi_messages
+ * of struct mcp25xxfd_trigger_tx_message
+ */
+enum mcp25xxfd_spi_ctx {
+	/* the irq thread - used without locking */
+	MCP25XXFD_SPI_CTX_IRQ = 0,
+	/* setup, open/stop and everything else */
+	MCP25XXFD_SPI_CTX_CONFIG,
+	/* debugfs and gpio accesses */
+	MCP25XXFD_SPI_CTX_DEBUG,
+	MCP25XXFD_SPI_CTX_COUNT
+};
+
+struct mcp25xxfd_spi_buffer {
+	struct mutex lock;
+	u8 *tx;
+	u8 *rx;
+};
+
+struct mcp25xxfd_dma_buffers {
+	struct {
+		u8 tx[MCP25XXFD_BUFFER_TXRX_SIZE] ____cacheline_aligned;
+		u8 rx[MCP25XXFD_BUFFER_TXRX_SIZE] ____cacheline_aligned;
+	} spi[MCP25XXFD_SPI_CTX_COUNT];
+	u8 fifo_data[MCP25XXFD_BUFFER_TXRX_SIZE] ____cacheline_aligned;
+	/* the command bytes of the reads into fifo_data */
+	u8 fifo_cmd[2] ____cacheline_aligned;
+};
+
+/* each message gets its own cachelines when allocated as an array */
 struct mcp25xxfd_trigger_tx_message {
 	struct spi_message msg;
 	struct spi_transfer fill_xfer;
+	struct spi_transfer crc_xfer;
 	struct spi_transfer trigger_xfer;
 	int fifo;
-	char fill_cmd[2];
+	/* without crc the command is in fill_cmd[1..2],
+	 * with crc it is in fill_cmd[0..1] followed by the length
+	 */
+	char fill_cmd[3];
 	char fill_obj[sizeof(struct mcp25xxfd_obj_tx)];
 	char fill_data[64];
-	char trigger_cmd[2];
-	char trigger_data;
+	char fill_crc[2];
+	/* the write of the FIFOCON byte(s): command, length (crc only),
+	 * up to 2 bytes of data and crc
+	 */
+	u8 trigger_cmd[7];
+	/* zero-copy: the payload gets sent straight from the skb, which
+	 * becomes the echo skb and is only freed once the frame is done
+	 */
+	struct spi_transfer data_xfer;
+	struct spi_transfer pad_xfer;
+	char fill_pad[3];
+	bool zero_copy;
+	/* the address of the slot in SRAM */
+	u32 addr;
+	/* used when the slot is part of a batch (see use_tx_batching):
+	 * the object as part of the contiguous write and the UINC (with
+	 * TXREQ, as writing its byte with TXREQ cleared would abort the
+	 * frames pending in the fifo)
+	 */
+	struct spi_transfer batch_xfer;
+	struct spi_transfer uinc_xfer;
+	u8 uinc_cmd[4];
+	/* only used when the slot is the first of a batch */
+	struct spi_message batch_msg;
+	struct spi_transfer batch_cmd_xfer;
+	char batch_cmd[2];
+	u32 batch_fifos;
+} ____cacheline_aligned;
+
+/* frames staged while the stack signals xmit_more - they get written
+ * to the adjacent slots/fifos in SRAM with a single write and then get
+ * triggered slot by slot
+ */
+#define MCP25XXFD_TX_BATCH_MAX	16
+
+struct mcp25xxfd_tx_batch {
+	u32 count;
+	struct mcp25xxfd_trigger_tx_message *txm[MCP25XXFD_TX_BATCH_MAX];
+	u32 echo[MCP25XXFD_TX_BATCH_MAX];
+	/* the length of the last object */
+	u32 last_len;
+	/* the bits on the wire of the staged frames (for BQL) */
+	u32 wire_bits;
+	/* the ring of the frames - NULL for the individual tx fifos */
+	struct mcp25xxfd_tx_ring *ring;
+};
+
+/* a tx fifo with multiple slots used as a ring
+ * head and tail are free running counters of submitted and completed
+ * frames, the slot is the counter modulo depth.
+ * inflight has a bit set for each slot in use - with the TXQ the
+ * frames complete in ID order, so there tail is not used.
+ * each netdev tx queue has its own ring, the rings share the echo skbs
+ * starting at echo_base.
+ * the SEQ field of the tx objects carries:
+ *   bits 0-4: the echo skb index (echo_base + slot)
+ *   bit 5:    the generation (the next bit of the counter),
+ *             so that stale TEF entries can get detected
+ *   bit 6:    set for the cyclic tx fifo - bits 0-5 are its slot and
+ *             generation then
+ */
+#define MCP25XXFD_TX_RING_SEQ_SLOT_MASK	GENMASK(4, 0)
+#define MCP25XXFD_TX_RING_SEQ_GEN	BIT(5)
+#define MCP25XXFD_TX_RING_SEQ_CYCLIC	BIT(6)
+#define MCP25XXFD_TX_RING_MAX_DEPTH	32
+#define MCP25XXFD_TX_RING_RESET_POLLS	10
+#define MCP25XXFD_TX_QUEUES_MAX		8
+
+struct mcp25xxfd_tx_ring {
+	u32 depth;
+	int fifo;
+	/* the netdev tx queue */
+	u32 queue;
+	u32 echo_base;
+	/* frames get transmitted in the order submitted (not the TXQ) */
+	bool ordered;
+	u32 head;
+	u32 tail;
+	unsigned long inflight;
+	/* the SEQ used for each slot */
+	u8 seq[MCP25XXFD_TX_RING_MAX_DEPTH];
+	/* the fifo got aborted and needs a reset */
+	bool reset_pending;
+	/* the prebuilt spi_messages of each slot */
+	struct mcp25xxfd_trigger_tx_message *txm;
+};
+
+/* launch time of the frames of a netdev tx queue (etf qdisc offload)
+ * a frame with a launch time gets written to its slot of the tx ring
+ * right away (a batch of one frame without UINC and TXREQ), the
+ * prebuilt trigger of the slot gets sent from the hrtimer.
+ * until then no other frame may get into the ring, as its UINC would
+ * send the staged frame as well.
+ */
+struct mcp25xxfd_tx_launch {
+	struct mcp25xxfd_priv *priv;
+	u32 queue;
+	bool enabled;
+	struct hrtimer timer;
+	/* the staged frame - NULL when there is none */
+	struct mcp25xxfd_trigger_tx_message *txm;
+	struct spi_message msg;
+	struct spi_transfer xfer;
+	/* the launch time of the frame the spi bus lock held back in the
+	 * batch - 0 when there is none
+	 */
+	ktime_t held;
+};
+
+/* tx shaper of an interface - a token bucket of bus time (in ns) that
+ * gets filled at share permille of the time passing, up to burst_us.
+ * the configuration gets changed at runtime via debugfs.
+ */
+struct mcp25xxfd_tx_shaper {
+	struct mcp25xxfd_priv *priv;
+	spinlock_t lock;
+	struct hrtimer timer;
+	/* configuration */
+	u32 share;
+	u32 burst_us;
+	u32 queues;
+	u32 txbws;
+	/* state */
+	s64 tokens;
+	ktime_t last;
+	u32 stopped;
+};
+
+/* an entry of the cyclic tx table - inactive entries are left in the
+ * table with their stats
+ */
+#define MCP25XXFD_TX_CYCLIC_MAX		256
+
+struct mcp25xxfd_tx_cyclic_entry {
+	struct canfd_frame frame;
+	bool fd;
+	bool active;
+	u32 period_us;
+	/* the frames left to send - 0 if it repeats until switched off */
+	u32 count;
+	ktime_t next;
+	/* the TEF time of the last frame - 0 after a missed cycle */
+	ktime_t last;
+	u64 frames;
+	u64 missed;
+	u64 jitter_max_ns;
+	u64 jitter_sum_ns;
+	u64 jitter_samples;
+};
+
+/* the cyclic tx table of an interface
+ * the due entries get written to a dedicated tx fifo used as a ring
+ * (without echo skbs) from an hrtimer. The active entries are kept in a
+ * min-heap on their next due time, so the timer only touches the ones
+ * due. the table and the ring are protected by the spinlock, changes
+ * of the table that rearm the timer are serialized by the mutex.
+ */
+struct mcp25xxfd_tx_cyclic {
+	struct mcp25xxfd_priv *priv;
+	struct mutex mutex;
+	spinlock_t lock;
+	struct hrtimer timer;
+	struct mcp25xxfd_tx_cyclic_entry *entries;
+	u16 heap[MCP25XXFD_TX_CYCLIC_MAX];
+	u32 heap_count;
+	/* the fifo - 0 when there is none, the timer only runs while
+	 * the interface is up
+	 */
+	u32 fifo;
+	u32 depth;
+	bool running;
+	u32 head;
+	u32 tail;
+	/* the SEQ and the table entry of each slot */
+	u8 seq[MCP25XXFD_TX_RING_MAX_DEPTH];
+	u16 entry[MCP25XXFD_TX_RING_MAX_DEPTH];
+	/* the prebuilt spi_messages of the slots and the frames due */
+	struct mcp25xxfd_trigger_tx_message *txm;
+	struct mcp25xxfd_tx_batch batch;
+};
+
+/* a register block read that gets prepared once and is then reused
+ * - room for command, length and crc for the crc protected variant
+ */
+#define MCP25XXFD_READ_MESSAGE_MAX_SIZE	36
+
+struct mcp25xxfd_read_message {
+	struct spi_message msg;
+	struct spi_transfer xfer[2];
+	u32 reg;
+	int len;
+	bool crc;
+	u8 tx[3 + MCP25XXFD_READ_MESSAGE_MAX_SIZE + 2];
+	/* not sharing a cacheline with the fields above */
+	u8 rx[3 + MCP25XXFD_READ_MESSAGE_MAX_SIZE + 2] ____cacheline_aligned;
+};
+
+/* several register block reads at different addresses that get
+ * submitted as one spi_message of cs_change transfers
+ */
+#define MCP25XXFD_GATHER_SEGMENTS	32
+#define MCP25XXFD_GATHER_SIZE		512
+
+struct mcp25xxfd_gather_message {
+	struct spi_message msg;
+	struct spi_transfer xfer[2 * MCP25XXFD_GATHER_SEGMENTS];
+	struct {
+		u32 reg;
+		int len;
+		/* offset of the command in tx/rx */
+		int offset;
+	} seg[MCP25XXFD_GATHER_SEGMENTS];
+	int count;
+	int xfers;
+	int size;
+	u32 speed_hz;
+	bool crc;
+	u8 tx[MCP25XXFD_GATHER_SIZE];
+	/* not sharing a cacheline with the fields above */
+	u8 rx[MCP25XXFD_GATHER_SIZE] ____cacheline_aligned;
+};
+
+/* a masked register write: command, length, 4 bytes of data and crc */
+#define MCP25XXFD_WRITE_MAX_SIZE	(3 + 4 + 2)
+
+/* a masked register write that gets prepared once and is then reused */
+struct mcp25xxfd_write_message {
+	struct spi_message msg;
+	struct spi_transfer xfer;
+	u32 reg;
+	u32 mask;
+	bool crc;
+	u8 tx[MCP25XXFD_WRITE_MAX_SIZE];
+};
+
+/* masked register writes that get queued and submitted in one spi_message
+ * of cs_change transfers
+ */
+#define MCP25XXFD_WRITE_BATCH_SIZE	48
+
+struct mcp25xxfd_write_batch {
+	struct spi_message msg;
+	struct spi_transfer xfer[MCP25XXFD_WRITE_BATCH_SIZE];
+	u8 tx[MCP25XXFD_WRITE_BATCH_SIZE][MCP25XXFD_WRITE_MAX_SIZE];
+	int count;
+};
+
+/* prebuilt spi_messages for the recurring transfers of the irq thread */
+struct mcp25xxfd_irq_templates {
+	/* read of CAN_INT to CAN_BDIAG1 */
+	struct mcp25xxfd_read_message status;
+	/* read of CAN_INT to CAN_BDIAG1 and of CAN_TEFSTA/CAN_TEFUA */
+	struct mcp25xxfd_gather_message status_gather;
+	/* read of CAN_FIFOSTA of the aborted tx fifos */
+	struct mcp25xxfd_gather_message txatif;
+	/* the gather messages are used */
+	bool gather;
+	/* read of a single TEF object and its release */
+	struct mcp25xxfd_read_message tef;
+	struct mcp25xxfd_write_message tef_release;
+	/* clearing of the CAN_INT flags */
+	struct mcp25xxfd_write_message int_clear;
+	/* release of each fifo */
+	struct mcp25xxfd_write_message release[32];
+	/* the queue of register writes */
+	struct mcp25xxfd_write_batch batch;
 };
 
 struct mcp25xxfd_read_fifo_info {
@@ -796,6 +1229,23 @@ struct mcp25xxfd_read_fifo_info {
 	int rx_count;
 };
 
+/* the devices sharing a spi controller
+ * the spi bus lock taken by the irq thread of one of them makes spi_async
+ * fail for all of them, so the lock state is kept per controller
+ */
+struct mcp25xxfd_bus {
+	struct list_head list;
+	struct spi_master *master;
+	/* the devices on this controller */
+	struct list_head devices;
+	/* the spi bus lock is held by the irq thread of one of them */
+	bool locked;
+};
+
+static LIST_HEAD(mcp25xxfd_buses);
+/* protects mcp25xxfd_buses and the device lists */
+static DEFINE_MUTEX(mcp25xxfd_buses_mutex);
+
 struct mcp25xxfd_priv {
 	struct can_priv	   can;
 	struct net_device *net;
@@ -820,6 +1270,12 @@ struct mcp25xxfd_priv {
 	enum mcp25xxfd_model model;
 
 	struct {
+		/* use the TXQ (which reorders frames by can id) */
+		bool use_txq;
+
+		/* complete the tx frames without the TEF */
+		bool no_tef;
+
 		/* clock configuration */
 		bool clock_pll;
 		bool clock_div2;
@@ -832,6 +1288,8 @@ struct mcp25xxfd_priv {
 	/* the distinct spi_speeds to use for spi communication */
 	u32 spi_setup_speed_hz;
 	u32 spi_speed_hz;
+	/* the result of the spi clock calibration (0 if not calibrated) */
+	u32 spi_calibrated_speed_hz;
 
 	/* fifo info */
 	struct {
@@ -850,6 +1308,7 @@ struct mcp25xxfd_priv {
 
 		/* infos on tx-fifos */
 		u32 tx_fifos;
+		u32 tx_fifo_depth; /* number of slots of each tx-fifo */
 		u32 tx_fifo_start;
 		u32 tx_fifo_mask; /* bitmask of which fifo is a tx fifo */
 		u32 tx_submitted_mask;
@@ -863,8 +1322,10 @@ struct mcp25xxfd_priv {
 		u32 rx_fifo_start;
 		u32 rx_fifo_mask;  /* bitmask of which fifo is a rx fifo */
 
-		/* memory image of FIFO RAM on mcp25xxfd */
-		u8 fifo_data[MCP25XXFD_BUFFER_TXRX_SIZE];
+		/* memory image of FIFO RAM on mcp25xxfd
+		 * - see struct mcp25xxfd_dma_buffers
+		 */
+		u8 *fifo_data;
 
 	} fifos;
 
@@ -877,6 +1338,96 @@ struct mcp25xxfd_priv {
 		u64 irq_calls;
 		/* number of loops inside the irq handler */
 		u64 irq_loops;
+		/* number of handoffs from spi_async to the irq thread */
+		u64 irq_async_handoff;
+
+		/* write batching: writes queued, messages submitted
+		 * and spi_messages saved by merging
+		 */
+		u64 write_batch_writes;
+		u64 write_batch_flushes;
+		u64 write_batch_merged;
+
+		/* bulk drains of the TEF and the objects read with them */
+		u64 tef_bulk_reads;
+		u64 tef_bulk_objects;
+
+		/* spi crc errors detected on reads of SFR and RAM and
+		 * the number of reads that failed after all the retries
+		 */
+		u64 spi_crc_err_sfr;
+		u64 spi_crc_err_ram;
+		u64 spi_crc_err_exhausted;
+
+		/* use of the per context spi buffers and the number of
+		 * times a context had to wait for its buffer
+		 */
+		u64 spi_buffer_uses[MCP25XXFD_SPI_CTX_COUNT];
+		u64 spi_buffer_waits[MCP25XXFD_SPI_CTX_COUNT];
+
+		/* spi bus lock: number of times taken, released due to
+		 * the budget, and the time other devices were held off
+		 */
+		u64 bus_lock_count;
+		u64 bus_lock_budget_exceeded;
+		u64 bus_lock_hold_ns;
+		u64 bus_lock_hold_max_ns;
+		/* tx submissions that failed, as the bus was locked */
+		u64 tx_spi_busy;
+
+		/* tx ring: queue stops due to a full ring, resets after
+		 * an abort and TEF entries that did not match the ring
+		 */
+		u64 tx_ring_full;
+		u64 tx_ring_resets;
+		u64 tx_ring_seq_errors;
+
+		/* tx batching: spi_messages, the frames sent in them and
+		 * the frames dropped as the spi_message failed
+		 */
+		u64 tx_batches;
+		u64 tx_batch_frames;
+		u64 tx_batch_drops;
+
+		/* launch time: frames sent with a launch time, those staged
+		 * after it, those that went out before it, triggers that
+		 * needed a retry and the deviation of the TEF time stamps
+		 */
+		u64 tx_launch_frames;
+		u64 tx_launch_late;
+		u64 tx_launch_early;
+		u64 tx_launch_retries;
+		u64 tx_launch_error_max_ns;
+		u64 tx_launch_error_sum_ns;
+
+		/* tx aborts by cause and the retransmissions requested
+		 * instead, as well as the frames that ran out of them
+		 */
+		u64 tx_abort_arbitration;
+		u64 tx_abort_error;
+		u64 tx_abort_other;
+		u64 tx_retransmits;
+		u64 tx_retransmit_exhausted;
+
+		/* tx shaper: frames accounted and their bus time, the times
+		 * the queues got stopped and the frames handed back
+		 */
+		u64 tx_shaper_frames;
+		u64 tx_shaper_bus_ns;
+		u64 tx_shaper_throttled;
+		u64 tx_shaper_requeued;
+
+		/* cyclic tx: frames sent, cycles missed (no free slot or
+		 * the spi bus was busy) and the deviation of the intervals
+		 * between the TEF time stamps from the period
+		 */
+		u64 tx_cyclic_frames;
+		u64 tx_cyclic_missed;
+		u64 tx_cyclic_jitter_max_ns;
+		u64 tx_cyclic_jitter_sum_ns;
+		u64 tx_cyclic_jitter_samples;
+
+		u64 ts_resync_steps;
 
 		/* interrupt handler state and statistics */
 		u32 irq_state;
@@ -921,7 +1472,7 @@ struct mcp25xxfd_priv {
 	} stats;
 
 	/* the current status of the mcp25xxfd */
-	struct {
+	struct mcp25xxfd_status {
 		u32 intf;
 		/* ASSERT(CAN_INT + 4 == CAN_RXIF) */
 		u32 rxif;
@@ -954,6 +1505,32 @@ struct mcp25xxfd_priv {
 		u32 dbtcfg;
 	} regs;
 
+	/* hardware time stamps: the TBC extended to ns by a timecounter,
+	 * which gets updated by a delayed work
+	 */
+	struct {
+		spinlock_t lock;
+		struct cyclecounter cc;
+		struct timecounter tc;
+		/* the TBC value read last */
+		u32 tbc;
+		u32 freq;
+		/* the nominal mult of the cyclecounter */
+		u32 mult;
+		/* serializes reading the TBC and protects running */
+		struct mutex mutex;
+		bool running;
+		/* the clock got adjusted by userspace via the PHC, so the
+		 * resync against the host clock is off
+		 */
+		bool adjusted;
+		struct ptp_clock_info ptp_info;
+		struct ptp_clock *ptp;
+		unsigned long period;
+		struct delayed_work work;
+		struct hwtstamp_config config;
+	} ts;
+
 	/* interrupt handler signaling */
 	int force_quit;
 	int after_suspend;
@@ -983,14 +1560,129 @@ struct mcp25xxfd_priv {
 #define TX_QUEUE_STATUS_STOPPED		3
 
 	/* spi-tx/rx buffers for efficient transfers
-	 * used during setup and irq
+	 * one per execution context, so that the irq thread never has
+	 * to wait for setup or debugfs accesses
+	 * - see struct mcp25xxfd_dma_buffers
 	 */
-	struct mutex spi_rxtx_lock;
-	u8 spi_tx[MCP25XXFD_BUFFER_TXRX_SIZE];
-	u8 spi_rx[MCP25XXFD_BUFFER_TXRX_SIZE];
+	struct mcp25xxfd_spi_buffer spi_buffers[MCP25XXFD_SPI_CTX_COUNT];
+	/* the task of the irq thread, which owns the irq buffer */
+	struct task_struct *spi_ist_task;
+	/* the task currently inside a debugfs or gpio access */
+	struct task_struct *spi_debug_task;
+	struct mutex spi_debug_lock;
+	/* command buffer for the reads into the fifo memory image */
+	u8 *spi_fifo_cmd;
 
 	/* structure for transmit fifo spi_messages */
 	struct mcp25xxfd_trigger_tx_message *spi_transmit_fifos;
+
+	/* the tx rings - one per netdev tx queue,
+	 * no rings if the individual tx fifos are used
+	 */
+	struct mcp25xxfd_tx_ring tx_rings[MCP25XXFD_TX_QUEUES_MAX];
+	u32 tx_ring_count;
+	/* the TXPRI of the tx fifo of each netdev tx queue */
+	u8 tx_queue_txpri[MCP25XXFD_TX_QUEUES_MAX];
+
+	/* the frames staged for a batch - per netdev tx queue */
+	struct mcp25xxfd_tx_batch tx_batch[MCP25XXFD_TX_QUEUES_MAX];
+
+	/* byte queue limits: the bits on the wire of the frame of each
+	 * echo skb and the completions collected in the irq thread
+	 */
+	u32 tx_wire_bits[TX_ECHO_SKB_MAX];
+	u32 tx_bql_pkts[MCP25XXFD_TX_QUEUES_MAX];
+	u32 tx_bql_bits[MCP25XXFD_TX_QUEUES_MAX];
+
+	/* launch time: per netdev tx queue and the requested time (on the
+	 * host clock) of the frame of each echo skb - 0 if there is none
+	 */
+	struct mcp25xxfd_tx_launch tx_launch[MCP25XXFD_TX_QUEUES_MAX];
+	ktime_t tx_launch_time[TX_ECHO_SKB_MAX];
+
+	/* the share of the bus time of some of the netdev tx queues */
+	struct mcp25xxfd_tx_shaper tx_shaper;
+
+	/* the periodic frames sent by the driver itself */
+	struct mcp25xxfd_tx_cyclic tx_cyclic;
+
+	/* retransmissions of the frame at the head of each tx fifo */
+	struct {
+		u32 count;
+		ktime_t first;
+	} tx_retransmit[32];
+
+	/* state of the spi_async driven interrupt handler */
+	struct mcp25xxfd_async_ist *async_ist;
+
+	/* prebuilt spi_messages used in the interrupt handler */
+	struct mcp25xxfd_irq_templates *irq_templates;
+
+	/* the spi bus lock held by the irq thread */
+	struct {
+		bool locked;
+		ktime_t start;
+		u32 bytes;
+		/* the tx queues stopped until the lock gets released */
+		unsigned long tx_stopped;
+		/* the devices sharing the spi controller */
+		struct mcp25xxfd_bus *bus;
+		struct list_head node;
+	} bus_lock;
+
+	/* CAN_TEFSTA and CAN_TEFUA read together with the status */
+	struct {
+		u32 tefsta;
+		u32 tefua;
+		bool valid;
+	} tef_status;
+
+	/* crc protected spi transfers are used */
+	bool spi_crc;
+};
+
+/* spi_async driven interrupt handling:
+ * the status is read from the hard irq handler via spi_async and each
+ * completion callback decides on the next spi_message to submit
+ * (currently only the pure RX case), everything else is handed over
+ * to the interrupt thread
+ */
+struct mcp25xxfd_async_ist {
+	/* read of CAN_INT to CAN_BDIAG1 */
+	struct mcp25xxfd_read_message status;
+
+	/* read of the rx fifos followed by the release of the fifos:
+	 * blocks of adjacent fifos with 2 transfers each (3 with crc)
+	 * and one release transfer per fifo
+	 */
+	struct spi_message rx_msg;
+	struct spi_transfer rx_xfer[32 * 3 + 32];
+	u32 rx_mask;
+	int rx_blocks;
+	u32 rx_block_addr[32];
+	int rx_block_len[32];
+	u8 rx_cmd[32][3];
+	u8 rx_crc[32][2] ____cacheline_aligned;
+
+	/* with crc the fifos only get released after the crc check */
+	struct spi_message release_msg;
+	struct spi_transfer release_xfer[32];
+
+	/* the remaining retries on crc errors */
+	int crc_retries ____cacheline_aligned;
+
+	/* the rx stage the irq thread continues with (the completions
+	 * may run in hard irq context, so they do not process the frames)
+	 */
+	int rx_stage;
+#define MCP25XXFD_ASYNC_IST_RX_IDLE	0
+#define MCP25XXFD_ASYNC_IST_RX_READ	1
+#define MCP25XXFD_ASYNC_IST_RX_RELEASED	2
+
+	/* set when the interrupt thread has taken over */
+	bool handoff;
+	/* signaled when the interrupt handling has finished */
+	struct completion done;
 };
 
 /* module parameters */
@@ -1006,6 +1698,18 @@ unsigned int tx_fifos;
 module_param(tx_fifos, uint, 0664);
 MODULE_PARM_DESC(tx_fifos,
 		 "Number of tx-fifos to configure\n");
+unsigned int tx_ring_depth;
+module_param(tx_ring_depth, uint, 0664);
+MODULE_PARM_DESC(tx_ring_depth,
+		 "Use a single tx-fifo with this many slots (power of 2, 2 to 32) as a ring instead of individual tx-fifos\n");
+unsigned int tx_queues;
+module_param(tx_queues, uint, 0444);
+MODULE_PARM_DESC(tx_queues,
+		 "Number of netdev tx queues (up to 8) - each gets its own tx ring\n");
+unsigned int tx_cyclic_depth;
+module_param(tx_cyclic_depth, uint, 0664);
+MODULE_PARM_DESC(tx_cyclic_depth,
+		 "Reserve a tx-fifo with this many slots (power of 2, 2 to 32) for the cyclic tx table, which is set up via debugfs - ignored without CONFIG_DEBUG_FS (default 0 - off)\n");
 unsigned int bw_sharing_log2bits;
 module_param(bw_sharing_log2bits, uint, 0664);
 MODULE_PARM_DESC(bw_sharing_log2bits,
@@ -1014,21 +1718,154 @@ bool three_shot;
 module_param(three_shot, bool, 0664);
 MODULE_PARM_DESC(three_shot,
 		 "Use 3 shots when one-shot is requested");
+unsigned int tx_retransmit_max;
+module_param(tx_retransmit_max, uint, 0664);
+MODULE_PARM_DESC(tx_retransmit_max,
+		 "Request frames aborted due to lost arbitration or errors again up to this many times (default 0 - off)\n");
+unsigned int tx_retransmit_deadline_us;
+module_param(tx_retransmit_deadline_us, uint, 0664);
+MODULE_PARM_DESC(tx_retransmit_deadline_us,
+		 "Request frames aborted due to lost arbitration or errors again until this long after the first abort (default 0 - off)\n");
+bool use_async_ist;
+module_param(use_async_ist, bool, 0664);
+MODULE_PARM_DESC(use_async_ist,
+		 "Use spi_async driven interrupt handling instead of the irq thread for the RX fast path");
+bool use_write_batching;
+module_param(use_write_batching, bool, 0664);
+MODULE_PARM_DESC(use_write_batching,
+		 "Merge the register writes of the interrupt handler into a single spi_message");
+bool use_spi_crc;
+module_param(use_spi_crc, bool, 0664);
+MODULE_PARM_DESC(use_spi_crc,
+		 "Use crc protected spi transfers - allows higher spi clock rates");
+unsigned int spi_crc_retries = 3;
+module_param(spi_crc_retries, uint, 0664);
+MODULE_PARM_DESC(spi_crc_retries,
+		 "Number of retries of a read with crc error (default 3, 0 - no retries)\n");
+bool use_spi_calibration;
+module_param(use_spi_calibration, bool, 0664);
+MODULE_PARM_DESC(use_spi_calibration,
+		 "Calibrate the spi clock rate per device during probe");
+bool use_status_gather;
+module_param(use_status_gather, bool, 0664);
+MODULE_PARM_DESC(use_status_gather,
+		 "Read the register blocks needed by the irq handler in one spi_message");
+bool use_tx_batching;
+module_param(use_tx_batching, bool, 0664);
+MODULE_PARM_DESC(use_tx_batching,
+		 "Send frames the stack submits in a burst (xmit_more) in one spi_message");
+bool use_zero_copy_tx;
+module_param(use_zero_copy_tx, bool, 0664);
+MODULE_PARM_DESC(use_zero_copy_tx,
+		 "Send the tx payload straight from the skb instead of copying it");
+bool use_timestamp_resync = true;
+module_param(use_timestamp_resync, bool, 0664);
+MODULE_PARM_DESC(use_timestamp_resync,
+		 "Keep the hardware time stamps in sync with the host clock unless the PHC gets adjusted (default on)");
+unsigned int tx_launch_lead_us;
+module_param(tx_launch_lead_us, uint, 0664);
+MODULE_PARM_DESC(tx_launch_lead_us,
+		 "Send the trigger of frames with a launch time that much earlier to cover the spi latency (default 0us)\n");
+bool use_spi_bus_lock;
+module_param(use_spi_bus_lock, bool, 0664);
+MODULE_PARM_DESC(use_spi_bus_lock,
+		 "Lock the spi bus for other devices while the irq thread runs");
+unsigned int spi_bus_lock_budget_us;
+module_param(spi_bus_lock_budget_us, uint, 0664);
+MODULE_PARM_DESC(spi_bus_lock_budget_us,
+		 "Maximum time the spi bus stays locked in one go (default 500us)\n");
+unsigned int spi_bus_lock_budget_bytes;
+module_param(spi_bus_lock_budget_bytes, uint, 0664);
+MODULE_PARM_DESC(spi_bus_lock_budget_bytes,
+		 "Maximum bytes transferred with the spi bus locked in one go (default 4096)\n");
 
 /* spi sync helper */
 
+/* the irq thread may hold the spi bus lock - see mcp25xxfd_bus_lock */
+#define MCP25XXFD_BUS_LOCK_BUDGET_US	500
+#define MCP25XXFD_BUS_LOCK_BUDGET_BYTES	4096
+
+/* wrapper arround spi_sync, that uses spi_sync_locked while the irq
+ * thread holds the spi bus lock
+ */
+static int mcp25xxfd_spi_sync(struct spi_device *spi,
+			      struct spi_message *msg)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	int ret;
+
+	if (!priv->bus_lock.locked || current != priv->spi_ist_task)
+		return spi_sync(spi, msg);
+
+	ret = spi_sync_locked(spi, msg);
+	priv->bus_lock.bytes += msg->actual_length;
+
+	return ret;
+}
+
 /* wrapper arround spi_sync, that sets speed_hz */
 static int mcp25xxfd_sync_transfer(struct spi_device *spi,
 				   struct spi_transfer *xfer,
 				   unsigned int xfers,
 				   int speed_hz)
 {
+	struct spi_message msg;
 	int i;
 
 	for (i = 0; i < xfers; i++)
 		xfer[i].speed_hz = speed_hz;
 
-	return spi_sync_transfer(spi, xfer, xfers);
+	spi_message_init_with_transfers(&msg, xfer, xfers);
+
+	return mcp25xxfd_spi_sync(spi, &msg);
+}
+
+/* get the spi buffer of the current execution context */
+static struct mcp25xxfd_spi_buffer *
+mcp25xxfd_spi_buffer_get(struct mcp25xxfd_priv *priv)
+{
+	enum mcp25xxfd_spi_ctx ctx;
+
+	/* the irq thread is the only user of its buffer */
+	if (current == priv->spi_ist_task) {
+		priv->stats.spi_buffer_uses[MCP25XXFD_SPI_CTX_IRQ]++;
+		return &priv->spi_buffers[MCP25XXFD_SPI_CTX_IRQ];
+	}
+
+	if (current == priv->spi_debug_task)
+		ctx = MCP25XXFD_SPI_CTX_DEBUG;
+	else
+		ctx = MCP25XXFD_SPI_CTX_CONFIG;
+
+	if (!mutex_trylock(&priv->spi_buffers[ctx].lock)) {
+		priv->stats.spi_buffer_waits[ctx]++;
+		mutex_lock(&priv->spi_buffers[ctx].lock);
+	}
+	priv->stats.spi_buffer_uses[ctx]++;
+
+	return &priv->spi_buffers[ctx];
+}
+
+static void mcp25xxfd_spi_buffer_put(struct mcp25xxfd_priv *priv,
+				     struct mcp25xxfd_spi_buffer *buf)
+{
+	if (buf != &priv->spi_buffers[MCP25XXFD_SPI_CTX_IRQ])
+		mutex_unlock(&buf->lock);
+}
+
+/* mark the current task as a debugfs/gpio user, so that its
+ * transfers use the debug buffer
+ */
+static void mcp25xxfd_spi_debug_enter(struct mcp25xxfd_priv *priv)
+{
+	mutex_lock(&priv->spi_debug_lock);
+	priv->spi_debug_task = current;
+}
+
+static void mcp25xxfd_spi_debug_exit(struct mcp25xxfd_priv *priv)
+{
+	priv->spi_debug_task = NULL;
+	mutex_unlock(&priv->spi_debug_lock);
 }
 
 /* an optimization of spi_write_then_read that merges the transfers */
@@ -1040,6 +1877,7 @@ static int mcp25xxfd_write_then_read(struct spi_device *spi,
 				     int speed_hz)
 {
 	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct mcp25xxfd_spi_buffer *buf = NULL;
 	struct spi_transfer xfer[2];
 	u8 single_reg_data_tx[6];
 	u8 single_reg_data_rx[6];
@@ -1049,7 +1887,7 @@ static int mcp25xxfd_write_then_read(struct spi_device *spi,
 
 	/* when using a halfduplex controller or to big for buffer */
 	if ((spi->master->flags & SPI_MASTER_HALF_DUPLEX) ||
-	    (tx_len + rx_len > sizeof(priv->spi_tx))) {
+	    (tx_len + rx_len > MCP25XXFD_BUFFER_TXRX_SIZE)) {
 		xfer[0].tx_buf = tx_buf;
 		xfer[0].len = tx_len;
 
@@ -1062,9 +1900,9 @@ static int mcp25xxfd_write_then_read(struct spi_device *spi,
 	/* full duplex optimization */
 	xfer[0].len = tx_len + rx_len;
 	if (xfer[0].len > sizeof(single_reg_data_tx)) {
-		mutex_lock(&priv->spi_rxtx_lock);
-		xfer[0].tx_buf = priv->spi_tx;
-		xfer[0].rx_buf = priv->spi_rx;
+		buf = mcp25xxfd_spi_buffer_get(priv);
+		xfer[0].tx_buf = buf->tx;
+		xfer[0].rx_buf = buf->rx;
 	} else {
 		xfer[0].tx_buf = single_reg_data_tx;
 		xfer[0].rx_buf = single_reg_data_rx;
@@ -1078,8 +1916,8 @@ static int mcp25xxfd_write_then_read(struct spi_device *spi,
 	if (!ret)
 		memcpy(rx_buf, xfer[0].rx_buf + tx_len, rx_len);
 
-	if (xfer[0].len > sizeof(single_reg_data_tx))
-		mutex_unlock(&priv->spi_rxtx_lock);
+	if (buf)
+		mcp25xxfd_spi_buffer_put(priv, buf);
 
 	return ret;
 }
@@ -1108,6 +1946,7 @@ static int mcp25xxfd_write_then_write(struct spi_device *spi,
 				      int speed_hz)
 {
 	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct mcp25xxfd_spi_buffer *buf = NULL;
 	struct spi_transfer xfer;
 	u8 single_reg_data[6];
 	int ret;
@@ -1119,8 +1958,8 @@ static int mcp25xxfd_write_then_write(struct spi_device *spi,
 
 	xfer.len = tx_len + tx2_len;
 	if (xfer.len > sizeof(single_reg_data)) {
-		mutex_lock(&priv->spi_rxtx_lock);
-		xfer.tx_buf = priv->spi_tx;
+		buf = mcp25xxfd_spi_buffer_get(priv);
+		xfer.tx_buf = buf->tx;
 	} else {
 		xfer.tx_buf = single_reg_data;
 	}
@@ -1130,8 +1969,8 @@ static int mcp25xxfd_write_then_write(struct spi_device *spi,
 
 	ret = mcp25xxfd_sync_transfer(spi, &xfer, 1, speed_hz);
 
-	if (xfer.len > sizeof(single_reg_data))
-		mutex_unlock(&priv->spi_rxtx_lock);
+	if (buf)
+		mcp25xxfd_spi_buffer_put(priv, buf);
 
 	return ret;
 }
@@ -1146,101 +1985,614 @@ static void mcp25xxfd_calc_cmd_addr(u16 cmd, u16 addr, u8 *data)
 	data[1] = (cmd >> 0) & 0xff;
 }
 
-static int mcp25xxfd_cmd_reset(struct spi_device *spi, u32 speed_hz)
+/* crc protected spi transfers
+ *
+ * READ_CRC:   cmd(2) + length(1) + data(n) + crc(2)
+ * WRITE_CRC:  cmd(2) + length(1) + data(n) + crc(2)
+ * WRITE_SAFE: cmd(2) + data(1) + crc(2)
+ *
+ * the length is in bytes for SFRs and in 32-bit words for the RAM.
+ * the crc is CRC-16 with polynomial 0x8005 and initial value 0xffff
+ * (not reflected, no final xor - this is the USB polynomial, but not
+ * the CRC-16/USB variant) over all the bytes before it and is
+ * transmitted msb first.
+ *
+ * WRITE_CRC executes the write even on a crc mismatch, so writes of a
+ * single byte (which are the majority in the irq handler) use
+ * WRITE_SAFE, which only executes the write when the crc matches.
+ * in both cases the controller flags the crc error via SPICRCIF.
+ */
+#define MCP25XXFD_SPI_CRC_MAX_SFR_LEN	255
+#define MCP25XXFD_SPI_CRC_MAX_RAM_LEN	(255 * 4)
+
+static const u16 mcp25xxfd_crc16_table[256] = {
+	0x0000, 0x8005, 0x800f, 0x000a, 0x801b, 0x001e, 0x0014, 0x8011,
+	0x8033, 0x0036, 0x003c, 0x8039, 0x0028, 0x802d, 0x8027, 0x0022,
+	0x8063, 0x0066, 0x006c, 0x8069, 0x0078, 0x807d, 0x8077, 0x0072,
+	0x0050, 0x8055, 0x805f, 0x005a, 0x804b, 0x004e, 0x0044, 0x8041,
+	0x80c3, 0x00c6, 0x00cc, 0x80c9, 0x00d8, 0x80dd, 0x80d7, 0x00d2,
+	0x00f0, 0x80f5, 0x80ff, 0x00fa, 0x80eb, 0x00ee, 0x00e4, 0x80e1,
+	0x00a0, 0x80a5, 0x80af, 0x00aa, 0x80bb, 0x00be, 0x00b4, 0x80b1,
+	0x8093, 0x0096, 0x009c, 0x8099, 0x0088, 0x808d, 0x8087, 0x0082,
+	0x8183, 0x0186, 0x018c, 0x8189, 0x0198, 0x819d, 0x8197, 0x0192,
+	0x01b0, 0x81b5, 0x81bf, 0x01ba, 0x81ab, 0x01ae, 0x01a4, 0x81a1,
+	0x01e0, 0x81e5, 0x81ef, 0x01ea, 0x81fb, 0x01fe, 0x01f4, 0x81f1,
+	0x81d3, 0x01d6, 0x01dc, 0x81d9, 0x01c8, 0x81cd, 0x81c7, 0x01c2,
+	0x0140, 0x8145, 0x814f, 0x014a, 0x815b, 0x015e, 0x0154, 0x8151,
+	0x8173, 0x0176, 0x017c, 0x8179, 0x0168, 0x816d, 0x8167, 0x0162,
+	0x8123, 0x0126, 0x012c, 0x8129, 0x0138, 0x813d, 0x8137, 0x0132,
+	0x0110, 0x8115, 0x811f, 0x011a, 0x810b, 0x010e, 0x0104, 0x8101,
+	0x8303, 0x0306, 0x030c, 0x8309, 0x0318, 0x831d, 0x8317, 0x0312,
+	0x0330, 0x8335, 0x833f, 0x033a, 0x832b, 0x032e, 0x0324, 0x8321,
+	0x0360, 0x8365, 0x836f, 0x036a, 0x837b, 0x037e, 0x0374, 0x8371,
+	0x8353, 0x0356, 0x035c, 0x8359, 0x0348, 0x834d, 0x8347, 0x0342,
+	0x03c0, 0x83c5, 0x83cf, 0x03ca, 0x83db, 0x03de, 0x03d4, 0x83d1,
+	0x83f3, 0x03f6, 0x03fc, 0x83f9, 0x03e8, 0x83ed, 0x83e7, 0x03e2,
+	0x83a3, 0x03a6, 0x03ac, 0x83a9, 0x03b8, 0x83bd, 0x83b7, 0x03b2,
+	0x0390, 0x8395, 0x839f, 0x039a, 0x838b, 0x038e, 0x0384, 0x8381,
+	0x0280, 0x8285, 0x828f, 0x028a, 0x829b, 0x029e, 0x0294, 0x8291,
+	0x82b3, 0x02b6, 0x02bc, 0x82b9, 0x02a8, 0x82ad, 0x82a7, 0x02a2,
+	0x82e3, 0x02e6, 0x02ec, 0x82e9, 0x02f8, 0x82fd, 0x82f7, 0x02f2,
+	0x02d0, 0x82d5, 0x82df, 0x02da, 0x82cb, 0x02ce, 0x02c4, 0x82c1,
+	0x8243, 0x0246, 0x024c, 0x8249, 0x0258, 0x825d, 0x8257, 0x0252,
+	0x0270, 0x8275, 0x827f, 0x027a, 0x826b, 0x026e, 0x0264, 0x8261,
+	0x0220, 0x8225, 0x822f, 0x022a, 0x823b, 0x023e, 0x0234, 0x8231,
+	0x8213, 0x0216, 0x021c, 0x8219, 0x0208, 0x820d, 0x8207, 0x0202,
+};
+
+static u16 mcp25xxfd_crc16(u16 crc, const u8 *data, int len)
 {
-	u8 cmd[2];
+	while (len--)
+		crc = (crc << 8) ^ mcp25xxfd_crc16_table[(crc >> 8) ^ *data++];
 
-	mcp25xxfd_calc_cmd_addr(INSTRUCTION_RESET, 0, cmd);
+	return crc;
+}
 
-	/* write the reset command */
-	return mcp25xxfd_write(spi, cmd, 2, speed_hz);
+static bool mcp25xxfd_is_ram(u32 reg)
+{
+	return (reg >= FIFO_DATA(0)) && (reg < FIFO_DATA(FIFO_DATA_SIZE));
 }
 
-/* read multiple bytes, transform some registers */
-static int mcp25xxfd_cmd_readn(struct spi_device *spi, u32 reg,
-			       void *data, int n, u32 speed_hz)
+/* the length field of the crc commands */
+static u8 mcp25xxfd_crc_len(u32 reg, int len)
 {
-	u8 cmd[2];
-	int ret;
+	return mcp25xxfd_is_ram(reg) ? len / 4 : len;
+}
 
-	mcp25xxfd_calc_cmd_addr(INSTRUCTION_READ, reg, cmd);
+static int mcp25xxfd_crc_retries(void)
+{
+	return spi_crc_retries;
+}
 
-	ret = mcp25xxfd_write_then_read(spi, &cmd, 2, data, n, speed_hz);
-	if (ret)
-		return ret;
+/* account for a crc error on read */
+static void mcp25xxfd_crc_error(struct mcp25xxfd_priv *priv, u32 reg)
+{
+	if (mcp25xxfd_is_ram(reg))
+		priv->stats.spi_crc_err_ram++;
+	else
+		priv->stats.spi_crc_err_sfr++;
+}
 
-	return 0;
+/* check the crc of a READ_CRC - cmd includes the length byte */
+static bool mcp25xxfd_crc_check(const u8 *cmd, const u8 *data, int len,
+				const u8 *crc_rx)
+{
+	u16 crc = mcp25xxfd_crc16(0xffff, cmd, 3);
+
+	crc = mcp25xxfd_crc16(crc, data, len);
+
+	return crc == ((crc_rx[0] << 8) | crc_rx[1]);
 }
 
-static int mcp25xxfd_convert_to_cpu(u32 *data, int n)
+/* append the crc to a WRITE_CRC or WRITE_SAFE */
+static int mcp25xxfd_crc_append(u8 *tx, int len)
 {
-	int i;
+	u16 crc = mcp25xxfd_crc16(0xffff, tx, len);
 
-	for (i = 0; i < n; i++)
-		data[i] = le32_to_cpu(data[i]);
+	tx[len] = crc >> 8;
+	tx[len + 1] = crc & 0xff;
 
-	return 0;
+	return len + 2;
 }
 
-static int mcp25xxfd_first_byte(u32 mask)
+/* the offset of the data in the rx buffer of a read message */
+static u8 *mcp25xxfd_read_message_data(struct mcp25xxfd_read_message *rm)
 {
-	return (mask & 0x0000ffff) ?
-		((mask & 0x000000ff) ? 0 : 1) :
-		((mask & 0x00ff0000) ? 2 : 3);
+	return rm->rx + (rm->crc ? 3 : 2);
 }
 
-static int mcp25xxfd_last_byte(u32 mask)
+/* set the register a prepared read message reads from */
+static void mcp25xxfd_read_message_set_reg(struct mcp25xxfd_read_message *rm,
+					   u32 reg)
 {
-	return (mask & 0xffff0000) ?
-		((mask & 0xff000000) ? 3 : 2) :
-		((mask & 0x0000ff00) ? 1 : 0);
+	rm->reg = reg;
+	if (rm->crc) {
+		mcp25xxfd_calc_cmd_addr(INSTRUCTION_READ_CRC, reg, rm->tx);
+		rm->tx[2] = mcp25xxfd_crc_len(reg, rm->len);
+	} else {
+		mcp25xxfd_calc_cmd_addr(INSTRUCTION_READ, reg, rm->tx);
+	}
 }
 
-/* read a register, but we are only interrested in a few bytes */
-static int mcp25xxfd_cmd_read_mask(struct spi_device *spi, u32 reg,
-				   u32 *data, u32 mask, u32 speed_hz)
+static bool mcp25xxfd_read_message_crc_ok(struct mcp25xxfd_read_message *rm)
 {
-	int first_byte, last_byte, len_byte;
-	int ret;
+	if (!rm->crc)
+		return true;
 
-	/* check that at least one bit is set */
-	if (!mask)
-		return -EINVAL;
+	return mcp25xxfd_crc_check(rm->tx, rm->rx + 3, rm->len,
+				   rm->rx + 3 + rm->len);
+}
 
-	/* calculate first and last byte used */
-	first_byte = mcp25xxfd_first_byte(mask);
-	last_byte = mcp25xxfd_last_byte(mask);
-	len_byte = last_byte - first_byte + 1;
+/* prepare a reusable spi_message that reads len bytes starting at reg,
+ * the data read is found at mcp25xxfd_read_message_data
+ * - with crc reads from RAM get extended to a multiple of 4 bytes
+ */
+static void mcp25xxfd_init_read_message(struct spi_device *spi,
+					struct mcp25xxfd_read_message *rm,
+					u32 reg, int len, u32 speed_hz)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	int cmd_len;
+
+	memset(rm->xfer, 0, sizeof(rm->xfer));
+	memset(rm->tx, 0, sizeof(rm->tx));
+	spi_message_init(&rm->msg);
+
+	rm->crc = priv->spi_crc;
+	rm->len = (rm->crc && mcp25xxfd_is_ram(reg)) ? ALIGN(len, 4) : len;
+	mcp25xxfd_read_message_set_reg(rm, reg);
+
+	/* the crc trails the data */
+	cmd_len = rm->crc ? 3 : 2;
+	len = rm->crc ? rm->len + 2 : rm->len;
+
+	if (spi->master->flags & SPI_MASTER_HALF_DUPLEX) {
+		rm->xfer[0].tx_buf = rm->tx;
+		rm->xfer[0].len = cmd_len;
+		rm->xfer[0].speed_hz = speed_hz;
+		spi_message_add_tail(&rm->xfer[0], &rm->msg);
+		rm->xfer[1].rx_buf = rm->rx + cmd_len;
+		rm->xfer[1].len = len;
+		rm->xfer[1].speed_hz = speed_hz;
+		spi_message_add_tail(&rm->xfer[1], &rm->msg);
+	} else {
+		/* full duplex optimization */
+		rm->xfer[0].tx_buf = rm->tx;
+		rm->xfer[0].rx_buf = rm->rx;
+		rm->xfer[0].len = cmd_len + len;
+		rm->xfer[0].speed_hz = speed_hz;
+		spi_message_add_tail(&rm->xfer[0], &rm->msg);
+	}
+}
 
-	/* do a partial read */
-	*data = 0;
-	ret = mcp25xxfd_cmd_readn(spi, reg + first_byte,
-				  ((void *)data + first_byte), len_byte,
-				  speed_hz);
-	if (ret)
-		return ret;
+/* run a prepared read message with retries on crc errors */
+static int mcp25xxfd_sync_read_message(struct spi_device *spi,
+				       struct mcp25xxfd_read_message *rm)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	int retries = mcp25xxfd_crc_retries();
+	int ret;
 
-	return mcp25xxfd_convert_to_cpu(data, 1);
+	while (1) {
+		ret = mcp25xxfd_spi_sync(spi, &rm->msg);
+		if (ret)
+			return ret;
+		if (mcp25xxfd_read_message_crc_ok(rm))
+			return 0;
+
+		mcp25xxfd_crc_error(priv, rm->reg);
+		if (!retries--) {
+			priv->stats.spi_crc_err_exhausted++;
+			return -EBADMSG;
+		}
+	}
 }
 
-static int mcp25xxfd_cmd_read(struct spi_device *spi, u32 reg, u32 *data,
-			      u32 speed_hz)
+/* start an empty gather message */
+static void mcp25xxfd_init_gather_message(struct spi_device *spi,
+					  struct mcp25xxfd_gather_message *gm,
+					  u32 speed_hz)
 {
-	return mcp25xxfd_cmd_read_mask(spi, reg, data, -1, speed_hz);
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+
+	spi_message_init(&gm->msg);
+	gm->count = 0;
+	gm->xfers = 0;
+	gm->size = 0;
+	gm->speed_hz = speed_hz;
+	gm->crc = priv->spi_crc;
 }
 
-/* read a register, but we are only interrested in a few bytes */
-static int mcp25xxfd_cmd_write_mask(struct spi_device *spi, u32 reg,
-				    u32 data, u32 mask, u32 speed_hz)
+static struct spi_transfer *
+mcp25xxfd_gather_add_xfer(struct mcp25xxfd_gather_message *gm)
 {
-	int first_byte, last_byte, len_byte;
-	u8 cmd[2];
+	struct spi_transfer *xfer = &gm->xfer[gm->xfers++];
 
-	/* check that at least one bit is set */
-	if (!mask)
-		return -EINVAL;
+	memset(xfer, 0, sizeof(*xfer));
+	xfer->speed_hz = gm->speed_hz;
+	spi_message_add_tail(xfer, &gm->msg);
 
-	/* calculate first and last byte used */
+	return xfer;
+}
+
+/* add a read of len bytes starting at reg to the gather message
+ * returns the index of the segment for mcp25xxfd_gather_message_data
+ */
+static int mcp25xxfd_gather_message_add(struct spi_device *spi,
+					struct mcp25xxfd_gather_message *gm,
+					u32 reg, int len)
+{
+	struct spi_transfer *xfer;
+	int cmd_len = gm->crc ? 3 : 2;
+	int data_len, offset;
+	u8 *tx;
+
+	/* with crc reads from RAM need to be a multiple of 4 */
+	if (gm->crc && mcp25xxfd_is_ram(reg))
+		len = ALIGN(len, 4);
+	data_len = gm->crc ? len + 2 : len;
+
+	if (gm->count >= MCP25XXFD_GATHER_SEGMENTS ||
+	    gm->size + cmd_len + data_len > MCP25XXFD_GATHER_SIZE)
+		return -ENOSPC;
+
+	/* the chip select has to toggle before the next command */
+	if (gm->xfers)
+		gm->xfer[gm->xfers - 1].cs_change = 1;
+
+	offset = gm->size;
+	tx = gm->tx + offset;
+	memset(tx, 0, cmd_len + data_len);
+	if (gm->crc) {
+		mcp25xxfd_calc_cmd_addr(INSTRUCTION_READ_CRC, reg, tx);
+		tx[2] = mcp25xxfd_crc_len(reg, len);
+	} else {
+		mcp25xxfd_calc_cmd_addr(INSTRUCTION_READ, reg, tx);
+	}
+
+	if (spi->master->flags & SPI_MASTER_HALF_DUPLEX) {
+		xfer = mcp25xxfd_gather_add_xfer(gm);
+		xfer->tx_buf = tx;
+		xfer->len = cmd_len;
+		xfer = mcp25xxfd_gather_add_xfer(gm);
+		xfer->rx_buf = gm->rx + offset + cmd_len;
+		xfer->len = data_len;
+	} else {
+		/* full duplex optimization */
+		xfer = mcp25xxfd_gather_add_xfer(gm);
+		xfer->tx_buf = tx;
+		xfer->rx_buf = gm->rx + offset;
+		xfer->len = cmd_len + data_len;
+	}
+
+	gm->seg[gm->count].reg = reg;
+	gm->seg[gm->count].len = len;
+	gm->seg[gm->count].offset = offset;
+	gm->size += cmd_len + data_len;
+
+	return gm->count++;
+}
+
+/* the data of a segment of the gather message */
+static u8 *mcp25xxfd_gather_message_data(struct mcp25xxfd_gather_message *gm,
+					 int i)
+{
+	return gm->rx + gm->seg[i].offset + (gm->crc ? 3 : 2);
+}
+
+/* run a gather message with retries on crc errors */
+static int mcp25xxfd_sync_gather_message(struct spi_device *spi,
+					 struct mcp25xxfd_gather_message *gm)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	int retries = mcp25xxfd_crc_retries();
+	int i, len, offset;
+	int ret;
+
+	while (1) {
+		ret = mcp25xxfd_spi_sync(spi, &gm->msg);
+		if (ret || !gm->crc)
+			return ret;
+
+		for (i = 0; i < gm->count; i++) {
+			offset = gm->seg[i].offset;
+			len = gm->seg[i].len;
+			if (!mcp25xxfd_crc_check(gm->tx + offset,
+						 gm->rx + offset + 3, len,
+						 gm->rx + offset + 3 + len)) {
+				mcp25xxfd_crc_error(priv, gm->seg[i].reg);
+				break;
+			}
+		}
+		if (i == gm->count)
+			return 0;
+
+		if (!retries--) {
+			priv->stats.spi_crc_err_exhausted++;
+			return -EBADMSG;
+		}
+	}
+}
+
+static int mcp25xxfd_cmd_reset(struct spi_device *spi, u32 speed_hz)
+{
+	u8 cmd[2];
+
+	mcp25xxfd_calc_cmd_addr(INSTRUCTION_RESET, 0, cmd);
+
+	/* write the reset command */
+	return mcp25xxfd_write(spi, cmd, 2, speed_hz);
+}
+
+/* a single READ_CRC into the spi buffer of the current context */
+static int mcp25xxfd_cmd_readn_crc_single(struct spi_device *spi, u32 reg,
+					  void *data, int n, u32 speed_hz)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct mcp25xxfd_spi_buffer *buf;
+	struct spi_transfer xfer[2];
+	/* reads from RAM need to be a multiple of 4 */
+	int len = mcp25xxfd_is_ram(reg) ? ALIGN(n, 4) : n;
+	int ret;
+
+	memset(xfer, 0, sizeof(xfer));
+
+	buf = mcp25xxfd_spi_buffer_get(priv);
+
+	mcp25xxfd_calc_cmd_addr(INSTRUCTION_READ_CRC, reg, buf->tx);
+	buf->tx[2] = mcp25xxfd_crc_len(reg, len);
+
+	if (spi->master->flags & SPI_MASTER_HALF_DUPLEX) {
+		xfer[0].tx_buf = buf->tx;
+		xfer[0].len = 3;
+		xfer[1].rx_buf = buf->rx + 3;
+		xfer[1].len = len + 2;
+		ret = mcp25xxfd_sync_transfer(spi, xfer, 2, speed_hz);
+	} else {
+		/* full duplex optimization */
+		memset(buf->tx + 3, 0, len + 2);
+		xfer[0].tx_buf = buf->tx;
+		xfer[0].rx_buf = buf->rx;
+		xfer[0].len = 3 + len + 2;
+		ret = mcp25xxfd_sync_transfer(spi, xfer, 1, speed_hz);
+	}
+
+	if (!ret) {
+		if (mcp25xxfd_crc_check(buf->tx, buf->rx + 3, len,
+					buf->rx + 3 + len))
+			memcpy(data, buf->rx + 3, n);
+		else
+			ret = -EBADMSG;
+	}
+
+	mcp25xxfd_spi_buffer_put(priv, buf);
+
+	return ret;
+}
+
+/* read multiple bytes with crc protection - splitting into chunks
+ * the length field can express and retrying on crc errors
+ */
+static int mcp25xxfd_cmd_readn_crc(struct spi_device *spi, u32 reg,
+				   void *data, int n, u32 speed_hz)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	int max = mcp25xxfd_is_ram(reg) ?
+		MCP25XXFD_SPI_CRC_MAX_RAM_LEN : MCP25XXFD_SPI_CRC_MAX_SFR_LEN;
+	int retries, len;
+	int ret;
+
+	for (; n > 0; n -= len, reg += len, data += len) {
+		len = min(n, max);
+		retries = mcp25xxfd_crc_retries();
+		while (1) {
+			ret = mcp25xxfd_cmd_readn_crc_single(spi, reg, data,
+							     len, speed_hz);
+			if (ret != -EBADMSG)
+				break;
+			mcp25xxfd_crc_error(priv, reg);
+			if (!retries--) {
+				priv->stats.spi_crc_err_exhausted++;
+				break;
+			}
+		}
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* read multiple bytes, transform some registers */
+static int mcp25xxfd_cmd_readn(struct spi_device *spi, u32 reg,
+			       void *data, int n, u32 speed_hz)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	u8 cmd[2];
+	int ret;
+
+	if (priv->spi_crc)
+		return mcp25xxfd_cmd_readn_crc(spi, reg, data, n, speed_hz);
+
+	mcp25xxfd_calc_cmd_addr(INSTRUCTION_READ, reg, cmd);
+
+	ret = mcp25xxfd_write_then_read(spi, &cmd, 2, data, n, speed_hz);
+	if (ret)
+		return ret;
+
+	return 0;
+}
+
+/* read fifo SRAM straight into the fifo memory image:
+ * the command goes out in a transfer of its own, so the data lands
+ * directly in the (cacheline aligned) image without a bounce buffer
+ * and without a memcpy.
+ * this is only used from the irq handler.
+ */
+static int mcp25xxfd_read_fifo_image(struct spi_device *spi, u32 addr,
+				     int len, u32 speed_hz)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct spi_transfer xfer[2];
+
+	/* crc uses the normal path */
+	if (priv->spi_crc)
+		return mcp25xxfd_cmd_readn(spi, FIFO_DATA(addr),
+					   priv->fifos.fifo_data + addr,
+					   len, speed_hz);
+
+	memset(xfer, 0, sizeof(xfer));
+	mcp25xxfd_calc_cmd_addr(INSTRUCTION_READ, FIFO_DATA(addr),
+				priv->spi_fifo_cmd);
+
+	xfer[0].tx_buf = priv->spi_fifo_cmd;
+	xfer[0].len = 2;
+	xfer[1].rx_buf = priv->fifos.fifo_data + addr;
+	xfer[1].len = len;
+
+	return mcp25xxfd_sync_transfer(spi, xfer, 2, speed_hz);
+}
+
+static int mcp25xxfd_convert_to_cpu(u32 *data, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		data[i] = le32_to_cpu(data[i]);
+
+	return 0;
+}
+
+static int mcp25xxfd_first_byte(u32 mask)
+{
+	return (mask & 0x0000ffff) ?
+		((mask & 0x000000ff) ? 0 : 1) :
+		((mask & 0x00ff0000) ? 2 : 3);
+}
+
+static int mcp25xxfd_last_byte(u32 mask)
+{
+	return (mask & 0xffff0000) ?
+		((mask & 0xff000000) ? 3 : 2) :
+		((mask & 0x0000ff00) ? 1 : 0);
+}
+
+/* format the spi command for a write of the bytes of reg covered by mask
+ * into tx (of MCP25XXFD_WRITE_MAX_SIZE) and return its length
+ */
+static int mcp25xxfd_format_write_mask(u8 *tx, u32 reg, u32 data, u32 mask,
+				       bool crc)
+{
+	int first_byte = mcp25xxfd_first_byte(mask);
+	int len_byte = mcp25xxfd_last_byte(mask) - first_byte + 1;
+	int pos = 2;
+
+	if (!crc)
+		mcp25xxfd_calc_cmd_addr(INSTRUCTION_WRITE, reg + first_byte,
+					tx);
+	else if (len_byte == 1)
+		mcp25xxfd_calc_cmd_addr(INSTRUCTION_WRITE_SAVE,
+					reg + first_byte, tx);
+	else {
+		mcp25xxfd_calc_cmd_addr(INSTRUCTION_WRITE_CRC,
+					reg + first_byte, tx);
+		tx[pos++] = len_byte;
+	}
+
+	data = cpu_to_le32(data);
+	memcpy(tx + pos, (u8 *)&data + first_byte, len_byte);
+	pos += len_byte;
+
+	return crc ? mcp25xxfd_crc_append(tx, pos) : pos;
+}
+
+/* set the data to write with a prepared write message */
+static void mcp25xxfd_write_message_set(struct mcp25xxfd_write_message *wm,
+					u32 data)
+{
+	wm->xfer.len = mcp25xxfd_format_write_mask(wm->tx, wm->reg, data,
+						   wm->mask, wm->crc);
+}
+
+/* prepare a reusable spi_message that writes the bytes of reg
+ * covered by mask
+ */
+static void mcp25xxfd_init_write_message(struct spi_device *spi,
+					 struct mcp25xxfd_write_message *wm,
+					 u32 reg, u32 data, u32 mask,
+					 u32 speed_hz)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+
+	memset(&wm->xfer, 0, sizeof(wm->xfer));
+	spi_message_init(&wm->msg);
+
+	wm->reg = reg;
+	wm->mask = mask;
+	wm->crc = priv->spi_crc;
+
+	wm->xfer.tx_buf = wm->tx;
+	wm->xfer.speed_hz = speed_hz;
+	spi_message_add_tail(&wm->xfer, &wm->msg);
+
+	mcp25xxfd_write_message_set(wm, data);
+}
+
+/* read a register, but we are only interrested in a few bytes */
+static int mcp25xxfd_cmd_read_mask(struct spi_device *spi, u32 reg,
+				   u32 *data, u32 mask, u32 speed_hz)
+{
+	int first_byte, last_byte, len_byte;
+	int ret;
+
+	/* check that at least one bit is set */
+	if (!mask)
+		return -EINVAL;
+
+	/* calculate first and last byte used */
+	first_byte = mcp25xxfd_first_byte(mask);
+	last_byte = mcp25xxfd_last_byte(mask);
+	len_byte = last_byte - first_byte + 1;
+
+	/* do a partial read */
+	*data = 0;
+	ret = mcp25xxfd_cmd_readn(spi, reg + first_byte,
+				  ((void *)data + first_byte), len_byte,
+				  speed_hz);
+	if (ret)
+		return ret;
+
+	return mcp25xxfd_convert_to_cpu(data, 1);
+}
+
+static int mcp25xxfd_cmd_read(struct spi_device *spi, u32 reg, u32 *data,
+			      u32 speed_hz)
+{
+	return mcp25xxfd_cmd_read_mask(spi, reg, data, -1, speed_hz);
+}
+
+/* read a register, but we are only interrested in a few bytes */
+static int mcp25xxfd_cmd_write_mask(struct spi_device *spi, u32 reg,
+				    u32 data, u32 mask, u32 speed_hz)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	int first_byte, last_byte, len_byte;
+	u8 cmd[2];
+	u8 tx[MCP25XXFD_WRITE_MAX_SIZE];
+
+	/* check that at least one bit is set */
+	if (!mask)
+		return -EINVAL;
+
+	/* crc protected write */
+	if (priv->spi_crc)
+		return mcp25xxfd_write(spi, tx,
+				       mcp25xxfd_format_write_mask(tx, reg,
+								   data, mask,
+								   true),
+				       speed_hz);
+
+	/* calculate first and last byte used */
 	first_byte = mcp25xxfd_first_byte(mask);
 	last_byte = mcp25xxfd_last_byte(mask);
 	len_byte = last_byte - first_byte + 1;
@@ -1277,6 +2629,100 @@ static int mcp25xxfd_cmd_writen(struct spi_device *spi, u32 reg,
 	return 0;
 }
 
+/* write batching
+ *
+ * the irq handler issues a lot of small register writes (releasing
+ * fifos, clearing interrupt flags,...) whose order relative to each
+ * other does not matter as long as they happen before the next read
+ * of the state they modify.
+ * so these get queued and are submitted in a single spi_message of
+ * cs_change transfers when mcp25xxfd_batch_flush gets called.
+ */
+static int mcp25xxfd_batch_flush(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct mcp25xxfd_write_batch *batch = &priv->irq_templates->batch;
+	int ret;
+
+	if (!batch->count)
+		return 0;
+
+	/* no cs_change on the last transfer */
+	batch->xfer[batch->count - 1].cs_change = 0;
+
+	ret = mcp25xxfd_spi_sync(spi, &batch->msg);
+
+	priv->stats.write_batch_flushes++;
+	priv->stats.write_batch_merged += batch->count - 1;
+
+	batch->count = 0;
+	spi_message_init(&batch->msg);
+
+	return ret;
+}
+
+static int mcp25xxfd_batch_add(struct spi_device *spi,
+			       const u8 *tx, int len)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct mcp25xxfd_write_batch *batch = &priv->irq_templates->batch;
+	struct spi_transfer *xfer;
+	int ret;
+
+	/* flush if full */
+	if (batch->count == MCP25XXFD_WRITE_BATCH_SIZE) {
+		ret = mcp25xxfd_batch_flush(spi);
+		if (ret)
+			return ret;
+	}
+
+	xfer = &batch->xfer[batch->count];
+	memcpy(batch->tx[batch->count], tx, len);
+
+	memset(xfer, 0, sizeof(*xfer));
+	xfer->tx_buf = batch->tx[batch->count];
+	xfer->len = len;
+	xfer->speed_hz = priv->spi_speed_hz;
+	xfer->cs_change = 1;
+	spi_message_add_tail(xfer, &batch->msg);
+
+	batch->count++;
+	priv->stats.write_batch_writes++;
+
+	return 0;
+}
+
+/* queue a prepared write message */
+static int mcp25xxfd_batch_write_message(struct spi_device *spi,
+					 struct mcp25xxfd_write_message *wm)
+{
+	if (!use_write_batching)
+		return mcp25xxfd_spi_sync(spi, &wm->msg);
+
+	return mcp25xxfd_batch_add(spi, wm->tx, wm->xfer.len);
+}
+
+/* queue a masked register write */
+static int mcp25xxfd_batch_write_mask(struct spi_device *spi, u32 reg,
+				      u32 data, u32 mask)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	u8 tx[MCP25XXFD_WRITE_MAX_SIZE];
+
+	if (!use_write_batching)
+		return mcp25xxfd_cmd_write_mask(spi, reg, data, mask,
+						priv->spi_speed_hz);
+
+	/* check that at least one bit is set */
+	if (!mask)
+		return -EINVAL;
+
+	return mcp25xxfd_batch_add(spi, tx,
+				   mcp25xxfd_format_write_mask(tx, reg, data,
+							       mask,
+							       priv->spi_crc));
+}
+
 static int mcp25xxfd_clean_sram(struct spi_device *spi, u32 speed_hz)
 {
 	u8 buffer[256];
@@ -1550,9 +2996,11 @@ static int mcp25xxfd_gpio_get(struct gpio_chip *chip, unsigned int offset)
 		return -EINVAL;
 
 	/* read the relevant gpio Latch */
+	mcp25xxfd_spi_debug_enter(priv);
 	ret = mcp25xxfd_cmd_read_mask(priv->spi, MCP25XXFD_IOCON,
 				      &priv->regs.iocon, mask,
 				      priv->spi_setup_speed_hz);
+	mcp25xxfd_spi_debug_exit(priv);
 	if (ret)
 		return ret;
 
@@ -1576,9 +3024,11 @@ static void mcp25xxfd_gpio_set(struct gpio_chip *chip, unsigned int offset,
 	else
 		priv->regs.iocon &= ~mask;
 
+	mcp25xxfd_spi_debug_enter(priv);
 	mcp25xxfd_cmd_write_mask(priv->spi, MCP25XXFD_IOCON,
 				 priv->regs.iocon, mask,
 				 priv->spi_setup_speed_hz);
+	mcp25xxfd_spi_debug_exit(priv);
 }
 
 static int mcp25xxfd_gpio_direction_input(struct gpio_chip *chip,
@@ -1591,6 +3041,7 @@ static int mcp25xxfd_gpio_direction_input(struct gpio_chip *chip,
 		0 : MCP25XXFD_IOCON_XSTBYEN;
 	u32 mask_pm = (offset) ?
 		MCP25XXFD_IOCON_PM1 : MCP25XXFD_IOCON_PM0;
+	int ret;
 
 	/* only handle gpio 0/1 */
 	if (offset > 1)
@@ -1602,10 +3053,14 @@ static int mcp25xxfd_gpio_direction_input(struct gpio_chip *chip,
 	/* clear stby */
 	priv->regs.iocon &= ~mask_stby;
 
-	return mcp25xxfd_cmd_write_mask(priv->spi, MCP25XXFD_IOCON,
-					priv->regs.iocon,
-					mask_tri | mask_stby | mask_pm,
-					priv->spi_setup_speed_hz);
+	mcp25xxfd_spi_debug_enter(priv);
+	ret = mcp25xxfd_cmd_write_mask(priv->spi, MCP25XXFD_IOCON,
+				       priv->regs.iocon,
+				       mask_tri | mask_stby | mask_pm,
+				       priv->spi_setup_speed_hz);
+	mcp25xxfd_spi_debug_exit(priv);
+
+	return ret;
 }
 
 static int mcp25xxfd_gpio_direction_output(struct gpio_chip *chip,
@@ -1620,6 +3075,7 @@ static int mcp25xxfd_gpio_direction_output(struct gpio_chip *chip,
 		MCP25XXFD_IOCON_PM1 : MCP25XXFD_IOCON_PM0;
 	u32 mask_stby = (offset) ?
 		0 : MCP25XXFD_IOCON_XSTBYEN;
+	int ret;
 
 	/* only handle gpio 0/1 */
 	if (offset > 1)
@@ -1637,11 +3093,15 @@ static int mcp25xxfd_gpio_direction_output(struct gpio_chip *chip,
 	else
 		priv->regs.iocon &= ~mask_lat;
 
-	return mcp25xxfd_cmd_write_mask(priv->spi, MCP25XXFD_IOCON,
-					priv->regs.iocon,
-					mask_tri | mask_lat |
-					mask_pm | mask_stby,
-					priv->spi_setup_speed_hz);
+	mcp25xxfd_spi_debug_enter(priv);
+	ret = mcp25xxfd_cmd_write_mask(priv->spi, MCP25XXFD_IOCON,
+				       priv->regs.iocon,
+				       mask_tri | mask_lat |
+				       mask_pm | mask_stby,
+				       priv->spi_setup_speed_hz);
+	mcp25xxfd_spi_debug_exit(priv);
+
+	return ret;
 }
 
 static int mcp25xxfd_gpio_setup(struct spi_device *spi)
@@ -1729,13 +3189,44 @@ static void __mcp25xxfd_stop_queue(struct net_device *net,
 			 priv->tx_queue_status);
 
 	priv->tx_queue_status = id ? id : TX_QUEUE_STATUS_STOPPED;
-	netif_stop_queue(priv->net);
+	netif_tx_stop_all_queues(priv->net);
 }
 
 /* helper to identify who is stopping the queue by line number */
 #define mcp25xxfd_stop_queue(spi) \
 	__mcp25xxfd_stop_queue(spi, __LINE__)
 
+/* whether the queue is kept stopped by whoever wakes it again -
+ * the spi bus lock or the tx shaper
+ */
+static bool mcp25xxfd_tx_queue_held(struct mcp25xxfd_priv *priv, u16 queue)
+{
+	return test_bit(queue, &priv->bus_lock.tx_stopped) ||
+		(READ_ONCE(priv->tx_shaper.stopped) & BIT(queue));
+}
+
+/* spi_async failed while the irq thread of a device on the controller
+ * (this one or a sibling) holds the spi bus lock, so stop the queue until
+ * mcp25xxfd_bus_unlock instead of having the stack retry all the time -
+ * returns false if the lock is not held (any longer) and the queue keeps
+ * running
+ */
+static bool mcp25xxfd_bus_lock_stop_queue(struct mcp25xxfd_priv *priv,
+					  u16 queue)
+{
+	set_bit(queue, &priv->bus_lock.tx_stopped);
+	netif_stop_subqueue(priv->net, queue);
+
+	smp_mb__after_atomic();
+	if (READ_ONCE(priv->bus_lock.bus->locked))
+		return true;
+
+	if (test_and_clear_bit(queue, &priv->bus_lock.tx_stopped))
+		netif_start_subqueue(priv->net, queue);
+
+	return false;
+}
+
 static void mcp25xxfd_wake_queue(struct spi_device *spi)
 {
 	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
@@ -1747,7 +3238,8 @@ static void mcp25xxfd_wake_queue(struct spi_device *spi)
 	priv->tx_queue_status = TX_QUEUE_STATUS_RUNNING;
 
 	/* wake queue now */
-	netif_wake_queue(priv->net);
+	if (!mcp25xxfd_tx_queue_held(priv, 0))
+		netif_tx_wake_all_queues(priv->net);
 }
 
 /* CAN transmit related*/
@@ -1765,77 +3257,270 @@ static void mcp25xxfd_mark_tx_pending(void *context)
 	priv->fifos.tx_pending_mask |= BIT(txm->fifo);
 }
 
-static int mcp25xxfd_fill_spi_transmit_fifos(struct mcp25xxfd_priv *priv)
+static void mcp25xxfd_mark_tx_batch_pending(void *context)
 {
-	struct mcp25xxfd_trigger_tx_message *txm;
-	int i, fifo;
-	const u32 trigger = CAN_FIFOCON_TXREQ | CAN_FIFOCON_UINC;
-	const int first_byte = mcp25xxfd_first_byte(trigger);
-	u32 fifo_address;
+	struct mcp25xxfd_trigger_tx_message *txm = context;
+	struct spi_device *spi = txm->batch_msg.spi;
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
 
-	priv->spi_transmit_fifos = kcalloc(priv->fifos.tx_fifos,
-					   sizeof(*priv->spi_transmit_fifos),
-					   GFP_KERNEL | GFP_DMA);
-	if (!priv->spi_transmit_fifos)
-		return -ENOMEM;
+	priv->fifos.tx_pending_mask |= txm->batch_fifos;
+}
 
-	for (i = 0; i < priv->fifos.tx_fifos; i++) {
-		fifo = priv->fifos.tx_fifo_start + i;
-		txm = &priv->spi_transmit_fifos[i];
-		fifo_address = priv->fifos.fifo_address[fifo];
-		/* prepare the message */
-		spi_message_init(&txm->msg);
-		txm->msg.complete = mcp25xxfd_mark_tx_pending;
-		txm->msg.context = txm;
-		txm->fifo = fifo;
-		/* the payload itself */
-		txm->fill_xfer.speed_hz = priv->spi_speed_hz;
+/* the transfers of the spi_message sending the payload copied into
+ * the fill buffer
+ */
+static void mcp25xxfd_tx_message_link(struct mcp25xxfd_priv *priv,
+				      struct mcp25xxfd_trigger_tx_message *txm)
+{
+	spi_message_init(&txm->msg);
+	txm->msg.complete = mcp25xxfd_mark_tx_pending;
+	txm->msg.context = txm;
+	txm->zero_copy = false;
+
+	txm->fill_xfer.cs_change = !priv->spi_crc;
+	spi_message_add_tail(&txm->fill_xfer, &txm->msg);
+	if (priv->spi_crc)
+		spi_message_add_tail(&txm->crc_xfer, &txm->msg);
+	spi_message_add_tail(&txm->trigger_xfer, &txm->msg);
+}
+
+/* the spi_messages of a slot of a tx fifo */
+static void mcp25xxfd_init_tx_message(struct mcp25xxfd_priv *priv,
+				      struct mcp25xxfd_trigger_tx_message *txm,
+				      int fifo, u32 fifo_address,
+				      u32 trigger, u32 mask)
+{
+	/* prepare the message */
+	txm->fifo = fifo;
+	txm->addr = fifo_address;
+	/* the transfers used when part of a batch */
+	txm->batch_cmd_xfer.speed_hz = priv->spi_speed_hz;
+	txm->batch_cmd_xfer.tx_buf = txm->batch_cmd;
+	txm->batch_cmd_xfer.len = 2;
+	txm->batch_xfer.speed_hz = priv->spi_speed_hz;
+	txm->batch_xfer.tx_buf = txm->fill_obj;
+	txm->uinc_xfer.speed_hz = priv->spi_speed_hz;
+	txm->uinc_xfer.tx_buf = txm->uinc_cmd;
+	txm->uinc_xfer.len =
+		mcp25xxfd_format_write_mask(txm->uinc_cmd,
+					    CAN_FIFOCON(fifo), trigger,
+					    mask, false);
+	/* the payload itself */
+	txm->fill_xfer.speed_hz = priv->spi_speed_hz;
+	if (priv->spi_crc) {
 		txm->fill_xfer.tx_buf = txm->fill_cmd;
-		txm->fill_xfer.len = 2;
-		txm->fill_xfer.cs_change = true;
-		mcp25xxfd_calc_cmd_addr(INSTRUCTION_WRITE,
+		txm->fill_xfer.len = 3;
+		mcp25xxfd_calc_cmd_addr(INSTRUCTION_WRITE_CRC,
 					FIFO_DATA(fifo_address),
 					txm->fill_cmd);
-		spi_message_add_tail(&txm->fill_xfer, &txm->msg);
-		/* the trigger command */
-		txm->trigger_xfer.speed_hz = priv->spi_speed_hz;
-		txm->trigger_xfer.tx_buf = txm->trigger_cmd;
-		txm->trigger_xfer.len = 3;
+	} else {
+		txm->fill_xfer.tx_buf = txm->fill_cmd + 1;
+		txm->fill_xfer.len = 2;
 		mcp25xxfd_calc_cmd_addr(INSTRUCTION_WRITE,
-					CAN_FIFOCON(fifo) + first_byte,
-					txm->trigger_cmd);
-		txm->trigger_data = trigger >> (8 * first_byte);
-		spi_message_add_tail(&txm->trigger_xfer, &txm->msg);
+					FIFO_DATA(fifo_address),
+					txm->fill_cmd + 1);
+	}
+	/* the payload and padding for zero-copy */
+	txm->data_xfer.speed_hz = priv->spi_speed_hz;
+	txm->pad_xfer.speed_hz = priv->spi_speed_hz;
+	txm->pad_xfer.tx_buf = txm->fill_pad;
+	/* the crc of the payload */
+	if (priv->spi_crc) {
+		txm->crc_xfer.speed_hz = priv->spi_speed_hz;
+		txm->crc_xfer.tx_buf = txm->fill_crc;
+		txm->crc_xfer.len = 2;
+		txm->crc_xfer.cs_change = true;
+	}
+	/* the trigger command */
+	txm->trigger_xfer.speed_hz = priv->spi_speed_hz;
+	txm->trigger_xfer.tx_buf = txm->trigger_cmd;
+	txm->trigger_xfer.len =
+		mcp25xxfd_format_write_mask(txm->trigger_cmd,
+					    CAN_FIFOCON(fifo), trigger,
+					    mask, priv->spi_crc);
+	mcp25xxfd_tx_message_link(priv, txm);
+}
+
+/* one spi_message per slot of each tx fifo - so for the tx ring one
+ * per slot of the ring - followed by those of the cyclic tx fifo
+ */
+static int mcp25xxfd_fill_spi_transmit_fifos(struct mcp25xxfd_priv *priv)
+{
+	struct mcp25xxfd_tx_cyclic *cyclic = &priv->tx_cyclic;
+	int i, fifo;
+	u32 trigger = CAN_FIFOCON_TXREQ | CAN_FIFOCON_UINC;
+	u32 mask = CAN_FIFOCON_TXREQ | CAN_FIFOCON_UINC;
+	const int depth = priv->fifos.tx_fifo_depth;
+	const int count = priv->fifos.tx_fifos * depth;
+	const u32 slot_size = sizeof(struct mcp25xxfd_obj_tx) +
+		priv->fifos.payload_size;
+
+	priv->spi_transmit_fifos = kcalloc(count + cyclic->depth,
+					   sizeof(*priv->spi_transmit_fifos),
+					   GFP_KERNEL | GFP_DMA);
+	if (!priv->spi_transmit_fifos)
+		return -ENOMEM;
+
+	/* the cyclic tx fifo always uses the TEF */
+	for (i = 0; i < cyclic->depth; i++)
+		mcp25xxfd_init_tx_message(priv,
+					  &priv->spi_transmit_fifos[count + i],
+					  cyclic->fifo,
+					  priv->fifos.fifo_address[cyclic->fifo]
+					  + i * slot_size,
+					  trigger, mask);
+	cyclic->txm = cyclic->depth ? priv->spi_transmit_fifos + count : NULL;
+
+	/* without the TEF the fifo empty interrupt signals the completion,
+	 * so it gets enabled together with the trigger (see
+	 * mcp25xxfd_can_ist_handle_txif)
+	 */
+	if (priv->config.no_tef) {
+		trigger |= MCP25XXFD_TX_FIFOCON_IE | CAN_FIFOCON_TFERFFIE;
+		mask |= GENMASK(7, 0);
+	}
+
+	for (i = 0; i < count; i++) {
+		fifo = priv->fifos.tx_fifo_start + i / depth;
+		mcp25xxfd_init_tx_message(priv, &priv->spi_transmit_fifos[i],
+					  fifo,
+					  priv->fifos.fifo_address[fifo] +
+					  (i % depth) * slot_size,
+					  trigger, mask);
 	}
 
 	return 0;
 }
 
+static void mcp25xxfd_tx_batch_add(struct mcp25xxfd_priv *priv,
+				   struct mcp25xxfd_tx_batch *batch,
+				   struct mcp25xxfd_trigger_tx_message *txm,
+				   int len);
+
+/* send the header from the fill buffer and the payload straight from
+ * the skb - followed by the padding to a multiple of 4 bytes.
+ * the skb is not shared and loops back, so once submitted it becomes
+ * the echo skb itself (no clone) and the irq thread only frees it after
+ * the frame is done - its spi transfers are queued behind this
+ * spi_message anyway.
+ */
+static int mcp25xxfd_transmit_zero_copy(struct spi_device *spi,
+					struct mcp25xxfd_trigger_tx_message
+					*txm,
+					struct sk_buff *skb,
+					int len,
+					u8 *data)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	const int hdr = (priv->spi_crc ? 3 : 2) +
+		sizeof(struct mcp25xxfd_obj_tx);
+	int pad = ALIGN(len, 4) - len;
+	struct spi_transfer *last = &txm->fill_xfer;
+	u16 crc;
+	int ret;
+
+	spi_message_init(&txm->msg);
+	txm->msg.complete = mcp25xxfd_mark_tx_pending;
+	txm->msg.context = txm;
+	txm->zero_copy = true;
+
+	txm->fill_xfer.len = hdr;
+	txm->fill_xfer.cs_change = false;
+	spi_message_add_tail(&txm->fill_xfer, &txm->msg);
+	if (len) {
+		txm->data_xfer.tx_buf = data;
+		txm->data_xfer.len = len;
+		txm->data_xfer.cs_change = false;
+		spi_message_add_tail(&txm->data_xfer, &txm->msg);
+		last = &txm->data_xfer;
+	}
+	if (pad) {
+		txm->pad_xfer.len = pad;
+		txm->pad_xfer.cs_change = false;
+		spi_message_add_tail(&txm->pad_xfer, &txm->msg);
+		last = &txm->pad_xfer;
+	}
+
+	if (priv->spi_crc) {
+		/* length in words and the crc in a separate transfer */
+		txm->fill_cmd[2] = (sizeof(struct mcp25xxfd_obj_tx) +
+				    len + pad) / 4;
+		crc = mcp25xxfd_crc16(0xffff, txm->fill_cmd, hdr);
+		crc = mcp25xxfd_crc16(crc, data, len);
+		crc = mcp25xxfd_crc16(crc, txm->fill_pad, pad);
+		txm->fill_crc[0] = crc >> 8;
+		txm->fill_crc[1] = crc & 0xff;
+		spi_message_add_tail(&txm->crc_xfer, &txm->msg);
+	} else {
+		last->cs_change = true;
+	}
+	spi_message_add_tail(&txm->trigger_xfer, &txm->msg);
+
+	ret = spi_async(spi, &txm->msg);
+	if (ret)
+		return NETDEV_TX_BUSY;
+
+	return NETDEV_TX_OK;
+}
+
 static int mcp25xxfd_transmit_message_common(struct spi_device *spi,
-					     int fifo,
+					     struct mcp25xxfd_trigger_tx_message
+					     *txm,
+					     u32 seq,
 					     struct mcp25xxfd_obj_tx *obj,
+					     struct sk_buff *skb,
 					     int len,
-					     u8 *data)
+					     u8 *data,
+					     struct mcp25xxfd_tx_batch *batch)
 {
 	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	struct mcp25xxfd_trigger_tx_message *txm =
-		&priv->spi_transmit_fifos[fifo - priv->fifos.tx_fifo_start];
+	u16 crc;
 	int ret;
 
-	/* add fifo as seq */
-	obj->header.flags |= fifo << CAN_OBJ_FLAGS_SEQ_SHIFT;
+	/* add seq - the fifo or the position in the tx ring */
+	obj->header.flags |= seq << CAN_OBJ_FLAGS_SEQ_SHIFT;
 
 	/* transform to le32 */
 	mcp25xxfd_obj_to_le(&obj->header);
 
 	/* fill in details */
 	memcpy(txm->fill_obj, obj, sizeof(struct mcp25xxfd_obj_tx));
-	memset(txm->fill_data, 0, priv->fifos.payload_size);
+
+	/* batched objects get written as a whole, so they get copied -
+	 * as do the skbs that do not become the echo skb themselves:
+	 * shared ones get cloned, the ones not looped back get freed
+	 */
+	if (use_zero_copy_tx && !batch && !skb_shared(skb) &&
+	    skb->pkt_type == PACKET_LOOPBACK)
+		return mcp25xxfd_transmit_zero_copy(spi, txm, skb, len, data);
+
+	/* the payload beyond the dlc does not get transmitted on the
+	 * bus, so only the padding to a multiple of 4 bytes needs clearing
+	 */
 	memcpy(txm->fill_data, data, len);
+	memset(txm->fill_data + len, 0, ALIGN(len, 4) - len);
+	if (txm->zero_copy)
+		mcp25xxfd_tx_message_link(priv, txm);
 
 	/* transfers to FIFO RAM has to be multiple of 4 */
-	txm->fill_xfer.len =
-		2 + sizeof(struct mcp25xxfd_obj_tx) + ALIGN(len, 4);
+	len = sizeof(struct mcp25xxfd_obj_tx) + ALIGN(len, 4);
+
+	/* staged frames get sent with the batch */
+	if (batch) {
+		mcp25xxfd_tx_batch_add(priv, batch, txm, len);
+		return NETDEV_TX_OK;
+	}
+
+	if (priv->spi_crc) {
+		/* length in words and the crc in a separate transfer */
+		txm->fill_cmd[2] = len / 4;
+		txm->fill_xfer.len = 3 + len;
+		crc = mcp25xxfd_crc16(0xffff, txm->fill_cmd, 3 + len);
+		txm->fill_crc[0] = crc >> 8;
+		txm->fill_crc[1] = crc & 0xff;
+	} else {
+		txm->fill_xfer.len = 2 + len;
+	}
 
 	/* and transmit asyncroniously */
 	ret = spi_async(spi, &txm->msg);
@@ -1845,10 +3530,14 @@ static int mcp25xxfd_transmit_message_common(struct spi_device *spi,
 	return NETDEV_TX_OK;
 }
 
-static int mcp25xxfd_transmit_fdmessage(struct spi_device *spi, int fifo,
-					struct canfd_frame *frame)
+static int mcp25xxfd_transmit_fdmessage(struct spi_device *spi,
+					struct mcp25xxfd_trigger_tx_message
+					*txm, u32 seq,
+					struct sk_buff *skb,
+					struct mcp25xxfd_tx_batch *batch)
 {
 	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct canfd_frame *frame = (struct canfd_frame *)skb->data;
 	struct mcp25xxfd_obj_tx obj;
 	int dlc = can_len2dlc(frame->len);
 	u32 flags;
@@ -1872,14 +3561,18 @@ static int mcp25xxfd_transmit_fdmessage(struct spi_device *spi, int fifo,
 
 	obj.header.flags = flags;
 
-	return mcp25xxfd_transmit_message_common(spi, fifo, &obj,
-						 frame->len, frame->data);
+	return mcp25xxfd_transmit_message_common(spi, txm, seq, &obj, skb,
+						 frame->len, frame->data,
+						 batch);
 }
 
-static int mcp25xxfd_transmit_message(struct spi_device *spi, int fifo,
-				      struct can_frame *frame)
+static int mcp25xxfd_transmit_message(struct spi_device *spi,
+				      struct mcp25xxfd_trigger_tx_message *txm,
+				      u32 seq, struct sk_buff *skb,
+				      struct mcp25xxfd_tx_batch *batch)
 {
 	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct can_frame *frame = (struct can_frame *)skb->data;
 	struct mcp25xxfd_obj_tx obj;
 	u32 flags;
 
@@ -1896,8 +3589,9 @@ static int mcp25xxfd_transmit_message(struct spi_device *spi, int fifo,
 
 	obj.header.flags = flags;
 
-	return mcp25xxfd_transmit_message_common(spi, fifo, &obj,
-						 frame->can_dlc, frame->data);
+	return mcp25xxfd_transmit_message_common(spi, txm, seq, &obj, skb,
+						 frame->can_dlc, frame->data,
+						 batch);
 }
 
 static bool mcp25xxfd_is_last_txfifo(struct spi_device *spi,
@@ -1909,1300 +3603,4320 @@ static bool mcp25xxfd_is_last_txfifo(struct spi_device *spi,
 		(priv->fifos.tx_fifo_start + priv->fifos.tx_fifos - 1));
 }
 
-static netdev_tx_t mcp25xxfd_start_xmit(struct sk_buff *skb,
-					struct net_device *net)
+/* hardware time stamps
+ *
+ * the TBC runs at the can clock divided by (TBCPRE + 1) and the objects
+ * carry its lower 24 bits, so a timecounter extends them to ns - it
+ * gets updated by a delayed work four times per wrap around.
+ * reading the TBC sleeps, so the cyclecounter returns the value read
+ * last and the timecounter is protected by a spinlock.
+ * the objects are converted from the spi completion callbacks as well,
+ * so the lock is taken with interrupts disabled.
+ */
+
+static u64 mcp25xxfd_timestamp_cc_read(const struct cyclecounter *cc)
 {
-	struct mcp25xxfd_priv *priv = netdev_priv(net);
-	struct spi_device *spi = priv->spi;
-	u32 pending_mask;
-	int fifo;
-	int ret;
+	struct mcp25xxfd_priv *priv =
+		container_of(cc, struct mcp25xxfd_priv, ts.cc);
 
-	if (can_dropped_invalid_skb(net, skb))
-		return NETDEV_TX_OK;
+	return priv->ts.tbc;
+}
 
-	if (priv->can.state == CAN_STATE_BUS_OFF) {
-		mcp25xxfd_stop_queue(priv->net);
-		return NETDEV_TX_BUSY;
+/* steer the timecounter towards the host clock:
+ * large offsets (initial sync, host clock set) get stepped, small
+ * ones get corrected by adjusting the rate until the next update.
+ * called with the timestamp lock held.
+ */
+#define MCP25XXFD_TIMESTAMP_STEP_NS	(10 * NSEC_PER_MSEC)
+#define MCP25XXFD_TIMESTAMP_MAX_PPB	500000
+
+static void mcp25xxfd_timestamp_resync(struct mcp25xxfd_priv *priv,
+				       s64 offset)
+{
+	s64 period = jiffies_to_nsecs(priv->ts.period);
+	s64 ppb;
+
+	if (offset > MCP25XXFD_TIMESTAMP_STEP_NS ||
+	    offset < -MCP25XXFD_TIMESTAMP_STEP_NS) {
+		timecounter_adjtime(&priv->ts.tc, offset);
+		priv->ts.cc.mult = priv->ts.mult;
+		priv->stats.ts_resync_steps++;
+		return;
 	}
 
-	/* get effective mask */
-	pending_mask = priv->fifos.tx_pending_mask |
-		priv->fifos.tx_submitted_mask;
+	/* correct the offset within the next period */
+	ppb = div64_s64(offset * NSEC_PER_SEC, period);
+	ppb = clamp_t(s64, ppb, -MCP25XXFD_TIMESTAMP_MAX_PPB,
+		      MCP25XXFD_TIMESTAMP_MAX_PPB);
+	priv->ts.cc.mult = priv->ts.mult +
+		div_s64((s64)priv->ts.mult * ppb, NSEC_PER_SEC);
+}
 
-	/* decide on fifo to assign */
-	if (pending_mask)
-		fifo = fls(pending_mask);
-	else
-		fifo = priv->fifos.tx_fifo_start;
+/* read the TBC (bracketed by system time stamps if requested) and
+ * advance the timecounter - called with the timestamp mutex held
+ */
+static int mcp25xxfd_timestamp_read(struct mcp25xxfd_priv *priv,
+				    struct ptp_system_timestamp *sts,
+				    u64 *ns)
+{
+	unsigned long flags;
+	u32 tbc;
+	int ret;
 
-	/* handle error - this should not happen... */
-	if (fifo >= priv->fifos.tx_fifo_start + priv->fifos.tx_fifos) {
-		dev_err(&spi->dev,
-			"reached tx-fifo %i, which is not valid\n",
-			fifo);
-		return NETDEV_TX_BUSY;
-	}
+	ptp_read_system_prets(sts);
+	ret = mcp25xxfd_cmd_read(priv->spi, CAN_TBC, &tbc,
+				 priv->spi_speed_hz);
+	ptp_read_system_postts(sts);
+	if (ret)
+		return ret;
 
-	/* if we are the last one, then stop the queue */
-	if (mcp25xxfd_is_last_txfifo(spi, fifo))
-		mcp25xxfd_stop_queue(priv->net);
+	spin_lock_irqsave(&priv->ts.lock, flags);
+	priv->ts.tbc = tbc;
+	*ns = timecounter_read(&priv->ts.tc);
+	spin_unlock_irqrestore(&priv->ts.lock, flags);
 
-	/* mark as submitted */
-	priv->fifos.tx_submitted_mask |= BIT(fifo);
-	priv->stats.fifo_usage[fifo]++;
+	return 0;
+}
 
-	/* now process it for real */
-	if (can_is_canfd_skb(skb))
-		ret = mcp25xxfd_transmit_fdmessage(spi, fifo,
-						   (struct canfd_frame *)
-						   skb->data);
-	else
-		ret = mcp25xxfd_transmit_message(spi, fifo,
-						 (struct can_frame *)
-						 skb->data);
+static int mcp25xxfd_timestamp_update(struct mcp25xxfd_priv *priv)
+{
+	struct ptp_system_timestamp sts;
+	unsigned long flags;
+	u64 host, ns;
+	int ret;
 
-	/* keep it for reference until the message really got transmitted */
-	if (ret == NETDEV_TX_OK)
-		can_put_echo_skb(skb, priv->net, fifo);
+	mutex_lock(&priv->ts.mutex);
+
+	ret = mcp25xxfd_timestamp_read(priv, &sts, &ns);
+	if (ret || !use_timestamp_resync || priv->ts.adjusted)
+		goto out;
+
+	/* the TBC got latched somewhere within the spi transfer */
+	host = (timespec64_to_ns(&sts.pre_ts) +
+		timespec64_to_ns(&sts.post_ts)) / 2;
+
+	spin_lock_irqsave(&priv->ts.lock, flags);
+	mcp25xxfd_timestamp_resync(priv, (s64)(host - ns));
+	spin_unlock_irqrestore(&priv->ts.lock, flags);
+
+out:
+	mutex_unlock(&priv->ts.mutex);
 
 	return ret;
 }
 
-/* CAN RX Related */
+static void mcp25xxfd_timestamp_work(struct work_struct *work)
+{
+	struct mcp25xxfd_priv *priv =
+		container_of(to_delayed_work(work), struct mcp25xxfd_priv,
+			     ts.work);
 
-static int mcp25xxfd_can_transform_rx_fd(struct spi_device *spi,
-					 struct mcp25xxfd_obj_rx *rx)
+	mcp25xxfd_timestamp_update(priv);
+	schedule_delayed_work(&priv->ts.work, priv->ts.period);
+}
+
+static int mcp25xxfd_timestamp_start(struct mcp25xxfd_priv *priv)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	struct canfd_frame *frame;
-	struct sk_buff *skb;
-	u32 flags = rx->header.flags;
-	int dlc;
+	struct cyclecounter *cc = &priv->ts.cc;
+	u32 tbcpre = (priv->regs.tscon & CAN_TSCON_TBCPRE_MASK) >>
+		CAN_TSCON_TBCPRE_SHIFT;
+	unsigned long flags;
+	u32 tbc;
+	int ret;
 
-	/* allocate the skb buffer */
-	skb = alloc_canfd_skb(priv->net, &frame);
-	if (!skb) {
-		dev_err(&spi->dev, "cannot allocate RX skb\n");
-		priv->net->stats.rx_dropped++;
-		return -ENOMEM;
-	}
+	priv->ts.freq = priv->can.clock.freq / (tbcpre + 1);
+	cc->read = mcp25xxfd_timestamp_cc_read;
+	cc->mask = CYCLECOUNTER_MASK(MCP25XXFD_TIMESTAMP_BITS);
+	clocks_calc_mult_shift(&cc->mult, &cc->shift, priv->ts.freq,
+			       NSEC_PER_SEC,
+			       BIT(MCP25XXFD_TIMESTAMP_BITS) / priv->ts.freq);
+	priv->ts.mult = cc->mult;
+	priv->ts.period = msecs_to_jiffies(div_u64((u64)(cc->mask >> 2) *
+						   MSEC_PER_SEC,
+						   priv->ts.freq));
 
-	mcp25xxfd_mcpid_to_canid(rx->header.id, flags, &frame->can_id);
-	frame->flags |= (flags & CAN_OBJ_FLAGS_BRS) ? CANFD_BRS : 0;
-	frame->flags |= (flags & CAN_OBJ_FLAGS_ESI) ? CANFD_ESI : 0;
+	mutex_lock(&priv->ts.mutex);
 
-	dlc = (flags & CAN_OBJ_FLAGS_DLC_MASK) >> CAN_OBJ_FLAGS_DLC_SHIFT;
-	frame->len = can_dlc2len(dlc);
+	ret = mcp25xxfd_cmd_read(priv->spi, CAN_TBC, &tbc,
+				 priv->spi_speed_hz);
+	if (ret)
+		goto out;
 
-	memcpy(frame->data, rx->data, frame->len);
+	spin_lock_irqsave(&priv->ts.lock, flags);
+	priv->ts.tbc = tbc;
+	timecounter_init(&priv->ts.tc, cc, ktime_get_real_ns());
+	spin_unlock_irqrestore(&priv->ts.lock, flags);
 
-	priv->stats.rx_fd_count++;
-	priv->net->stats.rx_packets++;
-	priv->net->stats.rx_bytes += frame->len;
-	if (rx->header.flags & CAN_OBJ_FLAGS_BRS)
-		priv->stats.rx_brs_count++;
-	priv->stats.rx_dlc_usage[dlc]++;
+	priv->ts.running = true;
+	priv->ts.adjusted = false;
 
-	can_led_event(priv->net, CAN_LED_EVENT_RX);
+	schedule_delayed_work(&priv->ts.work, priv->ts.period);
 
-	netif_rx_ni(skb);
+out:
+	mutex_unlock(&priv->ts.mutex);
 
-	return 0;
+	return ret;
 }
 
-static int mcp25xxfd_can_transform_rx_normal(struct spi_device *spi,
-					     struct mcp25xxfd_obj_rx *rx)
+static void mcp25xxfd_timestamp_stop(struct mcp25xxfd_priv *priv)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	struct sk_buff *skb;
-	struct can_frame *frame;
-	u32 flags = rx->header.flags;
-	int len;
-	int dlc;
+	cancel_delayed_work_sync(&priv->ts.work);
 
-	/* allocate the skb buffer */
-	skb = alloc_can_skb(priv->net, &frame);
-	if (!skb) {
-		dev_err(&spi->dev, "cannot allocate RX skb\n");
-		priv->net->stats.rx_dropped++;
-		return -ENOMEM;
+	mutex_lock(&priv->ts.mutex);
+	priv->ts.running = false;
+	mutex_unlock(&priv->ts.mutex);
+}
+
+/* PTP hardware clock
+ *
+ * the TBC only runs while the interface is up (the controller sleeps
+ * otherwise), so the clock is registered with the candev but fails
+ * with -ENETDOWN while it is down.
+ */
+static int mcp25xxfd_ptp_adjfine(struct ptp_clock_info *info,
+				 long scaled_ppm)
+{
+	struct mcp25xxfd_priv *priv =
+		container_of(info, struct mcp25xxfd_priv, ts.ptp_info);
+	bool neg = scaled_ppm < 0;
+	unsigned long flags;
+	u64 diff, ns;
+	int ret;
+
+	/* scaled_ppm is ppm with a 16 bit fractional part */
+	diff = (u64)priv->ts.mult * (neg ? -scaled_ppm : scaled_ppm);
+	diff = div64_u64(diff, 1000000ULL << 16);
+
+	mutex_lock(&priv->ts.mutex);
+	if (!priv->ts.running) {
+		ret = -ENETDOWN;
+		goto out;
 	}
 
-	mcp25xxfd_mcpid_to_canid(rx->header.id, flags, &frame->can_id);
+	/* account the time passed so far at the old rate */
+	ret = mcp25xxfd_timestamp_read(priv, NULL, &ns);
+	if (ret)
+		goto out;
 
-	dlc = (flags & CAN_OBJ_FLAGS_DLC_MASK) >> CAN_OBJ_FLAGS_DLC_SHIFT;
-	frame->can_dlc = dlc;
+	spin_lock_irqsave(&priv->ts.lock, flags);
+	priv->ts.cc.mult = neg ? priv->ts.mult - diff : priv->ts.mult + diff;
+	spin_unlock_irqrestore(&priv->ts.lock, flags);
+	priv->ts.adjusted = true;
 
-	len = can_dlc2len(frame->can_dlc);
+out:
+	mutex_unlock(&priv->ts.mutex);
 
-	memcpy(frame->data, rx->data, len);
+	return ret;
+}
 
-	priv->net->stats.rx_packets++;
-	priv->net->stats.rx_bytes += len;
-	priv->stats.rx_dlc_usage[dlc]++;
+static int mcp25xxfd_ptp_adjtime(struct ptp_clock_info *info, s64 delta)
+{
+	struct mcp25xxfd_priv *priv =
+		container_of(info, struct mcp25xxfd_priv, ts.ptp_info);
+	unsigned long flags;
+	int ret = 0;
 
-	can_led_event(priv->net, CAN_LED_EVENT_RX);
+	mutex_lock(&priv->ts.mutex);
+	if (!priv->ts.running) {
+		ret = -ENETDOWN;
+		goto out;
+	}
 
-	netif_rx_ni(skb);
+	spin_lock_irqsave(&priv->ts.lock, flags);
+	timecounter_adjtime(&priv->ts.tc, delta);
+	spin_unlock_irqrestore(&priv->ts.lock, flags);
+	priv->ts.adjusted = true;
 
-	return 0;
+out:
+	mutex_unlock(&priv->ts.mutex);
+
+	return ret;
 }
 
-static int mcp25xxfd_process_queued_rx(struct spi_device *spi,
-				       struct mcp25xxfd_obj_ts *obj)
+static int mcp25xxfd_ptp_gettimex64(struct ptp_clock_info *info,
+				    struct timespec64 *ts,
+				    struct ptp_system_timestamp *sts)
 {
-	struct mcp25xxfd_obj_rx *rx = container_of(obj,
-						   struct mcp25xxfd_obj_rx,
-						   header);
+	struct mcp25xxfd_priv *priv =
+		container_of(info, struct mcp25xxfd_priv, ts.ptp_info);
+	u64 ns;
+	int ret;
 
-	if (obj->flags & CAN_OBJ_FLAGS_FDF)
-		return mcp25xxfd_can_transform_rx_fd(spi, rx);
-	else
-		return mcp25xxfd_can_transform_rx_normal(spi, rx);
+	mutex_lock(&priv->ts.mutex);
+	if (!priv->ts.running) {
+		ret = -ENETDOWN;
+		goto out;
+	}
+
+	ret = mcp25xxfd_timestamp_read(priv, sts, &ns);
+	if (!ret)
+		*ts = ns_to_timespec64(ns);
+
+out:
+	mutex_unlock(&priv->ts.mutex);
+
+	return ret;
 }
 
-static int mcp25xxfd_normal_release_fifos(struct spi_device *spi,
-					  int start, int end)
+static int mcp25xxfd_ptp_settime64(struct ptp_clock_info *info,
+				   const struct timespec64 *ts)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct mcp25xxfd_priv *priv =
+		container_of(info, struct mcp25xxfd_priv, ts.ptp_info);
+	unsigned long flags;
+	u32 tbc;
 	int ret;
 
-	/* release each fifo in a separate transfer */
-	for (; start < end ; start++) {
-		ret = mcp25xxfd_cmd_write_mask(spi, CAN_FIFOCON(start),
-					       CAN_FIFOCON_UINC,
-					       CAN_FIFOCON_UINC,
-					       priv->spi_speed_hz);
-		if (ret)
-			return ret;
+	mutex_lock(&priv->ts.mutex);
+	if (!priv->ts.running) {
+		ret = -ENETDOWN;
+		goto out;
 	}
 
-	return 0;
+	ret = mcp25xxfd_cmd_read(priv->spi, CAN_TBC, &tbc,
+				 priv->spi_speed_hz);
+	if (ret)
+		goto out;
+
+	spin_lock_irqsave(&priv->ts.lock, flags);
+	priv->ts.tbc = tbc;
+	timecounter_init(&priv->ts.tc, &priv->ts.cc, timespec64_to_ns(ts));
+	spin_unlock_irqrestore(&priv->ts.lock, flags);
+	priv->ts.adjusted = true;
+
+out:
+	mutex_unlock(&priv->ts.mutex);
+
+	return ret;
 }
 
-/* unfortunately the CAN_FIFOCON are not directly consecutive
- * so the optimization of "clearing all in one spi_transfer"
- * would produce an overhead of 11 unnecessary bytes/fifo
- * - transferring 14 (2 cmd + 12 data) bytes
- * instead of just 3 (2 + 1).
- * On some slower systems this may still be beneficial,
- * but it is not good enough for the generic case.
- * On a Raspberry Pi CM the timings for clearing 3 fifos
- * (at 12.5MHz SPI clock speed) are:
- * * normal:
- *   * 3 spi transfers
- *   * 9 bytes total
- *   * 36.74us from first CS low to last CS high
- *   * individual CS: 9.14us, 5.74us and 5.16us
- *   * 77.02us from CS up of fifo transfer to last release CS up
- * * bulk:
- *   * 1 spi transfer
- *   * 27 bytes total
- *   * 29.06us CS Low
- *   * 78.28us from CS up of fifo transfer to last release CS up
- * this obviously varies with SPI_clock speed
- * - the slower the clock the less efficient the optimization.
- * similarly the faster the CPU (and bigger the code cache) the
- * less effcient the optimization - the above case is border line.
- */
+static int mcp25xxfd_ptp_enable(struct ptp_clock_info *info,
+				struct ptp_clock_request *rq, int on)
+{
+	return -EOPNOTSUPP;
+}
 
-#define FIFOCON_SPACING (CAN_FIFOCON(1) - CAN_FIFOCON(0))
-#define FIFOCON_SPACINGW (FIFOCON_SPACING / sizeof(u32))
+static const struct ptp_clock_info mcp25xxfd_ptp_info = {
+	.owner = THIS_MODULE,
+	.name = "mcp25xxfd",
+	.max_adj = MCP25XXFD_TIMESTAMP_MAX_PPB,
+	.adjfine = mcp25xxfd_ptp_adjfine,
+	.adjtime = mcp25xxfd_ptp_adjtime,
+	.gettimex64 = mcp25xxfd_ptp_gettimex64,
+	.settime64 = mcp25xxfd_ptp_settime64,
+	.enable = mcp25xxfd_ptp_enable,
+};
 
-static int mcp25xxfd_bulk_release_fifos(struct spi_device *spi,
-					int start, int end)
+static void mcp25xxfd_ptp_register(struct mcp25xxfd_priv *priv)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	int i;
-	int ret;
+	priv->ts.ptp_info = mcp25xxfd_ptp_info;
+	priv->ts.ptp = ptp_clock_register(&priv->ts.ptp_info,
+					  &priv->spi->dev);
+	if (IS_ERR(priv->ts.ptp)) {
+		dev_warn(&priv->spi->dev,
+			 "Failed to register PTP clock: %ld\n",
+			 PTR_ERR(priv->ts.ptp));
+		priv->ts.ptp = NULL;
+	}
+}
 
-	/* calculate start address and length */
-	int fifos = end - start;
-	int first_byte = mcp25xxfd_first_byte(CAN_FIFOCON_UINC);
-	int addr = CAN_FIFOCON(start);
-	int len = 1 + (fifos - 1) * FIFOCON_SPACING;
+static void mcp25xxfd_ptp_unregister(struct mcp25xxfd_priv *priv)
+{
+	if (priv->ts.ptp)
+		ptp_clock_unregister(priv->ts.ptp);
+	priv->ts.ptp = NULL;
+}
 
-	/* the worsted case buffer */
-	u32 buf[32 * FIFOCON_SPACINGW], base;
+static ktime_t mcp25xxfd_timestamp_to_ktime(struct mcp25xxfd_priv *priv,
+					    u32 ts)
+{
+	unsigned long flags;
+	u64 ns;
 
-	base = (priv->fifos.payload_mode << CAN_FIFOCON_PLSIZE_SHIFT) |
-		((priv->fifos.rx_fifo_depth - 1) << CAN_FIFOCON_FSIZE_SHIFT) |
-		CAN_FIFOCON_RXTSEN | /* RX timestamps */
-		CAN_FIFOCON_UINC |
-		CAN_FIFOCON_TFERFFIE | /* FIFO Full */
-		CAN_FIFOCON_TFHRFHIE | /* FIFO Half Full*/
-		CAN_FIFOCON_TFNRFNIE; /* FIFO not empty */
+	spin_lock_irqsave(&priv->ts.lock, flags);
+	ns = timecounter_cyc2time(&priv->ts.tc, ts & priv->ts.cc.mask);
+	spin_unlock_irqrestore(&priv->ts.lock, flags);
 
-	memset(buf, 0, sizeof(buf));
-	for (i = 0; i < end - start ; i++) {
-		if (i == priv->fifos.rx_fifos - 1)
-			base |= CAN_FIFOCON_RXOVIE;
-		buf[FIFOCON_SPACINGW * i] = cpu_to_le32(base);
-	}
+	return ns_to_ktime(ns);
+}
 
-	ret = mcp25xxfd_cmd_writen(spi, addr + first_byte,
-				   (u8 *)buf + first_byte,
-				   len,
-				   priv->spi_speed_hz);
-	if (ret)
-		return ret;
+/* the stack asks for a hardware tx time stamp */
+static void mcp25xxfd_tx_timestamp_prepare(struct mcp25xxfd_priv *priv,
+					   struct sk_buff *skb)
+{
+	if (priv->ts.config.tx_type == HWTSTAMP_TX_ON &&
+	    skb_shinfo(skb)->tx_flags & SKBTX_HW_TSTAMP)
+		skb_shinfo(skb)->tx_flags |= SKBTX_IN_PROGRESS;
 
-	return 0;
+	skb_tx_timestamp(skb);
 }
 
-/* queued FIFO handling for release to system */
-
-static void mcp25xxfd_clear_queued_fifos(struct spi_device *spi)
+/* the echo skb gets the time of the transmission from the TEF
+ * and the socket gets it reported, if it asked for it
+ */
+static void mcp25xxfd_tx_timestamp(struct mcp25xxfd_priv *priv,
+				   u32 echo, u32 ts)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct sk_buff *skb = priv->can.echo_skb[echo];
+	struct skb_shared_hwtstamps *hwts;
 
-	/* prepare rfi - mostly used for sorting */
-	priv->queued_fifos.rx_count = 0;
+	if (!skb)
+		return;
+
+	hwts = skb_hwtstamps(skb);
+	hwts->hwtstamp = mcp25xxfd_timestamp_to_ktime(priv, ts);
+	if (skb_shinfo(skb)->tx_flags & SKBTX_IN_PROGRESS)
+		skb_tstamp_tx(skb, hwts);
 }
 
-static void mcp25xxfd_addto_queued_fifos(struct spi_device *spi,
-					 struct mcp25xxfd_obj_ts *obj)
+/* how far off the frame went out from its launch time */
+static void mcp25xxfd_tx_launch_report(struct mcp25xxfd_priv *priv,
+				       u32 echo, u32 ts)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	struct mcp25xxfd_read_fifo_info *rfi = &priv->queued_fifos;
+	ktime_t time = priv->tx_launch_time[echo];
+	s64 err;
 
-	/* timestamps must ignore the highest byte, so we shift it,
-	 * so that it still compares correctly
-	 */
-	obj->ts <<= 8;
+	if (!time)
+		return;
+	priv->tx_launch_time[echo] = 0;
 
-	/* add pointer to queued array-list */
-	rfi->rxb[rfi->rx_count] = obj;
-	rfi->rx_count++;
+	err = ktime_to_ns(ktime_sub(mcp25xxfd_timestamp_to_ktime(priv, ts),
+				    time));
+	if (err < 0) {
+		priv->stats.tx_launch_early++;
+		err = -err;
+	}
+	priv->stats.tx_launch_error_sum_ns += err;
+	if (err > priv->stats.tx_launch_error_max_ns)
+		priv->stats.tx_launch_error_max_ns = err;
 }
 
-static int mcp25xxfd_process_queued_tef(struct spi_device *spi,
-					struct mcp25xxfd_obj_ts *obj)
+static int mcp25xxfd_hwtstamp_set(struct net_device *net, struct ifreq *ifr)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	struct mcp25xxfd_obj_tef *tef = container_of(obj,
-						     struct mcp25xxfd_obj_tef,
-						     header);
-	int dlc = (obj->flags & CAN_OBJ_FLAGS_DLC_MASK)
-		>> CAN_OBJ_FLAGS_DLC_SHIFT;
-	int fifo = (tef->header.flags & CAN_OBJ_FLAGS_SEQ_MASK) >>
-		CAN_OBJ_FLAGS_SEQ_SHIFT;
+	struct mcp25xxfd_priv *priv = netdev_priv(net);
+	struct hwtstamp_config config;
 
-	/* update counters */
-	priv->net->stats.tx_packets++;
-	priv->net->stats.tx_bytes += can_dlc2len(dlc);
-	if (obj->flags & CAN_OBJ_FLAGS_FDF)
-		priv->stats.tx_fd_count++;
-	if (obj->flags & CAN_OBJ_FLAGS_BRS)
-		priv->stats.tx_brs_count++;
-	priv->stats.tx_dlc_usage[dlc]++;
+	if (copy_from_user(&config, ifr->ifr_data, sizeof(config)))
+		return -EFAULT;
 
-	/* release it */
-	can_get_echo_skb(priv->net, fifo);
+	/* reserved for future extensions */
+	if (config.flags)
+		return -EINVAL;
 
-	can_led_event(priv->net, CAN_LED_EVENT_TX);
+	/* the tx time stamps come from the TEF */
+	switch (config.tx_type) {
+	case HWTSTAMP_TX_OFF:
+		break;
+	case HWTSTAMP_TX_ON:
+		if (priv->config.no_tef)
+			return -ERANGE;
+		break;
+	default:
+		return -ERANGE;
+	}
 
-	return 0;
-}
+	/* rx frames get time stamped all or nothing */
+	if (config.rx_filter != HWTSTAMP_FILTER_NONE)
+		config.rx_filter = HWTSTAMP_FILTER_ALL;
 
-static int mcp25xxfd_compare_obj_ts(const void *a, const void *b)
-{
-	const struct mcp25xxfd_obj_ts * const *rxa = a;
-	const struct mcp25xxfd_obj_ts * const *rxb = b;
-	/* using signed here to handle rollover correctly */
-	s32 ats = (*rxa)->ts;
-	s32 bts = (*rxb)->ts;
+	priv->ts.config = config;
 
-	if (ats < bts)
-		return -1;
-	if (ats > bts)
-		return 1;
-	return 0;
+	return copy_to_user(ifr->ifr_data, &config, sizeof(config)) ?
+		-EFAULT : 0;
 }
 
-static int mcp25xxfd_process_queued_fifos(struct spi_device *spi)
+static int mcp25xxfd_hwtstamp_get(struct net_device *net, struct ifreq *ifr)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	struct mcp25xxfd_read_fifo_info *rfi = &priv->queued_fifos;
-	int i;
-	int ret;
+	struct mcp25xxfd_priv *priv = netdev_priv(net);
 
-	/* sort the fifos (rx and TEF) by receive timestamp */
-	sort(rfi->rxb, rfi->rx_count, sizeof(struct mcp25xxfd_obj_ts *),
-	     mcp25xxfd_compare_obj_ts, NULL);
+	return copy_to_user(ifr->ifr_data, &priv->ts.config,
+			    sizeof(priv->ts.config)) ? -EFAULT : 0;
+}
 
-	/* process the recived fifos */
-	for (i = 0; i < rfi->rx_count ; i++) {
-		if (rfi->rxb[i]->flags & CAN_OBJ_FLAGS_CUSTOM_ISTEF)
-			ret = mcp25xxfd_process_queued_tef(spi, rfi->rxb[i]);
-		else
-			ret = mcp25xxfd_process_queued_rx(spi, rfi->rxb[i]);
-		if (ret)
-			return ret;
+static int mcp25xxfd_do_ioctl(struct net_device *net, struct ifreq *ifr,
+			      int cmd)
+{
+	switch (cmd) {
+	case SIOCSHWTSTAMP:
+		return mcp25xxfd_hwtstamp_set(net, ifr);
+	case SIOCGHWTSTAMP:
+		return mcp25xxfd_hwtstamp_get(net, ifr);
+	default:
+		return -EOPNOTSUPP;
 	}
-
-	/* clear queued fifos */
-	mcp25xxfd_clear_queued_fifos(spi);
-
-	return 0;
 }
 
-static int mcp25xxfd_transform_rx(struct spi_device *spi,
-				  struct mcp25xxfd_obj_rx *rx)
+static int mcp25xxfd_get_ts_info(struct net_device *net,
+				 struct ethtool_ts_info *info)
 {
-	int dlc;
-
-	/* transform the data to system byte order */
-	mcp25xxfd_obj_ts_from_le(&rx->header);
+	struct mcp25xxfd_priv *priv = netdev_priv(net);
 
-	/* add the object to the list */
-	mcp25xxfd_addto_queued_fifos(spi, &rx->header);
+	info->so_timestamping =
+		SOF_TIMESTAMPING_TX_SOFTWARE |
+		SOF_TIMESTAMPING_RX_SOFTWARE |
+		SOF_TIMESTAMPING_SOFTWARE |
+		SOF_TIMESTAMPING_TX_HARDWARE |
+		SOF_TIMESTAMPING_RX_HARDWARE |
+		SOF_TIMESTAMPING_RAW_HARDWARE;
+	info->phc_index = priv->ts.ptp ? ptp_clock_index(priv->ts.ptp) : -1;
+	info->tx_types = BIT(HWTSTAMP_TX_OFF);
+	if (!priv->config.no_tef)
+		info->tx_types |= BIT(HWTSTAMP_TX_ON);
+	info->rx_filters = BIT(HWTSTAMP_FILTER_NONE) | BIT(HWTSTAMP_FILTER_ALL);
 
-	/* calc length and return it */
-	dlc = (rx->header.flags & CAN_OBJ_FLAGS_DLC_MASK)
-		>> CAN_OBJ_FLAGS_DLC_SHIFT;
-	return can_dlc2len(dlc);
+	return 0;
 }
 
-/* read_fifo implementations
- *
- * read_fifos is a simple implementation, that:
- *   * loops all fifos
- *     * read header + some data-bytes (8)
- *     * read rest of data-bytes bytes
- *     * release fifo
- *   for 3 can frames dlc<=8 to read here we have:
- *     * 6 spi transfers
- *     * 75 bytes (= 3 * (2 + 12 + 8) bytes + 3 * 3 bytes)
- *   for 3 canfd frames dlc>8 to read here we have:
- *     * 9 spi transfers
- *     * 81 (= 3 * (2 + 12 + 8 + 2) bytes + 3 * 3 bytes) + 3 * extra payload
- *     this only transfers the required size of bytes on the spi bus.
- *
- * bulk_read_fifos is an optimization that is most practical for
- * Can2.0 busses, but may also be practical for CanFD busses that
- * have a high average payload data size.
- *
- * It will read all of the fifo data in a single spi_transfer:
- *   * read all fifos in one go (as long as these are ajacent to each other)
- *   * loop all fifos
- *     * release fifo
- *   for 3 can2.0 frames to read here we have:
- *     * 4 spi transfers
- *     * 71 bytes (= 2 + 3 * (12 + 8) bytes + 3 * 3 bytes)
- *   for 3 canfd frames to read here we have:
- *     * 4 spi transfers
- *     * 230 bytes (= 2 + 3 * (12 + 64) bytes)
- *     obviously this reads way too many bytes for framesizes <=32 bytes,
- *     but it avoids the overhead on the CPU side and may even trigger
- *     DMA transfers due to the high byte count, which release CPU cycles.
- *
- * This optimization will also be efficient for cases where a high
- * percentage of canFD frames has a dlc-size > 8.
- * This mode is used for Can2.0 configured busses.
- *
- * For now this option can get forced for CanFD via a module parameter.
- * In the future there may be some heuristics that could trigger a usage
- * of this mode as well in some circumstances.
+/* byte queue limits
  *
- * Note: there is a second optimization for release fifo as well,
- *       but it is not as efficient as this optimization for the
- *       non-CanFD case - see mcp25xxfd_bulk_release_fifos
+ * the size of a frame is the number of bits it occupies on the bus
+ * (with stuffing), so that the qdisc sees the backlog in the
+ * controller in terms of bus time rather than payload bytes.
+ * frames are accounted when their spi_message got submitted, the
+ * completions (transmitted or aborted) get collected while processing
+ * the TEF and reported in one go.
  */
 
-static int mcp25xxfd_read_fifos(struct spi_device *spi)
+struct mcp25xxfd_wire_bits {
+	/* the bits including the stuff bits */
+	u32 bits;
+	/* the level of the last bit and the number of those in a row */
+	u32 level;
+	u32 run;
+	/* the CRC-15 of classic CAN */
+	u16 crc;
+};
+
+static void mcp25xxfd_wire_bits_add(struct mcp25xxfd_wire_bits *wb,
+				    u32 val, int count)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	int fifo_header_size = sizeof(struct mcp25xxfd_obj_rx);
-	int fifo_min_payload_size = 8;
-	int fifo_min_size = fifo_header_size + fifo_min_payload_size;
-	int fifo_max_payload_size =
-		((priv->can.ctrlmode & CAN_CTRLMODE_FD) ? 64 : 8);
-	u32 mask = priv->status.rxif;
-	struct mcp25xxfd_obj_rx *rx;
-	int i, len;
-	int ret;
-	u32 fifo_address;
-	u8 *data;
+	u32 bit;
 
-	/* read all the "open" segments in big chunks */
-	for (i = priv->fifos.rx_fifo_start + priv->fifos.rx_fifos - 1;
-	     i >= priv->fifos.rx_fifo_start;
-	     i--) {
-		if (!(mask & BIT(i)))
-			continue;
-		/* the fifo to fill */
-		rx = (struct mcp25xxfd_obj_rx *)
-			(priv->fifos.fifo_data + priv->fifos.fifo_address[i]);
-		/* read the minimal payload */
-		fifo_address = priv->fifos.fifo_address[i];
-		ret = mcp25xxfd_cmd_readn(spi,
-					  FIFO_DATA(fifo_address),
-					  rx,
-					  fifo_min_size,
-					  priv->spi_speed_hz);
-		if (ret)
-			return ret;
-		/* process fifo stats and get length */
-		len = min_t(int, mcp25xxfd_transform_rx(spi, rx),
-			    fifo_max_payload_size);
+	while (count--) {
+		bit = (val >> count) & 1;
 
-		/* read extra payload if needed */
-		if (len > fifo_min_payload_size) {
-			data = &rx->data[fifo_min_payload_size];
-			ret = mcp25xxfd_cmd_readn(spi,
-						  FIFO_DATA(fifo_address +
-							    fifo_min_size),
-						  data,
-						  len - fifo_min_payload_size,
-						  priv->spi_speed_hz);
-			if (ret)
-				return ret;
+		wb->crc = ((wb->crc << 1) ^
+			   ((bit ^ (wb->crc >> 14)) & 1 ? 0x4599 : 0)) &
+			0x7fff;
+
+		if (bit == wb->level) {
+			wb->run++;
+		} else {
+			wb->level = bit;
+			wb->run = 1;
 		}
-		/* release fifo */
-		ret = mcp25xxfd_normal_release_fifos(spi, i, i + 1);
-		if (ret)
-			return ret;
-		/* increment fifo_usage */
-		priv->stats.fifo_usage[i]++;
-	}
+		wb->bits++;
 
-	return 0;
+		/* a stuff bit of the other level after 5 equal ones */
+		if (wb->run == 5) {
+			wb->bits++;
+			wb->level = !bit;
+			wb->run = 1;
+		}
+	}
 }
 
-static int mcp25xxfd_bulk_read_fifo_range(struct spi_device *spi,
-					  int start, int end)
+/* the bits a frame (of a valid skb) occupies on the bus, including the
+ * stuff bits of its actual content - in the nominal phase, the ones of
+ * the data phase (ESI up to the crc) of a CAN FD frame go to data_bits
+ */
+static u32 mcp25xxfd_tx_wire_bits(struct sk_buff *skb, u32 *data_bits)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	const int fifo_header_size = sizeof(struct mcp25xxfd_obj_rx);
-	const int fifo_max_payload_size = priv->fifos.payload_size;
-	const int fifo_max_size = fifo_header_size + fifo_max_payload_size;
-	struct mcp25xxfd_obj_rx *rx;
-	int i;
-	int ret;
+	struct canfd_frame *frame = (struct canfd_frame *)skb->data;
+	struct mcp25xxfd_wire_bits wb = { .level = 1 };
+	bool eff = frame->can_id & CAN_EFF_FLAG;
+	bool rtr = frame->can_id & CAN_RTR_FLAG;
+	u32 id = frame->can_id & (eff ? CAN_EFF_MASK : CAN_SFF_MASK);
+	u32 len = frame->len;
+	u32 nominal, i;
+	u16 crc;
+
+	/* SOF, base identifier, SRR + IDE and the identifier extension */
+	mcp25xxfd_wire_bits_add(&wb, 0, 1);
+	mcp25xxfd_wire_bits_add(&wb, eff ? id >> 18 : id, 11);
+	if (eff) {
+		mcp25xxfd_wire_bits_add(&wb, 3, 2);
+		mcp25xxfd_wire_bits_add(&wb, id, 18);
+	}
 
-	/* now we got start and end, so read the range */
-	ret = mcp25xxfd_cmd_readn(spi,
-				  FIFO_DATA(priv->fifos.fifo_address[start]),
-				  priv->fifos.fifo_data +
-				  priv->fifos.fifo_address[start],
-				  (end - start) * fifo_max_size,
-				  priv->spi_speed_hz);
-	if (ret)
-		return ret;
+	if (can_is_canfd_skb(skb)) {
+		/* RRS (+ IDE), FDF, res and BRS */
+		mcp25xxfd_wire_bits_add(&wb, 0, eff ? 1 : 2);
+		mcp25xxfd_wire_bits_add(&wb, frame->flags & CANFD_BRS ?
+					5 : 4, 3);
+		nominal = wb.bits;
+		/* ESI, DLC and data */
+		mcp25xxfd_wire_bits_add(&wb, 0, 1);
+		mcp25xxfd_wire_bits_add(&wb, can_len2dlc(len), 4);
+		for (i = 0; i < len; i++)
+			mcp25xxfd_wire_bits_add(&wb, frame->data[i], 8);
+		/* stuff count and crc with their fixed stuff bits */
+		wb.bits += (len > 16) ? 4 + 21 + 7 : 4 + 17 + 6;
+	} else {
+		/* RTR, IDE + r0 or r1 + r0, DLC, data and crc */
+		mcp25xxfd_wire_bits_add(&wb, rtr ? 4 : 0, 3);
+		mcp25xxfd_wire_bits_add(&wb, len, 4);
+		for (i = 0; i < len && !rtr; i++)
+			mcp25xxfd_wire_bits_add(&wb, frame->data[i], 8);
+		crc = wb.crc;
+		mcp25xxfd_wire_bits_add(&wb, crc, 15);
+		nominal = wb.bits;
+	}
 
-	/* clear all the fifos in range */
-	if (use_bulk_release_fifos)
-		ret = mcp25xxfd_bulk_release_fifos(spi, start, end);
-	else
-		ret = mcp25xxfd_normal_release_fifos(spi, start, end);
-	if (ret)
-		return ret;
+	/* crc delimiter, ack, EOF and intermission */
+	*data_bits = wb.bits - nominal;
+	return nominal + 1 + 2 + 7 + 3;
+}
 
-	/* preprocess data */
-	for (i = start; i < end ; i++) {
-		/* store the fifo to process */
-		rx = (struct mcp25xxfd_obj_rx *)
-			(priv->fifos.fifo_data + priv->fifos.fifo_address[i]);
-		/* process fifo stats */
-		mcp25xxfd_transform_rx(spi, rx);
-		/* increment usage */
-		priv->stats.fifo_usage[i]++;
-	}
+static u16 mcp25xxfd_tx_echo_queue(struct mcp25xxfd_priv *priv, u32 echo)
+{
+	if (priv->tx_ring_count)
+		return echo / priv->fifos.tx_fifo_depth;
 
 	return 0;
 }
 
-static int mcp25xxfd_bulk_read_fifos(struct spi_device *spi)
+/* a frame got transmitted or aborted */
+static void mcp25xxfd_tx_bql_done(struct mcp25xxfd_priv *priv, u32 echo)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	u32 mask = priv->status.rxif;
-	int i, start, end;
-	int ret;
-
-	/* find blocks of set bits top down */
-	for (i = priv->fifos.rx_fifo_start + priv->fifos.rx_fifos - 1;
-	     mask && (i >= priv->fifos.rx_fifo_start);
-	     i--) {
-		/* if the bit is 0 then continue loop to find a 1 */
-		if ((mask & BIT(i)) == 0)
-			continue;
+	u16 queue = mcp25xxfd_tx_echo_queue(priv, echo);
 
-		/* so we found a non-0 bit - this is start and end */
-		start = i;
-		end = i;
+	priv->tx_bql_pkts[queue]++;
+	priv->tx_bql_bits[queue] += priv->tx_wire_bits[echo];
+}
 
-		/* find the first bit set */
-		for (; mask & BIT(i); i--) {
-			mask &= ~BIT(i);
-			start = i;
-		}
+static void mcp25xxfd_tx_bql_completed(struct mcp25xxfd_priv *priv)
+{
+	int i;
 
-		/* now process that range */
-		ret = mcp25xxfd_bulk_read_fifo_range(spi, start, end + 1);
-		if (ret)
-			return ret;
+	for (i = 0; i < priv->net->real_num_tx_queues; i++) {
+		if (!priv->tx_bql_pkts[i])
+			continue;
+		netdev_tx_completed_queue(netdev_get_tx_queue(priv->net, i),
+					  priv->tx_bql_pkts[i],
+					  priv->tx_bql_bits[i]);
+		priv->tx_bql_pkts[i] = 0;
+		priv->tx_bql_bits[i] = 0;
 	}
-
-	return 0;
 }
 
-static int mcp25xxfd_can_ist_handle_rxif(struct spi_device *spi)
+/* the frame has been submitted - or got staged for a batch */
+static void mcp25xxfd_tx_bql_sent(struct mcp25xxfd_priv *priv,
+				  struct mcp25xxfd_tx_batch *batch,
+				  struct sk_buff *skb, u32 echo)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	u32 mask = priv->status.rxif;
-	int ret;
-
-	if (!mask)
-		return 0;
+	u32 data_bits;
+	u32 bits = mcp25xxfd_tx_wire_bits(skb, &data_bits) + data_bits;
 
-	/* read all the fifos - for non-fd case use bulk read optimization */
-	if (((priv->can.ctrlmode & CAN_CTRLMODE_FD) == 0) ||
-	    use_complete_fdfifo_read)
-		ret = mcp25xxfd_bulk_read_fifos(spi);
+	priv->tx_wire_bits[echo] = bits;
+	if (batch)
+		batch->wire_bits += bits;
 	else
-		ret = mcp25xxfd_read_fifos(spi);
+		netdev_tx_sent_queue(netdev_get_tx_queue(priv->net,
+							 skb_get_queue_mapping(skb)),
+				     bits);
+}
 
-	return 0;
+/* tx batching
+ *
+ * while the stack signals xmit_more the frames only get filled into the
+ * buffers of their slots, the slots get assigned (echo skb, masks, ring
+ * head) as if the frames had been sent. When the stack has no more
+ * frames, the queue got stopped or the next slot is not adjacent in
+ * SRAM the batch gets sent as a single spi_message:
+ * * one write of all the objects
+ * * the UINC + TXREQ of each slot (the same as the single frame trigger)
+ * the spi_message lives in the first slot of the batch, which does not
+ * get reused before its TEF entry has been processed.
+ * crc protected writes are limited in length, so there is no batching.
+ */
+
+static struct mcp25xxfd_tx_batch *
+mcp25xxfd_tx_batch_get(struct mcp25xxfd_priv *priv, u16 queue)
+{
+	if (!use_tx_batching || priv->spi_crc)
+		return NULL;
+
+	return &priv->tx_batch[queue];
 }
 
-static void mcp25xxfd_mark_tx_processed(struct spi_device *spi,
-					int fifo)
+static bool mcp25xxfd_tx_batch_fits(struct mcp25xxfd_priv *priv,
+				    struct mcp25xxfd_tx_batch *batch,
+				    struct mcp25xxfd_trigger_tx_message *txm)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	const u32 slot_size = sizeof(struct mcp25xxfd_obj_tx) +
+		priv->fifos.payload_size;
 
-	/* set mask */
-	priv->fifos.tx_processed_mask |= BIT(fifo);
+	if (!batch->count)
+		return true;
+	if (batch->count >= MCP25XXFD_TX_BATCH_MAX)
+		return false;
 
-	/* check if we should reenable the TX-queue */
-	if (mcp25xxfd_is_last_txfifo(spi, fifo))
-		priv->tx_queue_status = TX_QUEUE_STATUS_NEEDS_START;
+	return txm->addr == batch->txm[batch->count - 1]->addr + slot_size;
 }
 
-static int mcp25xxfd_can_ist_handle_tefif_handle_single(struct spi_device *spi)
+static void mcp25xxfd_tx_batch_add(struct mcp25xxfd_priv *priv,
+				   struct mcp25xxfd_tx_batch *batch,
+				   struct mcp25xxfd_trigger_tx_message *txm,
+				   int len)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	struct mcp25xxfd_obj_tef *tef;
-	int fifo;
-	int ret;
-
-	/* calc address in address space */
-	tef = (struct mcp25xxfd_obj_tef *)(priv->fifos.fifo_data +
-					   priv->fifos.tef_address);
+	batch->txm[batch->count++] = txm;
+	batch->last_len = len;
+}
 
-	/* read all the object data */
-	ret = mcp25xxfd_cmd_readn(spi,
-				  FIFO_DATA(priv->fifos.tef_address),
-				  tef,
-				  /* we do not read the last byte of the ts
-				   * to avoid MAB issiues
-				   */
-				  sizeof(*tef) - 1,
-				  priv->spi_speed_hz);
-	/* increment the counter to read next */
-	ret = mcp25xxfd_cmd_write_mask(spi,
-				       CAN_TEFCON,
-				       CAN_TEFCON_UINC,
-				       CAN_TEFCON_UINC,
-				       priv->spi_speed_hz);
+/* the frames of a batch that could not get sent get dropped
+ * and their slots get used again - unless it is the spi bus lock of
+ * the irq thread, then they get sent once it is released
+ */
+static void mcp25xxfd_tx_batch_drop(struct mcp25xxfd_priv *priv,
+				    struct mcp25xxfd_tx_batch *batch)
+{
+	struct mcp25xxfd_trigger_tx_message *txm;
+	struct mcp25xxfd_tx_ring *ring = NULL;
+	u32 i, slot;
+
+	if (priv->tx_ring_count)
+		ring = &priv->tx_rings[batch - priv->tx_batch];
+
+	for (i = 0; i < batch->count; i++) {
+		txm = batch->txm[i];
+		priv->stats.fifo_usage[txm->fifo]--;
+		priv->stats.tx_batch_drops++;
+		priv->net->stats.tx_dropped++;
+		if (ring) {
+			slot = txm - ring->txm;
+			can_free_echo_skb(priv->net, ring->echo_base + slot);
+			clear_bit(slot, &ring->inflight);
+		} else {
+			can_free_echo_skb(priv->net, txm->fifo);
+			priv->fifos.tx_submitted_mask &= ~BIT(txm->fifo);
+		}
+	}
+	if (ring)
+		WRITE_ONCE(ring->head, ring->head - batch->count);
+	batch->count = 0;
+	batch->wire_bits = 0;
 
-	/* transform the data to system byte order */
-	mcp25xxfd_obj_ts_from_le(&tef->header);
+	/* the queue may have been stopped due to the last of them */
+	if (priv->can.state == CAN_STATE_BUS_OFF)
+		return;
+	if (!ring)
+		priv->tx_queue_status = TX_QUEUE_STATUS_RUNNING;
+	if (!mcp25xxfd_tx_queue_held(priv, batch - priv->tx_batch))
+		netif_start_subqueue(priv->net, batch - priv->tx_batch);
+}
 
-	fifo = (tef->header.flags & CAN_OBJ_FLAGS_SEQ_MASK) >>
-		CAN_OBJ_FLAGS_SEQ_SHIFT;
+/* build the spi_message of a batch (in its first slot) */
+static struct mcp25xxfd_trigger_tx_message *
+mcp25xxfd_tx_batch_message(struct mcp25xxfd_priv *priv,
+			   struct mcp25xxfd_tx_batch *batch)
+{
+	struct mcp25xxfd_trigger_tx_message *first = batch->txm[0];
+	struct mcp25xxfd_trigger_tx_message *txm = first;
+	const u32 slot_size = sizeof(struct mcp25xxfd_obj_tx) +
+		priv->fifos.payload_size;
+	u32 i;
 
-	/* submit to queue */
-	tef->header.flags |= CAN_OBJ_FLAGS_CUSTOM_ISTEF;
-	mcp25xxfd_addto_queued_fifos(spi, &tef->header);
+	spi_message_init(&first->batch_msg);
+	first->batch_fifos = 0;
 
-	/* increment tef_address with rollover */
-	priv->fifos.tef_address += sizeof(*tef);
-	if (priv->fifos.tef_address > priv->fifos.tef_address_end)
-		priv->fifos.tef_address =
-			priv->fifos.tef_address_start;
+	/* all the objects in a single write - only the last one may be
+	 * shorter than the slot
+	 */
+	mcp25xxfd_calc_cmd_addr(INSTRUCTION_WRITE, FIFO_DATA(first->addr),
+				first->batch_cmd);
+	spi_message_add_tail(&first->batch_cmd_xfer, &first->batch_msg);
+	for (i = 0; i < batch->count; i++) {
+		txm = batch->txm[i];
+		txm->batch_xfer.len = slot_size;
+		txm->batch_xfer.cs_change = false;
+		spi_message_add_tail(&txm->batch_xfer, &first->batch_msg);
+		first->batch_fifos |= BIT(txm->fifo);
+	}
+	txm->batch_xfer.len = batch->last_len;
+	txm->batch_xfer.cs_change = true;
 
-	/* and mark as processed right now */
-	mcp25xxfd_mark_tx_processed(spi, fifo);
+	/* move the fifos on and request the transmission - TXREQ stays set
+	 * for the frames already pending in the fifo
+	 */
+	for (i = 0; i < batch->count; i++) {
+		txm = batch->txm[i];
+		txm->uinc_xfer.cs_change = i < batch->count - 1;
+		spi_message_add_tail(&txm->uinc_xfer, &first->batch_msg);
+	}
 
-	return 0;
+	return first;
 }
 
-static int mcp25xxfd_can_ist_handle_tefif_conservative(struct spi_device *spi)
+/* submit the spi_message of a batch - returns -EAGAIN if the spi bus lock
+ * of a device on the controller holds it back, the queue is then stopped
+ * and mcp25xxfd_bus_unlock submits it again. the submission is retried
+ * once if the lock got released in the meantime, any other error means
+ * the batch has to be dropped.
+ */
+static int mcp25xxfd_tx_batch_submit(struct mcp25xxfd_priv *priv, u16 queue,
+				     struct spi_message *msg)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	u32 val[2];
+	bool retried = false;
 	int ret;
 
-	while (1) {
-		/* get the current TEFSTA and TEFUA */
-		ret = mcp25xxfd_cmd_readn(priv->spi,
-					  CAN_TEFSTA,
-					  val,
-					  8,
-					  priv->spi_speed_hz);
-		if (ret)
-			return ret;
-		mcp25xxfd_convert_to_cpu(val, 2);
-
-		/* check for interrupt flags */
-		if (!(val[0] & CAN_TEFSTA_TEFNEIF))
-			return 0;
-
-		if (priv->fifos.tef_address != val[1]) {
-			dev_err(&spi->dev,
-				"TEF Address mismatch - read: %04x calculated: %04x\n",
-				val[1], priv->fifos.tef_address);
-			priv->fifos.tef_address = val[1];
-		}
-
-		ret = mcp25xxfd_can_ist_handle_tefif_handle_single(spi);
-		if (ret)
-			return ret;
+	while ((ret = spi_async(priv->spi, msg))) {
+		priv->stats.tx_spi_busy++;
+		if (ret != -EBUSY)
+			break;
+		if (mcp25xxfd_bus_lock_stop_queue(priv, queue))
+			return -EAGAIN;
+		if (retried)
+			break;
+		retried = true;
 	}
 
-	return 0;
+	return ret;
 }
 
-static int mcp25xxfd_can_ist_handle_tefif_count(struct spi_device *spi,
-						int count)
+static int mcp25xxfd_tx_batch_flush(struct mcp25xxfd_priv *priv,
+				    struct mcp25xxfd_tx_batch *batch)
 {
-	int i;
+	struct mcp25xxfd_trigger_tx_message *first;
 	int ret;
 
-	/* now clear TEF for each */
-	/* TODO: optimize for BULK reads, as we (hopefully) know COUNT */
-	for (i = 0; i < count; i++) {
-		/* handle a single TEF */
-		ret = mcp25xxfd_can_ist_handle_tefif_handle_single(spi);
-		if (ret)
-			return ret;
+	if (!batch->count)
+		return 0;
+
+	first = mcp25xxfd_tx_batch_message(priv, batch);
+	first->batch_msg.complete = mcp25xxfd_mark_tx_batch_pending;
+	first->batch_msg.context = first;
+
+	ret = mcp25xxfd_tx_batch_submit(priv, batch - priv->tx_batch,
+					&first->batch_msg);
+	if (ret) {
+		if (ret != -EAGAIN)
+			mcp25xxfd_tx_batch_drop(priv, batch);
+		return ret;
 	}
 
+	priv->stats.tx_batches++;
+	priv->stats.tx_batch_frames += batch->count;
+	batch->count = 0;
+
+	netdev_tx_sent_queue(netdev_get_tx_queue(priv->net,
+						 batch - priv->tx_batch),
+			     batch->wire_bits);
+	batch->wire_bits = 0;
+
 	return 0;
 }
 
-static int mcp25xxfd_can_ist_handle_tefif(struct spi_device *spi)
+/* the tx ring
+ *
+ * start_xmit fills the slot at head and triggers the transmission
+ * (TXREQ + UINC) in the same spi_message, so the controller sends the
+ * frames back to back (strictly in order unless it is the TXQ), while
+ * the queue keeps running as long as the slot at head is free.
+ * the slot gets freed when its TEF entry has been processed.
+ * start_xmit only modifies head and the irq thread only modifies tail,
+ * inflight is modified with atomic bitops by both.
+ */
+
+static u32 mcp25xxfd_tx_ring_seq(struct mcp25xxfd_tx_ring *ring, u32 count)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	u32 pending = priv->fifos.tx_pending_mask_in_irq &
-		(~priv->fifos.tx_processed_mask);
-	int count;
+	u32 seq = ring->echo_base + (count & (ring->depth - 1));
 
-	/* calculate the number of fifos that have been processed */
-	count = hweight_long(pending);
-	count -= hweight_long(priv->status.txreq & pending);
+	if (count & ring->depth)
+		seq |= MCP25XXFD_TX_RING_SEQ_GEN;
 
-	/* in case of unexpected results handle "safely" */
-	if (count <= 0)
-		return mcp25xxfd_can_ist_handle_tefif_conservative(spi);
+	return seq;
+}
 
-	return mcp25xxfd_can_ist_handle_tefif_count(spi, count);
+static bool mcp25xxfd_tx_ring_full(struct mcp25xxfd_tx_ring *ring)
+{
+	return test_bit(READ_ONCE(ring->head) & (ring->depth - 1),
+			&ring->inflight);
 }
 
-static int mcp25xxfd_can_ist_handle_txatif_fifo(struct spi_device *spi,
-						int fifo)
+/* whether nothing keeps the (stopped) queue stopped any longer */
+static bool mcp25xxfd_tx_queue_may_wake(struct mcp25xxfd_priv *priv,
+					u16 queue)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	u32 val;
-	int ret;
+	if (priv->can.state == CAN_STATE_BUS_OFF ||
+	    mcp25xxfd_tx_queue_held(priv, queue))
+		return false;
 
-	/* read fifo status */
-	ret = mcp25xxfd_cmd_read(spi,
-				 CAN_FIFOSTA(fifo),
-				 &val,
-				 priv->spi_speed_hz);
-	if (ret)
-		return ret;
+	if (priv->tx_ring_count)
+		return !mcp25xxfd_tx_ring_full(&priv->tx_rings[queue]) &&
+			!READ_ONCE(priv->tx_launch[queue].txm);
 
-	/* clear the relevant interrupt flags */
-	ret = mcp25xxfd_cmd_write_mask(spi,
-				       CAN_FIFOSTA(fifo),
-				       0,
-				       CAN_FIFOSTA_TXABT |
-				       CAN_FIFOSTA_TXLARB |
-				       CAN_FIFOSTA_TXERR |
-				       CAN_FIFOSTA_TXATIF,
-				       priv->spi_speed_hz);
+	return priv->tx_queue_status == TX_QUEUE_STATUS_RUNNING;
+}
 
-	/* for specific cases we could trigger a retransmit
-	 * instead of an abort.
-	 */
+static netdev_tx_t mcp25xxfd_tx_ring_xmit(struct sk_buff *skb,
+					  struct net_device *net,
+					  struct mcp25xxfd_tx_batch *batch)
+{
+	struct mcp25xxfd_priv *priv = netdev_priv(net);
+	struct mcp25xxfd_tx_ring *ring =
+		&priv->tx_rings[skb_get_queue_mapping(skb)];
+	struct spi_device *spi = priv->spi;
+	u32 head, slot, seq;
+	int ret;
 
-	/* and we release it from the echo_skb buffer
-	 * NOTE: this is one place where packet delivery will not
-	 * be ordered, as we do not have any timing information
-	 * when this occurred
-	 */
-	can_get_echo_skb(priv->net, fifo);
+	/* nothing may follow a frame waiting for its launch time */
+	if (READ_ONCE(priv->tx_launch[ring->queue].txm)) {
+		netif_stop_subqueue(net, ring->queue);
+		smp_mb();
+		if (!READ_ONCE(priv->tx_launch[ring->queue].txm))
+			netif_start_subqueue(net, ring->queue);
+		return NETDEV_TX_BUSY;
+	}
 
-	/* but we need to run a bit of cleanup */
-	priv->status.txif &= ~BIT(fifo);
-	priv->net->stats.tx_aborted_errors++;
+	/* send the staged frames first at the end of the fifo */
+	if (batch &&
+	    !mcp25xxfd_tx_batch_fits(priv, batch,
+				     &ring->txm[ring->head &
+						(ring->depth - 1)])) {
+		mcp25xxfd_tx_batch_flush(priv, batch);
+		/* held back by the spi bus lock */
+		if (batch->count)
+			return NETDEV_TX_BUSY;
+	}
 
-	/* mark the fifo as processed */
-	 mcp25xxfd_mark_tx_processed(spi, fifo);
+	head = ring->head;
+	slot = head & (ring->depth - 1);
+	seq = mcp25xxfd_tx_ring_seq(ring, head);
 
-	/* handle all the known cases accordingly - ignoring FIFO full */
-	val &= CAN_FIFOSTA_TXABT |
-		CAN_FIFOSTA_TXLARB |
-		CAN_FIFOSTA_TXERR;
-	switch (val) {
-	case CAN_FIFOSTA_TXERR:
-		break;
-	default:
-		dev_warn_ratelimited(&spi->dev,
-				     "Unknown TX-Fifo abort condition: %08x - stopping tx-queue\n",
-				     val);
-		break;
+	/* should not happen, as the queue gets stopped when full */
+	if (test_bit(slot, &ring->inflight)) {
+		netif_stop_subqueue(net, ring->queue);
+		return NETDEV_TX_BUSY;
 	}
 
-	return 0;
-}
+	if (can_is_canfd_skb(skb))
+		ret = mcp25xxfd_transmit_fdmessage(spi, &ring->txm[slot], seq,
+						   skb, batch);
+	else
+		ret = mcp25xxfd_transmit_message(spi, &ring->txm[slot], seq,
+						 skb, batch);
+	if (ret != NETDEV_TX_OK) {
+		priv->stats.tx_spi_busy++;
+		mcp25xxfd_bus_lock_stop_queue(priv, ring->queue);
+		return ret;
+	}
 
-static int mcp25xxfd_can_ist_handle_txatif(struct spi_device *spi)
-{
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	int i, fifo;
-	int ret;
+	mcp25xxfd_tx_bql_sent(priv, batch, skb, ring->echo_base + slot);
+	mcp25xxfd_tx_timestamp_prepare(priv, skb);
+	can_put_echo_skb(skb, net, ring->echo_base + slot);
+	priv->stats.fifo_usage[ring->fifo]++;
 
-	/* process all the fifos with that flag set */
-	for (i = 0, fifo = priv->fifos.tx_fifo_start;
-	    i < priv->fifos.tx_fifos; i++, fifo++) {
-		if (priv->status.txatif & BIT(fifo)) {
-			ret = mcp25xxfd_can_ist_handle_txatif_fifo(spi, fifo);
-			if (ret)
-				return ret;
-		}
+	ring->seq[slot] = seq;
+	set_bit(slot, &ring->inflight);
+	WRITE_ONCE(ring->head, head + 1);
+
+	/* stop the queue when full - and recheck against a concurrent
+	 * completion in the irq thread
+	 */
+	if (mcp25xxfd_tx_ring_full(ring)) {
+		priv->stats.tx_ring_full++;
+		netif_stop_subqueue(net, ring->queue);
+		smp_mb__after_atomic();
+		if (!mcp25xxfd_tx_ring_full(ring))
+			netif_start_subqueue(net, ring->queue);
 	}
 
-	return 0;
+	return NETDEV_TX_OK;
 }
 
-static void mcp25xxfd_error_skb(struct net_device *net)
+static void mcp25xxfd_tx_ring_free_slot(struct mcp25xxfd_priv *priv,
+					struct mcp25xxfd_tx_ring *ring,
+					u32 slot, bool transmitted)
 {
-	struct mcp25xxfd_priv *priv = netdev_priv(net);
-	struct sk_buff *skb;
-	struct can_frame *frame;
-
-	skb = alloc_can_err_skb(net, &frame);
-	if (skb) {
-		frame->can_id = priv->can_err_id;
-		memcpy(frame->data, priv->can_err_data, 8);
-		netif_rx_ni(skb);
+	if (transmitted) {
+		can_get_echo_skb(priv->net, ring->echo_base + slot);
 	} else {
-		netdev_err(net, "cannot allocate error skb\n");
+		can_free_echo_skb(priv->net, ring->echo_base + slot);
+		priv->net->stats.tx_aborted_errors++;
 	}
+	mcp25xxfd_tx_bql_done(priv, ring->echo_base + slot);
+	priv->tx_launch_time[ring->echo_base + slot] = 0;
+	clear_bit(slot, &ring->inflight);
 }
 
-static int mcp25xxfd_can_ist_handle_rxovif(struct spi_device *spi)
+/* free the slot with seq - in the ordered case also the ones before */
+static void mcp25xxfd_tx_ring_complete(struct mcp25xxfd_priv *priv,
+				       u32 seq, u32 ts)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	u32 mask = priv->status.rxovif;
-	int i;
-	int ret;
+	u32 idx = seq & MCP25XXFD_TX_RING_SEQ_SLOT_MASK;
+	u32 depth = priv->fifos.tx_fifo_depth;
+	struct mcp25xxfd_tx_ring *ring;
+	u32 slot, head, tail;
+	u32 count;
+
+	/* the echo skb index tells the ring */
+	if (idx / depth >= priv->tx_ring_count) {
+		priv->stats.tx_ring_seq_errors++;
+		return;
+	}
+	ring = &priv->tx_rings[idx / depth];
+	slot = idx - ring->echo_base;
+	head = READ_ONCE(ring->head);
+	tail = ring->tail;
 
-	/* clear all fifos that have an overflow bit set */
-	for (i = 0; i < 32; i++) {
-		if (mask & BIT(i)) {
-			ret = mcp25xxfd_cmd_write_mask(spi,
-						       CAN_FIFOSTA(i),
-						       0,
-						       CAN_FIFOSTA_RXOVIF,
-						       priv->spi_speed_hz);
-			if (ret)
-				return ret;
-			/* update statistics */
-			priv->net->stats.rx_over_errors++;
-			priv->net->stats.rx_errors++;
-			priv->stats.rx_overflow++;
-			priv->can_err_id |= CAN_ERR_CRTL;
-			priv->can_err_data[1] |= CAN_ERR_CRTL_RX_OVERFLOW;
-		}
+	if (!test_bit(slot, &ring->inflight) || ring->seq[slot] != seq) {
+		priv->stats.tx_ring_seq_errors++;
+		return;
 	}
 
-	return 0;
-}
+	if (ring->ordered) {
+		/* find the frame in flight that this TEF entry belongs to */
+		count = tail + ((slot - tail) & (ring->depth - 1));
+		if (count - tail >= head - tail) {
+			priv->stats.tx_ring_seq_errors++;
+			return;
+		}
 
-static int mcp25xxfd_can_ist_handle_modif(struct spi_device *spi)
-{
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	int omode = priv->active_can_mode;
-	int mode;
-	int ret;
+		/* frames skipped in the TEF got aborted */
+		for (; tail != count; tail++)
+			mcp25xxfd_tx_ring_free_slot(priv, ring,
+						    tail & (ring->depth - 1),
+						    false);
+		WRITE_ONCE(ring->tail, tail + 1);
+	}
 
-	/* Note that this irq does not get triggered in all situations
-	 * for example SERRIF will move to RESTICTED or LISTENONLY
-	 * but MODIF will not be raised!
-	 */
+	mcp25xxfd_tx_timestamp(priv, idx, ts);
+	mcp25xxfd_tx_launch_report(priv, idx, ts);
+	priv->tx_retransmit[ring->fifo].count = 0;
+	mcp25xxfd_tx_ring_free_slot(priv, ring, slot, true);
 
-	/* get the mode */
-	ret = mcp25xxfd_get_opmode(spi, &mode, priv->spi_speed_hz);
-	if (ret)
-		return ret;
+	/* wake the queue if it got stopped because of a full ring */
+	smp_mb__after_atomic();
+	if (__netif_subqueue_stopped(priv->net, ring->queue) &&
+	    mcp25xxfd_tx_queue_may_wake(priv, ring->queue))
+		netif_wake_subqueue(priv->net, ring->queue);
+}
 
-	/* if we are restricted, then return to "normal" mode */
-	if (mode == CAN_CON_MODE_RESTRICTED)
-		return mcp25xxfd_set_normal_opmode(spi);
+/* launch time
+ *
+ * the etf qdisc hands over the frames in the order of their launch
+ * time (CLOCK_TAI) some time ahead of it, so there is at most one frame
+ * staged per queue and the queue stays stopped until its trigger got
+ * sent. the frames get staged with plain writes, so there is no launch
+ * time with the crc protected spi commands.
+ */
 
-	/* the controller itself will transition to sleep, so we ignore it */
-	if (mode == CAN_CON_MODE_SLEEP)
-		return 0;
+static bool mcp25xxfd_tx_launch_enabled(struct mcp25xxfd_priv *priv,
+					u16 queue)
+{
+	return priv->tx_launch[queue].enabled && priv->tx_ring_count &&
+		!priv->spi_crc;
+}
 
-	/* switches to the same mode as before are also ignored
-	 * - this typically happens if the driver is shortly
-	 *   switching to a different mode and then returning to the
-	 *   original mode
-	 */
-	if (mode == omode)
-		return 0;
+static void mcp25xxfd_tx_launch_done(void *context)
+{
+	struct mcp25xxfd_tx_launch *launch = context;
+	struct mcp25xxfd_priv *priv = launch->priv;
 
-	/* these we need to handle correctly, so warn and give context */
-	dev_warn(&spi->dev,
-		 "Controller unexpectedly switched from mode %s(%u) to %s(%u)\n",
-		 mcp25xxfd_mode_names[omode], omode,
-		 mcp25xxfd_mode_names[mode], mode);
+	WRITE_ONCE(launch->txm, NULL);
 
-	return 0;
+	smp_mb();
+	if (mcp25xxfd_tx_queue_may_wake(priv, launch->queue))
+		netif_wake_subqueue(priv->net, launch->queue);
 }
 
-static int mcp25xxfd_can_ist_handle_cerrif(struct spi_device *spi)
+static enum hrtimer_restart mcp25xxfd_tx_launch_timer(struct hrtimer *timer)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-
-	/* in principle we could also delay reading bdiag registers
-	 * until we get here - it would add some extra delay in the
-	 * error case, but be slightly faster in the "normal" case.
-	 * slightly faster would be saving 8 bytes of spi transfer.
+	struct mcp25xxfd_tx_launch *launch =
+		container_of(timer, struct mcp25xxfd_tx_launch, timer);
+	struct mcp25xxfd_priv *priv = launch->priv;
+
+	/* the prebuilt trigger of the slot */
+	spi_message_init(&launch->msg);
+	launch->msg.complete = mcp25xxfd_tx_launch_done;
+	launch->msg.context = launch;
+	launch->xfer.speed_hz = priv->spi_speed_hz;
+	launch->xfer.tx_buf = launch->txm->trigger_cmd;
+	launch->xfer.len = launch->txm->trigger_xfer.len;
+	spi_message_add_tail(&launch->xfer, &launch->msg);
+
+	/* the spi bus may be locked (by the irq thread of this or of
+	 * another device) - try again soon
 	 */
+	if (spi_async(priv->spi, &launch->msg)) {
+		priv->stats.tx_launch_retries++;
+		hrtimer_forward_now(timer, ns_to_ktime(10 * NSEC_PER_USEC));
+		return HRTIMER_RESTART;
+	}
 
-	dev_err_ratelimited(&spi->dev, "CAN Bus error\n");
-	priv->can_err_id |= CAN_ERR_BUSERROR;
+	return HRTIMER_NORESTART;
+}
 
-	if (priv->status.bdiag1 &
-	    (CAN_BDIAG1_DBIT0ERR | CAN_BDIAG1_NBIT0ERR)) {
-		priv->can_err_id |= CAN_ERR_BUSERROR;
-		priv->can_err_data[2] |= CAN_ERR_PROT_BIT0;
-		priv->bdiag1_clear_mask |= CAN_BDIAG1_DBIT0ERR |
-			CAN_BDIAG1_NBIT0ERR;
-	}
-	if (priv->status.bdiag1 &
-	    (CAN_BDIAG1_DBIT1ERR | CAN_BDIAG1_NBIT1ERR)) {
-		priv->can_err_id |= CAN_ERR_BUSERROR;
-		priv->can_err_data[2] |= CAN_ERR_PROT_BIT1;
-		priv->bdiag1_clear_mask |= CAN_BDIAG1_DBIT1ERR |
-			CAN_BDIAG1_NBIT1ERR;
-	}
-	if (priv->status.bdiag1 &
-	    (CAN_BDIAG1_DSTUFERR | CAN_BDIAG1_NSTUFERR)) {
-		priv->can_err_id |= CAN_ERR_BUSERROR;
-		priv->can_err_data[2] |= CAN_ERR_PROT_STUFF;
-		priv->bdiag1_clear_mask |= CAN_BDIAG1_DSTUFERR |
-			CAN_BDIAG1_NSTUFERR;
-	}
-	if (priv->status.bdiag1 &
-	    (CAN_BDIAG1_DFORMERR | CAN_BDIAG1_NFORMERR)) {
-		priv->can_err_id |= CAN_ERR_BUSERROR;
-		priv->can_err_data[2] |= CAN_ERR_PROT_FORM;
-		priv->bdiag1_clear_mask |= CAN_BDIAG1_DFORMERR |
-			CAN_BDIAG1_NFORMERR;
-	}
-	if (priv->status.bdiag1 & CAN_BDIAG1_NACKERR) {
-		priv->can_err_id |= CAN_ERR_ACK;
-		priv->bdiag1_clear_mask |= CAN_BDIAG1_NACKERR;
+/* write the frame staged in the batch of the queue to its slot and arm
+ * the timer - the frame gets dropped if that fails (other than due to
+ * the spi bus lock of the irq thread)
+ */
+static void mcp25xxfd_tx_launch_stage(struct mcp25xxfd_priv *priv,
+				      u16 queue, ktime_t time)
+{
+	struct mcp25xxfd_tx_launch *launch = &priv->tx_launch[queue];
+	struct mcp25xxfd_tx_batch *batch = &priv->tx_batch[queue];
+	struct mcp25xxfd_tx_ring *ring = &priv->tx_rings[queue];
+	struct mcp25xxfd_trigger_tx_message *txm = batch->txm[0];
+	ktime_t now = ktime_get_clocktai();
+
+	spi_message_init(&txm->batch_msg);
+	mcp25xxfd_calc_cmd_addr(INSTRUCTION_WRITE, FIFO_DATA(txm->addr),
+				txm->batch_cmd);
+	spi_message_add_tail(&txm->batch_cmd_xfer, &txm->batch_msg);
+	txm->batch_xfer.len = batch->last_len;
+	txm->batch_xfer.cs_change = false;
+	spi_message_add_tail(&txm->batch_xfer, &txm->batch_msg);
+
+	switch (mcp25xxfd_tx_batch_submit(priv, queue, &txm->batch_msg)) {
+	case 0:
+		break;
+	case -EAGAIN:
+		launch->held = time;
+		return;
+	default:
+		mcp25xxfd_tx_batch_drop(priv, batch);
+		return;
 	}
 
-	return 0;
+	batch->count = 0;
+	netdev_tx_sent_queue(netdev_get_tx_queue(priv->net, queue),
+			     batch->wire_bits);
+	batch->wire_bits = 0;
+
+	/* the TEF time stamps are on the host clock */
+	priv->tx_launch_time[ring->echo_base + (txm - ring->txm)] =
+		ktime_sub(time, ktime_sub(now, ktime_get_real()));
+	priv->stats.tx_launch_frames++;
+	if (ktime_before(time, now))
+		priv->stats.tx_launch_late++;
+
+	WRITE_ONCE(launch->txm, txm);
+	hrtimer_start(&launch->timer, ktime_sub_us(time, tx_launch_lead_us),
+		      HRTIMER_MODE_ABS);
+
+	/* no other frame until the trigger got sent */
+	netif_stop_subqueue(priv->net, queue);
+	smp_mb();
+	if (!READ_ONCE(launch->txm))
+		netif_start_subqueue(priv->net, queue);
 }
 
-static int mcp25xxfd_can_ist_handle_eccif(struct spi_device *spi)
+/* the staged frame does not get triggered any longer, a trigger already
+ * sent is ahead of anything the caller sends via spi afterwards
+ */
+static void mcp25xxfd_tx_launch_cancel(struct mcp25xxfd_priv *priv,
+				       u16 queue)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	int ret;
-	u32 val;
-	u32 addr;
+	struct mcp25xxfd_tx_launch *launch = &priv->tx_launch[queue];
 
-	priv->can_err_id |= CAN_ERR_CRTL;
-	priv->can_err_data[1] |= CAN_ERR_CRTL_UNSPEC;
+	if (hrtimer_cancel(&launch->timer))
+		WRITE_ONCE(launch->txm, NULL);
+}
 
-	/* read ECC status register */
-	ret = mcp25xxfd_cmd_read(spi, MCP25XXFD_ECCSTAT, &val,
-				 priv->spi_speed_hz);
-	if (ret)
-		return ret;
+/* send the frames the spi bus lock held back in the batch of the queue
+ * - called once the lock got released
+ */
+static void mcp25xxfd_tx_batch_resume(struct mcp25xxfd_priv *priv,
+				      u16 queue)
+{
+	struct netdev_queue *txq = netdev_get_tx_queue(priv->net, queue);
+	struct mcp25xxfd_tx_launch *launch = &priv->tx_launch[queue];
+	ktime_t time = launch->held;
+
+	/* start_xmit may still be on its way out */
+	__netif_tx_lock_bh(txq);
+	launch->held = 0;
+	if (time)
+		mcp25xxfd_tx_launch_stage(priv, queue, time);
+	else
+		mcp25xxfd_tx_batch_flush(priv, &priv->tx_batch[queue]);
+	__netif_tx_unlock_bh(txq);
+}
 
-	addr = (val & MCP25XXFD_ECCSTAT_ERRADDR_MASK) >>
-		MCP25XXFD_ECCSTAT_ERRADDR_SHIFT;
+/* tx shaper
+ *
+ * bulk traffic on some of the netdev tx queues (by default all of them)
+ * may be limited to a share of the bus time, leaving the rest to the
+ * other queues and nodes. a frame costs the time of its bits on the
+ * wire: with the stuff bits of its actual content and with the data
+ * phase at the data bitrate. the bucket may run into debt by one frame,
+ * then the shaped queues get stopped until an hrtimer finds it refilled.
+ * the spacing of the frames within the controller is left to TXBWS
+ * (which gets applied on the next open).
+ */
 
-	dev_err_ratelimited(&spi->dev,
-			    "ECC %s bit error at %03x\n",
-			    (val & MCP25XXFD_ECCSTAT_DEDIF) ?
-			    "double" : "single",
-			    addr);
+/* the time in ns a frame (of a valid skb) occupies the bus */
+static u32 mcp25xxfd_tx_wire_time(struct mcp25xxfd_priv *priv,
+				  struct sk_buff *skb)
+{
+	struct canfd_frame *frame = (struct canfd_frame *)skb->data;
+	u32 nbitrate = priv->can.bittiming.bitrate;
+	u32 dbitrate = priv->can.data_bittiming.bitrate;
+	u32 bits, data_bits;
 
-	return mcp25xxfd_cmd_write(spi, MCP25XXFD_ECCSTAT, 0,
-				 priv->spi_speed_hz);
+	if (!nbitrate)
+		return 0;
+
+	bits = mcp25xxfd_tx_wire_bits(skb, &data_bits);
+	if (!(frame->flags & CANFD_BRS) || !dbitrate) {
+		bits += data_bits;
+		data_bits = 0;
+	}
+
+	return div_u64((u64)bits * NSEC_PER_SEC, nbitrate) +
+		(data_bits ? div_u64((u64)data_bits * NSEC_PER_SEC, dbitrate) :
+		 0);
 }
 
-static int mcp25xxfd_can_ist_handle_serrif_txmab(struct spi_device *spi)
+static bool mcp25xxfd_tx_shaper_enabled(struct mcp25xxfd_priv *priv,
+					u16 queue)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-
-	priv->net->stats.tx_fifo_errors++;
-	priv->net->stats.tx_errors++;
-	priv->stats.tx_mab++;
+	return READ_ONCE(priv->tx_shaper.share) &&
+		(READ_ONCE(priv->tx_shaper.queues) & BIT(queue));
+}
 
-	return 0;
+/* called with the lock held */
+static u32 mcp25xxfd_tx_shaper_refill(struct mcp25xxfd_tx_shaper *shaper)
+{
+	u32 share = min_t(u32, READ_ONCE(shaper->share), 1000);
+	s64 burst = (s64)READ_ONCE(shaper->burst_us) * NSEC_PER_USEC;
+	ktime_t now = ktime_get();
+	s64 elapsed = ktime_to_ns(ktime_sub(now, shaper->last));
+
+	/* an hour of idling fills any bucket */
+	elapsed = min_t(s64, elapsed, 3600LL * NSEC_PER_SEC);
+	shaper->last = now;
+	shaper->tokens = min_t(s64, shaper->tokens +
+			       div_u64((u64)elapsed * share, 1000), burst);
+
+	return share;
 }
 
-static int mcp25xxfd_can_ist_handle_serrif_rxmab(struct spi_device *spi)
+/* stop the queue until the debt is paid off - with the lock held */
+static void mcp25xxfd_tx_shaper_throttle(struct mcp25xxfd_priv *priv,
+					 u16 queue, u32 share)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct mcp25xxfd_tx_shaper *shaper = &priv->tx_shaper;
 
-	priv->net->stats.rx_dropped++;
-	priv->net->stats.rx_errors++;
-	priv->stats.rx_mab++;
+	WRITE_ONCE(shaper->stopped, shaper->stopped | BIT(queue));
+	netif_stop_subqueue(priv->net, queue);
 
-	return 0;
+	if (!hrtimer_is_queued(&shaper->timer))
+		hrtimer_start(&shaper->timer,
+			      ns_to_ktime(div_u64(-shaper->tokens * 1000,
+						  share)),
+			      HRTIMER_MODE_REL);
 }
 
-static int mcp25xxfd_can_ist_handle_serrif(struct spi_device *spi)
+/* whether the frame may get sent now */
+static bool mcp25xxfd_tx_shaper_admit(struct mcp25xxfd_priv *priv,
+				      u16 queue)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	u32 clear;
-	int ret;
+	struct mcp25xxfd_tx_shaper *shaper = &priv->tx_shaper;
+	unsigned long flags;
+	bool ret = true;
+	u32 share;
+
+	spin_lock_irqsave(&shaper->lock, flags);
+	share = mcp25xxfd_tx_shaper_refill(shaper);
+	if (share && shaper->tokens < 0) {
+		priv->stats.tx_shaper_requeued++;
+		mcp25xxfd_tx_shaper_throttle(priv, queue, share);
+		ret = false;
+	}
+	spin_unlock_irqrestore(&shaper->lock, flags);
 
-	/* clear some interrupts immediately,
-	 * so that we get notified if they happen again
-	 */
-	clear = CAN_INT_SERRIF | CAN_INT_MODIF | CAN_INT_IVMIF;
-	ret = mcp25xxfd_cmd_write_mask(spi, CAN_INT,
-				       priv->status.intf & (~clear),
-				       clear,
-				       priv->spi_speed_hz);
-	if (ret)
-		return ret;
+	return ret;
+}
 
-	/* Errors here are:
-	 * * Bus Bandwidth Error: when a RX Message Assembly Buffer
-	 *   is still full when the next message has already arrived
-	 *   the recived message shall be ignored
-	 * * TX MAB Underflow: when a TX Message is invalid
-	 *   due to ECC errors or TXMAB underflow
-	 *   in this situatioon the system will transition to
-	 *   Restricted or Listen Only mode
-	 */
+/* the frame got sent (or staged) */
+static void mcp25xxfd_tx_shaper_charge(struct mcp25xxfd_priv *priv,
+				       u16 queue, u32 bus_ns)
+{
+	struct mcp25xxfd_tx_shaper *shaper = &priv->tx_shaper;
+	unsigned long flags;
+	u32 share;
+
+	spin_lock_irqsave(&shaper->lock, flags);
+	share = mcp25xxfd_tx_shaper_refill(shaper);
+	shaper->tokens -= bus_ns;
+	priv->stats.tx_shaper_frames++;
+	priv->stats.tx_shaper_bus_ns += bus_ns;
+	if (share && shaper->tokens < 0) {
+		priv->stats.tx_shaper_throttled++;
+		mcp25xxfd_tx_shaper_throttle(priv, queue, share);
+	}
+	spin_unlock_irqrestore(&shaper->lock, flags);
+}
 
-	priv->can_err_id |= CAN_ERR_CRTL;
-	priv->can_err_data[1] |= CAN_ERR_CRTL_UNSPEC;
+static enum hrtimer_restart mcp25xxfd_tx_shaper_timer(struct hrtimer *timer)
+{
+	struct mcp25xxfd_tx_shaper *shaper =
+		container_of(timer, struct mcp25xxfd_tx_shaper, timer);
+	struct mcp25xxfd_priv *priv = shaper->priv;
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	unsigned long flags;
+	u32 share, stopped;
+	int i;
 
-	/* a mode change + invalid message would indicate
-	 * TX MAB Underflow
-	 */
-	if ((priv->status.intf & CAN_INT_MODIF) &&
-	    (priv->status.intf & CAN_INT_IVMIF)) {
-		return mcp25xxfd_can_ist_handle_serrif_txmab(spi);
+	spin_lock_irqsave(&shaper->lock, flags);
+	share = mcp25xxfd_tx_shaper_refill(shaper);
+	if (share && shaper->tokens < 0) {
+		hrtimer_forward_now(timer,
+				    ns_to_ktime(div_u64(-shaper->tokens * 1000,
+							share)));
+		ret = HRTIMER_RESTART;
+	} else {
+		stopped = shaper->stopped;
+		WRITE_ONCE(shaper->stopped, 0);
+		for (i = 0; i < priv->net->real_num_tx_queues; i++)
+			if ((stopped & BIT(i)) &&
+			    mcp25xxfd_tx_queue_may_wake(priv, i))
+				netif_wake_subqueue(priv->net, i);
 	}
+	spin_unlock_irqrestore(&shaper->lock, flags);
 
-	/* for RX there is only the RXIF an indicator
-	 * - surprizingly RX-MAB does not change mode or anything
-	 */
-	if (priv->status.intf & CAN_INT_RXIF)
-		return mcp25xxfd_can_ist_handle_serrif_rxmab(spi);
+	return ret;
+}
 
-	/* the final case */
-	dev_warn_ratelimited(&spi->dev,
-			     "unidentified system error - intf =  %08x\n",
-			     priv->status.intf);
+/* cyclic tx
+ *
+ * periodic frames (e.g. of a simulated ECU) configured in a table via
+ * debugfs get sent by the driver itself, without skbs and without the
+ * stack: an hrtimer writes the frames due (with the same period and
+ * phase usually several at a time) as a batch to a dedicated tx fifo
+ * (see tx_cyclic_depth) - a single write of the objects and the
+ * UINC + TXREQ of each slot in one spi_message. Their TEF entries are told
+ * apart by MCP25XXFD_TX_RING_SEQ_CYCLIC and free the slots in order,
+ * the intervals between their time stamps give the achieved jitter.
+ * a cycle without a free slot (or with the spi bus busy) is missed -
+ * there is no catching up.
+ * the fifo does not get aborted (unlimited attempts) and is not part of
+ * the tx fifo mask, so the tx paths do not see it.
+ */
 
-	return 0;
+static bool mcp25xxfd_tx_cyclic_before(struct mcp25xxfd_tx_cyclic *cyclic,
+				       u32 a, u32 b)
+{
+	return ktime_before(cyclic->entries[cyclic->heap[a]].next,
+			    cyclic->entries[cyclic->heap[b]].next);
 }
 
-static int mcp25xxfd_can_ist_handle_ivmif(struct spi_device *spi)
+static void mcp25xxfd_tx_cyclic_sift_down(struct mcp25xxfd_tx_cyclic *cyclic,
+					  u32 i)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	u32 child;
 
-	/* if we have a systemerror as well, then ignore it */
-	if (priv->status.intf & CAN_INT_SERRIF)
-		return 0;
+	for (; (child = 2 * i + 1) < cyclic->heap_count; i = child) {
+		if (child + 1 < cyclic->heap_count &&
+		    mcp25xxfd_tx_cyclic_before(cyclic, child + 1, child))
+			child++;
+		if (!mcp25xxfd_tx_cyclic_before(cyclic, child, i))
+			break;
+		swap(cyclic->heap[i], cyclic->heap[child]);
+	}
+}
 
-	/* otherwise it is an RX issue, so account for it here */
-	priv->can_err_id |= CAN_ERR_PROT;
-	priv->can_err_data[2] |= CAN_ERR_PROT_FORM;
-	priv->net->stats.rx_frame_errors++;
-	priv->net->stats.rx_errors++;
+/* the heap of the active entries - with the lock held */
+static void mcp25xxfd_tx_cyclic_rebuild(struct mcp25xxfd_tx_cyclic *cyclic)
+{
+	int i;
 
-	return 0;
+	cyclic->heap_count = 0;
+	for (i = 0; i < MCP25XXFD_TX_CYCLIC_MAX; i++)
+		if (cyclic->entries[i].active)
+			cyclic->heap[cyclic->heap_count++] = i;
+
+	for (i = cyclic->heap_count / 2 - 1; i >= 0; i--)
+		mcp25xxfd_tx_cyclic_sift_down(cyclic, i);
 }
 
-static int mcp25xxfd_disable_interrupts(struct spi_device *spi,
-					u32 speed_hz)
+/* arm the timer for the first entry due - with the mutex held */
+static void mcp25xxfd_tx_cyclic_arm(struct mcp25xxfd_priv *priv)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-
-	priv->status.intf = 0;
-	return mcp25xxfd_cmd_write(spi, CAN_INT, 0, speed_hz);
+	struct mcp25xxfd_tx_cyclic *cyclic = &priv->tx_cyclic;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cyclic->lock, flags);
+	if (cyclic->running && cyclic->heap_count)
+		hrtimer_start(&cyclic->timer,
+			      cyclic->entries[cyclic->heap[0]].next,
+			      HRTIMER_MODE_ABS);
+	spin_unlock_irqrestore(&cyclic->lock, flags);
 }
 
-static int mcp25xxfd_enable_interrupts(struct spi_device *spi,
-				       u32 speed_hz)
+/* write the object of an entry to the slot, returns its length */
+static int mcp25xxfd_tx_cyclic_fill(struct mcp25xxfd_trigger_tx_message *txm,
+				    struct mcp25xxfd_tx_cyclic_entry *entry,
+				    u32 seq)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct canfd_frame *frame = &entry->frame;
+	struct mcp25xxfd_obj_tx obj;
+	u32 flags;
 
-	priv->status.intf = CAN_INT_TEFIE |
-		CAN_INT_RXIE |
-		CAN_INT_MODIE |
-		CAN_INT_SERRIE |
-		CAN_INT_IVMIE |
-		CAN_INT_CERRIE |
-		CAN_INT_RXOVIE |
-		CAN_INT_ECCIE;
-	return mcp25xxfd_cmd_write(spi, CAN_INT,
-				   priv->status.intf,
-				   speed_hz);
+	mcp25xxfd_canid_to_mcpid(frame->can_id, &obj.header.id, &flags);
+
+	flags |= can_len2dlc(frame->len) << CAN_OBJ_FLAGS_DLC_SHIFT;
+	flags |= (frame->can_id & CAN_EFF_FLAG) ? CAN_OBJ_FLAGS_IDE : 0;
+	flags |= (frame->can_id & CAN_RTR_FLAG) ? CAN_OBJ_FLAGS_RTR : 0;
+	if (entry->fd) {
+		flags |= CAN_OBJ_FLAGS_FDF;
+		flags |= (frame->flags & CANFD_BRS) ? CAN_OBJ_FLAGS_BRS : 0;
+	}
+	flags |= seq << CAN_OBJ_FLAGS_SEQ_SHIFT;
+
+	obj.header.flags = flags;
+	mcp25xxfd_obj_to_le(&obj.header);
+
+	memcpy(txm->fill_obj, &obj, sizeof(obj));
+	memcpy(txm->fill_data, frame->data, frame->len);
+	memset(txm->fill_data + frame->len, 0,
+	       ALIGN(frame->len, 4) - frame->len);
+
+	return sizeof(obj) + ALIGN(frame->len, 4);
 }
 
-static int mcp25xxfd_hw_wake(struct spi_device *spi)
+static void mcp25xxfd_tx_cyclic_miss(struct mcp25xxfd_priv *priv,
+				     struct mcp25xxfd_tx_cyclic_entry *entry)
 {
-	return mcp25xxfd_start_clock(spi, MCP25XXFD_CLK_USER_CAN);
+	entry->missed++;
+	entry->last = 0;
+	priv->stats.tx_cyclic_missed++;
 }
 
-static void mcp25xxfd_hw_sleep(struct spi_device *spi)
+/* send the staged frames - with the lock held */
+static void mcp25xxfd_tx_cyclic_flush(struct mcp25xxfd_priv *priv)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct mcp25xxfd_tx_cyclic *cyclic = &priv->tx_cyclic;
+	struct mcp25xxfd_tx_batch *batch = &cyclic->batch;
+	struct mcp25xxfd_tx_cyclic_entry *entry;
+	struct mcp25xxfd_trigger_tx_message *first;
+	bool expired = false;
+	u32 i, slot;
+
+	if (!batch->count)
+		return;
 
-	/* disable interrupts */
-	mcp25xxfd_disable_interrupts(spi, priv->spi_setup_speed_hz);
+	/* nothing to do on completion, the TEF frees the slots */
+	first = mcp25xxfd_tx_batch_message(priv, batch);
 
-	/* stop the clocks */
-	mcp25xxfd_stop_clock(spi, MCP25XXFD_CLK_USER_CAN);
+	if (spi_async(priv->spi, &first->batch_msg)) {
+		/* the spi bus is locked (by the irq thread of this or of
+		 * another device)
+		 */
+		for (i = 0; i < batch->count; i++) {
+			slot = batch->txm[i] - cyclic->txm;
+			entry = &cyclic->entries[cyclic->entry[slot]];
+			entry->frames--;
+			mcp25xxfd_tx_cyclic_miss(priv, entry);
+		}
+		cyclic->head -= batch->count;
+	} else {
+		priv->stats.tx_cyclic_frames += batch->count;
+		/* the entries with a count end with their last frame sent */
+		for (i = 0; i < batch->count; i++) {
+			slot = batch->txm[i] - cyclic->txm;
+			entry = &cyclic->entries[cyclic->entry[slot]];
+			if (entry->count && !--entry->count) {
+				entry->active = false;
+				expired = true;
+			}
+		}
+	}
+	batch->count = 0;
+
+	if (expired)
+		mcp25xxfd_tx_cyclic_rebuild(cyclic);
 }
 
-static int mcp25xxfd_can_ist_handle_status(struct spi_device *spi)
+/* stage the entry at the top of the heap and move it to its next cycle
+ * - with the lock held
+ */
+static void mcp25xxfd_tx_cyclic_due(struct mcp25xxfd_priv *priv, ktime_t now)
 {
-	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
-	const u32 clear_irq = CAN_INT_TBCIF |
-		CAN_INT_MODIF |
-		CAN_INT_SERRIF |
-		CAN_INT_CERRIF |
-		CAN_INT_WAKIF |
-		CAN_INT_IVMIF;
-	int ret;
+	struct mcp25xxfd_tx_cyclic *cyclic = &priv->tx_cyclic;
+	struct mcp25xxfd_tx_batch *batch = &cyclic->batch;
+	struct mcp25xxfd_tx_cyclic_entry *entry;
+	struct mcp25xxfd_trigger_tx_message *txm;
+	u32 idx, slot, seq;
 
-	/* clear all the interrupts asap */
-	ret = mcp25xxfd_cmd_write_mask(spi, CAN_INT,
-				       priv->status.intf & (~clear_irq),
-				       clear_irq,
-				       priv->spi_speed_hz);
-	if (ret)
-		return ret;
+	/* a batch ends at the end of the fifo (head may move back if
+	 * sending it fails, the entries may run out if it succeeds)
+	 */
+	slot = cyclic->head & (cyclic->depth - 1);
+	if (!mcp25xxfd_tx_batch_fits(priv, batch, &cyclic->txm[slot])) {
+		mcp25xxfd_tx_cyclic_flush(priv);
+		if (!cyclic->heap_count ||
+		    ktime_after(cyclic->entries[cyclic->heap[0]].next, now))
+			return;
+		slot = cyclic->head & (cyclic->depth - 1);
+	}
+	txm = &cyclic->txm[slot];
+	idx = cyclic->heap[0];
+	entry = &cyclic->entries[idx];
 
-	/* interrupt clearing info */
-	priv->bdiag1_clear_value = 0;
-	priv->bdiag1_clear_mask = 0;
-	priv->can_err_id = 0;
-	memset(priv->can_err_data, 0, 8);
+	if (cyclic->head - cyclic->tail >= cyclic->depth ||
+	    entry->frame.len > priv->fifos.payload_size) {
+		mcp25xxfd_tx_cyclic_miss(priv, entry);
+	} else {
+		seq = MCP25XXFD_TX_RING_SEQ_CYCLIC | slot;
+		if (cyclic->head & cyclic->depth)
+			seq |= MCP25XXFD_TX_RING_SEQ_GEN;
+		mcp25xxfd_tx_batch_add(priv, batch, txm,
+				       mcp25xxfd_tx_cyclic_fill(txm, entry,
+								seq));
+		cyclic->seq[slot] = seq;
+		cyclic->entry[slot] = idx;
+		cyclic->head++;
+		entry->frames++;
+	}
 
-	/* state changes */
-	priv->new_state = priv->can.state;
+	/* the next cycle - the ones already passed are missed */
+	entry->next = ktime_add_us(entry->next, entry->period_us);
+	if (!ktime_after(entry->next, now)) {
+		mcp25xxfd_tx_cyclic_miss(priv, entry);
+		entry->next = ktime_add_us(now, entry->period_us);
+	}
 
-	/* clear queued fifos */
-	mcp25xxfd_clear_queued_fifos(spi);
+	mcp25xxfd_tx_cyclic_sift_down(cyclic, 0);
+}
 
-	/* system error interrupt needs to get handled first
-	 * to get us out of restricted mode
-	 */
-	if (priv->status.intf & CAN_INT_SERRIF) {
-		priv->stats.int_serr_count++;
-		ret = mcp25xxfd_can_ist_handle_serrif(spi);
-		if (ret)
-			return ret;
+static enum hrtimer_restart mcp25xxfd_tx_cyclic_timer(struct hrtimer *timer)
+{
+	struct mcp25xxfd_tx_cyclic *cyclic =
+		container_of(timer, struct mcp25xxfd_tx_cyclic, timer);
+	struct mcp25xxfd_priv *priv = cyclic->priv;
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	ktime_t now = ktime_get();
+	unsigned long flags;
+
+	spin_lock_irqsave(&cyclic->lock, flags);
+	while (cyclic->heap_count &&
+	       !ktime_after(cyclic->entries[cyclic->heap[0]].next, now))
+		mcp25xxfd_tx_cyclic_due(priv, now);
+	mcp25xxfd_tx_cyclic_flush(priv);
+
+	if (cyclic->heap_count) {
+		hrtimer_set_expires(timer,
+				    cyclic->entries[cyclic->heap[0]].next);
+		ret = HRTIMER_RESTART;
 	}
+	spin_unlock_irqrestore(&cyclic->lock, flags);
 
-	/* mode change interrupt */
-	if (priv->status.intf & CAN_INT_MODIF) {
-		priv->stats.int_mod_count++;
-		ret = mcp25xxfd_can_ist_handle_modif(spi);
-		if (ret)
-			return ret;
+	return ret;
+}
+
+/* the TEF entry of a frame of the cyclic tx fifo */
+static void mcp25xxfd_tx_cyclic_complete(struct mcp25xxfd_priv *priv,
+					 u32 seq, u32 ts)
+{
+	struct mcp25xxfd_tx_cyclic *cyclic = &priv->tx_cyclic;
+	u32 slot = seq & MCP25XXFD_TX_RING_SEQ_SLOT_MASK;
+	struct mcp25xxfd_tx_cyclic_entry *entry;
+	unsigned long flags;
+	ktime_t time;
+	u32 count;
+	s64 err;
+
+	spin_lock_irqsave(&cyclic->lock, flags);
+
+	/* find the frame in flight that this TEF entry belongs to */
+	count = cyclic->tail + ((slot - cyclic->tail) & (cyclic->depth - 1));
+	if (count - cyclic->tail >= cyclic->head - cyclic->tail ||
+	    cyclic->seq[slot] != seq) {
+		priv->stats.tx_ring_seq_errors++;
+		goto out;
 	}
 
-	/* handle the rx */
-	if (priv->status.intf & CAN_INT_RXIF) {
-		priv->stats.int_rx_count++;
-		ret = mcp25xxfd_can_ist_handle_rxif(spi);
-		if (ret)
-			return ret;
+	/* the frames of the fifo get transmitted in order - so the ones
+	 * skipped in the TEF are lost, resync to this one
+	 */
+	for (; cyclic->tail != count; cyclic->tail++) {
+		priv->stats.tx_ring_seq_errors++;
+		entry = &cyclic->entries[cyclic->entry[cyclic->tail &
+						       (cyclic->depth - 1)]];
+		mcp25xxfd_tx_cyclic_miss(priv, entry);
+	}
+	cyclic->tail++;
+
+	entry = &cyclic->entries[cyclic->entry[slot]];
+	time = mcp25xxfd_timestamp_to_ktime(priv, ts);
+	if (entry->last) {
+		err = abs(ktime_to_ns(ktime_sub(time, entry->last)) -
+			  (s64)entry->period_us * NSEC_PER_USEC);
+		entry->jitter_max_ns = max_t(u64, entry->jitter_max_ns, err);
+		entry->jitter_sum_ns += err;
+		entry->jitter_samples++;
+		priv->stats.tx_cyclic_jitter_max_ns =
+			max_t(u64, priv->stats.tx_cyclic_jitter_max_ns, err);
+		priv->stats.tx_cyclic_jitter_sum_ns += err;
+		priv->stats.tx_cyclic_jitter_samples++;
 	}
+	entry->last = time;
 
-	/* handle aborted TX FIFOs */
-	if (priv->status.txatif) {
-		priv->stats.int_txat_count++;
-		ret = mcp25xxfd_can_ist_handle_txatif(spi);
-		if (ret)
-			return ret;
+out:
+	spin_unlock_irqrestore(&cyclic->lock, flags);
+}
+
+/* the interface comes up with the fifo set up - all the active entries
+ * start right away
+ */
+static void mcp25xxfd_tx_cyclic_start(struct mcp25xxfd_priv *priv)
+{
+	struct mcp25xxfd_tx_cyclic *cyclic = &priv->tx_cyclic;
+	ktime_t now = ktime_get();
+	unsigned long flags;
+	int i;
+
+	mutex_lock(&cyclic->mutex);
+	spin_lock_irqsave(&cyclic->lock, flags);
+	cyclic->head = 0;
+	cyclic->tail = 0;
+	cyclic->batch.count = 0;
+	for (i = 0; i < MCP25XXFD_TX_CYCLIC_MAX; i++) {
+		cyclic->entries[i].next = now;
+		cyclic->entries[i].last = 0;
 	}
+	mcp25xxfd_tx_cyclic_rebuild(cyclic);
+	cyclic->running = !!cyclic->fifo;
+	spin_unlock_irqrestore(&cyclic->lock, flags);
+	mcp25xxfd_tx_cyclic_arm(priv);
+	mutex_unlock(&cyclic->mutex);
+}
 
-	/* handle the tef */
-	if (priv->status.intf & CAN_INT_TEFIF) {
-		priv->stats.int_tef_count++;
-		ret = mcp25xxfd_can_ist_handle_tefif(spi);
-		if (ret)
-			return ret;
+static void mcp25xxfd_tx_cyclic_stop(struct mcp25xxfd_priv *priv)
+{
+	struct mcp25xxfd_tx_cyclic *cyclic = &priv->tx_cyclic;
+
+	mutex_lock(&cyclic->mutex);
+	cyclic->running = false;
+	hrtimer_cancel(&cyclic->timer);
+	cyclic->fifo = 0;
+	cyclic->depth = 0;
+	cyclic->txm = NULL;
+	mutex_unlock(&cyclic->mutex);
+}
+
+#if defined(CONFIG_DEBUG_FS)
+/* a frame in the notation of cansend:
+ * <can_id>#{data}, <can_id>#R{len} or <can_id>##<flags>{data}
+ * with 3 (standard) or 8 (extended) hex digits of can_id, the data as
+ * pairs of hex digits optionally separated by '.'
+ */
+static int mcp25xxfd_tx_cyclic_parse_frame(char *str,
+					   struct canfd_frame *frame,
+					   bool *fd)
+{
+	char *data = strchr(str, '#');
+	int len;
+
+	memset(frame, 0, sizeof(*frame));
+	*fd = false;
+
+	if (!data)
+		return -EINVAL;
+	*data++ = 0;
+
+	len = strlen(str);
+	if ((len != 3 && len != 8) || kstrtou32(str, 16, &frame->can_id))
+		return -EINVAL;
+	if (len == 8) {
+		if (frame->can_id & ~CAN_EFF_MASK)
+			return -EINVAL;
+		frame->can_id |= CAN_EFF_FLAG;
+	} else if (frame->can_id & ~CAN_SFF_MASK) {
+		return -EINVAL;
 	}
 
-	/* process the queued fifos */
-	ret = mcp25xxfd_process_queued_fifos(spi);
+	if (*data == 'R' || *data == 'r') {
+		frame->can_id |= CAN_RTR_FLAG;
+		if (*++data) {
+			len = hex_to_bin(*data);
+			if (len < 0 || len > CAN_MAX_DLEN || data[1])
+				return -EINVAL;
+			frame->len = len;
+		}
+		return 0;
+	}
 
-	/* handle error interrupt flags */
-	if (priv->status.rxovif) {
-		priv->stats.int_rxov_count++;
-		ret = mcp25xxfd_can_ist_handle_rxovif(spi);
-		if (ret)
-			return ret;
+	if (*data == '#') {
+		len = hex_to_bin(*++data);
+		if (len < 0)
+			return -EINVAL;
+		frame->flags = len & CANFD_BRS;
+		*fd = true;
+		data++;
 	}
 
-	/* sram ECC error interrupt */
-	if (priv->status.intf & CAN_INT_ECCIF) {
-		priv->stats.int_ecc_count++;
-		ret = mcp25xxfd_can_ist_handle_eccif(spi);
-		if (ret)
-			return ret;
+	for (; *data; data += 2) {
+		if (*data == '.')
+			data--;
+		else if (frame->len >= (*fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN) ||
+			 hex2bin(&frame->data[frame->len++], data, 1))
+			return -EINVAL;
 	}
 
-	/* message format interrupt */
-	if (priv->status.intf & CAN_INT_IVMIF) {
-		priv->stats.int_ivm_count++;
-		ret = mcp25xxfd_can_ist_handle_ivmif(spi);
-		if (ret)
-			return ret;
+	/* the fd lengths the dlc can tell */
+	if (*fd && can_dlc2len(can_len2dlc(frame->len)) != frame->len)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* the shortest period the spi transfers of an entry can sustain: the
+ * write of its object and the UINC + TXREQ of its slot
+ */
+static u32 mcp25xxfd_tx_cyclic_min_period_us(struct mcp25xxfd_priv *priv,
+					     struct canfd_frame *frame)
+{
+	u32 bytes = 2 + sizeof(struct mcp25xxfd_obj_tx) +
+		ALIGN(frame->len, 4) + 3;
+
+	return DIV_ROUND_UP(bytes * 8 * USEC_PER_SEC,
+			    priv->spi_speed_hz);
+}
+
+/* a line written to the table:
+ * <index> <period_us> <count> <frame> - set (and start) an entry,
+ *                                       count 0 for no end
+ * <index> off                         - stop an entry
+ * clear                               - stop all the entries
+ */
+static int mcp25xxfd_tx_cyclic_parse(struct mcp25xxfd_priv *priv,
+				     char *line)
+{
+	struct mcp25xxfd_tx_cyclic *cyclic = &priv->tx_cyclic;
+	struct mcp25xxfd_tx_cyclic_entry *entry;
+	char *arg[4];
+	u32 idx, period_us, count;
+	struct canfd_frame frame;
+	unsigned long flags;
+	bool fd, clear;
+	int i, n, ret;
+
+	line = strim(line);
+	for (n = 0; n < ARRAY_SIZE(arg) && line && *line; n++) {
+		arg[n] = strsep(&line, " \t");
+		line = line ? skip_spaces(line) : NULL;
 	}
+	if (line && *line)
+		return -EINVAL;
 
-	/* handle bus errors in more detail */
-	if (priv->status.intf & CAN_INT_CERRIF) {
-		priv->stats.int_cerr_count++;
-		ret = mcp25xxfd_can_ist_handle_cerrif(spi);
+	clear = n == 1 && !strcmp(arg[0], "clear");
+	if (!clear) {
+		if (n < 2 || kstrtou32(arg[0], 0, &idx) ||
+		    idx >= MCP25XXFD_TX_CYCLIC_MAX)
+			return -EINVAL;
+		if (n == 2 && strcmp(arg[1], "off"))
+			return -EINVAL;
+		if (n == 3)
+			return -EINVAL;
+	}
+	if (n == 4) {
+		if (kstrtou32(arg[1], 0, &period_us) || !period_us ||
+		    kstrtou32(arg[2], 0, &count))
+			return -EINVAL;
+		ret = mcp25xxfd_tx_cyclic_parse_frame(arg[3], &frame, &fd);
 		if (ret)
 			return ret;
+		if (fd && priv->net->mtu != CANFD_MTU)
+			return -EINVAL;
+		if (period_us < mcp25xxfd_tx_cyclic_min_period_us(priv,
+								  &frame))
+			return -EINVAL;
 	}
 
-	/* Error counter handling */
-	if (priv->status.trec & CAN_TREC_TXWARN) {
-		priv->new_state = CAN_STATE_ERROR_WARNING;
-		priv->can_err_id |= CAN_ERR_CRTL;
-		priv->can_err_data[1] |= CAN_ERR_CRTL_TX_WARNING;
-	}
-	if (priv->status.trec & CAN_TREC_RXWARN) {
-		priv->new_state = CAN_STATE_ERROR_WARNING;
-		priv->can_err_id |= CAN_ERR_CRTL;
-		priv->can_err_data[1] |= CAN_ERR_CRTL_RX_WARNING;
-	}
-	if (priv->status.trec & CAN_TREC_TXBP) {
-		priv->new_state = CAN_STATE_ERROR_PASSIVE;
-		priv->can_err_id |= CAN_ERR_CRTL;
-		priv->can_err_data[1] |= CAN_ERR_CRTL_TX_PASSIVE;
+	mutex_lock(&cyclic->mutex);
+	hrtimer_cancel(&cyclic->timer);
+	spin_lock_irqsave(&cyclic->lock, flags);
+	for (i = 0; i < MCP25XXFD_TX_CYCLIC_MAX; i++) {
+		entry = &cyclic->entries[i];
+		if (clear) {
+			entry->active = false;
+		} else if (i == idx) {
+			if (n == 4) {
+				memset(entry, 0, sizeof(*entry));
+				entry->frame = frame;
+				entry->fd = fd;
+				entry->period_us = period_us;
+				entry->count = count;
+				entry->next = ktime_get();
+			}
+			entry->active = n == 4;
+		}
 	}
-	if (priv->status.trec & CAN_TREC_RXBP) {
-		priv->new_state = CAN_STATE_ERROR_PASSIVE;
-		priv->can_err_id |= CAN_ERR_CRTL;
-		priv->can_err_data[1] |= CAN_ERR_CRTL_RX_PASSIVE;
+	mcp25xxfd_tx_cyclic_rebuild(cyclic);
+	spin_unlock_irqrestore(&cyclic->lock, flags);
+	mcp25xxfd_tx_cyclic_arm(priv);
+	mutex_unlock(&cyclic->mutex);
+
+	return 0;
+}
+#endif
+
+/* select the netdev tx queue (and thus the tx ring) of a frame */
+static u16 mcp25xxfd_select_queue(struct net_device *net,
+				  struct sk_buff *skb,
+				  struct net_device *sb_dev)
+{
+	/* the traffic classes configured via mqprio */
+	if (netdev_get_num_tc(net))
+		return netdev_pick_tx(net, skb, sb_dev);
+
+	/* otherwise a higher priority uses a higher (TXPRI) queue */
+	return min_t(u32, skb->priority, net->real_num_tx_queues - 1);
+}
+
+/* the mqprio qdisc maps traffic classes to tx queues, the fifos of the
+ * queues in a traffic class get it as TXPRI when the device gets opened
+ */
+static int mcp25xxfd_setup_tc_mqprio(struct net_device *net,
+				     struct tc_mqprio_qopt *mqprio)
+{
+	struct mcp25xxfd_priv *priv = netdev_priv(net);
+	int tc, i;
+
+	/* the fifo configuration only changes in config mode */
+	if (netif_running(net))
+		return -EBUSY;
+
+	if (!mqprio->num_tc) {
+		netdev_reset_tc(net);
+		for (i = 0; i < MCP25XXFD_TX_QUEUES_MAX; i++)
+			priv->tx_queue_txpri[i] = i;
+		return 0;
 	}
-	if (priv->status.trec & CAN_TREC_TXBO) {
-		priv->new_state = CAN_STATE_BUS_OFF;
-		priv->can_err_id |= CAN_ERR_BUSOFF;
+
+	if (mqprio->num_tc > net->real_num_tx_queues)
+		return -EINVAL;
+	for (tc = 0; tc < mqprio->num_tc; tc++)
+		if (!mqprio->count[tc] ||
+		    mqprio->offset[tc] + mqprio->count[tc] >
+		    net->real_num_tx_queues)
+			return -EINVAL;
+
+	netdev_set_num_tc(net, mqprio->num_tc);
+	for (tc = 0; tc < mqprio->num_tc; tc++) {
+		netdev_set_tc_queue(net, tc, mqprio->count[tc],
+				    mqprio->offset[tc]);
+		for (i = 0; i < mqprio->count[tc]; i++)
+			priv->tx_queue_txpri[mqprio->offset[tc] + i] = tc;
 	}
+	mqprio->hw = TC_MQPRIO_HW_OFFLOAD_TCS;
 
-	/* based on the last state state check the new state */
-	switch (priv->can.state) {
-	case CAN_STATE_ERROR_ACTIVE:
-		if (priv->new_state >= CAN_STATE_ERROR_WARNING &&
-		    priv->new_state <= CAN_STATE_BUS_OFF)
-			priv->can.can_stats.error_warning++;
-		/* fallthrough */
-	case CAN_STATE_ERROR_WARNING:
-		if (priv->new_state >= CAN_STATE_ERROR_PASSIVE &&
-		    priv->new_state <= CAN_STATE_BUS_OFF)
-			priv->can.can_stats.error_passive++;
-		break;
+	return 0;
+}
+
+/* the etf qdisc with offload on a tx queue - the frames get staged in
+ * the tx ring of the queue, which only exists while the interface is up
+ */
+static int mcp25xxfd_setup_tc_etf(struct net_device *net,
+				  struct tc_etf_qopt_offload *qopt)
+{
+	struct mcp25xxfd_priv *priv = netdev_priv(net);
+
+	if (qopt->queue < 0 || qopt->queue >= net->real_num_tx_queues)
+		return -EINVAL;
+
+	if (qopt->enable && (!priv->tx_ring_count || priv->spi_crc))
+		return -EOPNOTSUPP;
+
+	priv->tx_launch[qopt->queue].enabled = qopt->enable;
+
+	return 0;
+}
+
+static int mcp25xxfd_setup_tc(struct net_device *net,
+			      enum tc_setup_type type, void *type_data)
+{
+	switch (type) {
+	case TC_SETUP_QDISC_MQPRIO:
+		return mcp25xxfd_setup_tc_mqprio(net, type_data);
+	case TC_SETUP_QDISC_ETF:
+		return mcp25xxfd_setup_tc_etf(net, type_data);
 	default:
-		break;
+		return -EOPNOTSUPP;
 	}
-	priv->can.state = priv->new_state;
+}
 
-	/* and send error packet */
-	if (priv->can_err_id)
-		mcp25xxfd_error_skb(priv->net);
+static int mcp25xxfd_next_txfifo(struct mcp25xxfd_priv *priv)
+{
+	/* get effective mask */
+	u32 pending_mask = priv->fifos.tx_pending_mask |
+		priv->fifos.tx_submitted_mask;
+
+	/* decide on fifo to assign */
+	if (pending_mask)
+		return fls(pending_mask);
+
+	return priv->fifos.tx_fifo_start;
+}
+
+static netdev_tx_t __mcp25xxfd_start_xmit(struct sk_buff *skb,
+					  struct net_device *net,
+					  struct mcp25xxfd_tx_batch *batch)
+{
+	struct mcp25xxfd_priv *priv = netdev_priv(net);
+	struct spi_device *spi = priv->spi;
+	struct mcp25xxfd_trigger_tx_message *txm;
+	int fifo;
+	int ret;
 
-	/* handle BUS OFF */
 	if (priv->can.state == CAN_STATE_BUS_OFF) {
-		if (priv->can.restart_ms == 0) {
-			mcp25xxfd_stop_queue(priv->net);
-			priv->force_quit = 1;
-			priv->can.can_stats.bus_off++;
-			can_bus_off(priv->net);
-			mcp25xxfd_hw_sleep(spi);
-		}
-	} else {
-		/* restart the tx queue if needed */
-		if (priv->fifos.tx_processed_mask == priv->fifos.tx_fifo_mask)
-			mcp25xxfd_wake_queue(spi);
+		mcp25xxfd_stop_queue(priv->net);
+		return NETDEV_TX_BUSY;
+	}
+
+	if (priv->tx_ring_count)
+		return mcp25xxfd_tx_ring_xmit(skb, net, batch);
+
+	fifo = mcp25xxfd_next_txfifo(priv);
+
+	/* send the staged frames first if this one can not join them */
+	if (batch && fifo < priv->fifos.tx_fifo_start + priv->fifos.tx_fifos &&
+	    !mcp25xxfd_tx_batch_fits(priv, batch,
+				     &priv->spi_transmit_fifos[fifo -
+					priv->fifos.tx_fifo_start])) {
+		mcp25xxfd_tx_batch_flush(priv, batch);
+		/* held back by the spi bus lock */
+		if (batch->count)
+			return NETDEV_TX_BUSY;
+		fifo = mcp25xxfd_next_txfifo(priv);
+	}
+
+	/* handle error - this should not happen... */
+	if (fifo >= priv->fifos.tx_fifo_start + priv->fifos.tx_fifos) {
+		dev_err(&spi->dev,
+			"reached tx-fifo %i, which is not valid\n",
+			fifo);
+		return NETDEV_TX_BUSY;
+	}
+
+	/* if we are the last one, then stop the queue */
+	if (mcp25xxfd_is_last_txfifo(spi, fifo))
+		mcp25xxfd_stop_queue(priv->net);
+
+	/* mark as submitted */
+	priv->fifos.tx_submitted_mask |= BIT(fifo);
+	priv->tx_retransmit[fifo].count = 0;
+	priv->stats.fifo_usage[fifo]++;
+
+	/* now process it for real */
+	txm = &priv->spi_transmit_fifos[fifo - priv->fifos.tx_fifo_start];
+	if (can_is_canfd_skb(skb))
+		ret = mcp25xxfd_transmit_fdmessage(spi, txm, fifo, skb, batch);
+	else
+		ret = mcp25xxfd_transmit_message(spi, txm, fifo, skb, batch);
+
+	/* the spi bus may be locked by the irq thread (of this or of
+	 * another device), so undo the assignment and let the stack retry
+	 * later
+	 */
+	if (ret != NETDEV_TX_OK) {
+		priv->stats.tx_spi_busy++;
+		priv->fifos.tx_submitted_mask &= ~BIT(fifo);
+		priv->stats.fifo_usage[fifo]--;
+		if (mcp25xxfd_is_last_txfifo(spi, fifo)) {
+			priv->tx_queue_status = TX_QUEUE_STATUS_RUNNING;
+			netif_start_queue(priv->net);
+		}
+		mcp25xxfd_bus_lock_stop_queue(priv, skb_get_queue_mapping(skb));
+		return ret;
+	}
+
+	/* keep it for reference until the message really got transmitted */
+	mcp25xxfd_tx_bql_sent(priv, batch, skb, fifo);
+	mcp25xxfd_tx_timestamp_prepare(priv, skb);
+	can_put_echo_skb(skb, priv->net, fifo);
+
+	return ret;
+}
+
+static netdev_tx_t mcp25xxfd_start_xmit(struct sk_buff *skb,
+					struct net_device *net)
+{
+	struct mcp25xxfd_priv *priv = netdev_priv(net);
+	u16 queue = skb_get_queue_mapping(skb);
+	struct mcp25xxfd_tx_batch *batch = &priv->tx_batch[queue];
+	bool more = netdev_xmit_more();
+	ktime_t time = skb->tstamp;
+	netdev_tx_t ret;
+	u32 bus_ns = 0;
+
+	if (can_dropped_invalid_skb(net, skb)) {
+		ret = NETDEV_TX_OK;
+		goto flush;
+	}
+
+	/* a frame with a launch time is a batch on its own, which gets
+	 * staged instead of sent (the skb may be gone by then)
+	 */
+	if (time && mcp25xxfd_tx_launch_enabled(priv, queue)) {
+		if (batch->count)
+			mcp25xxfd_tx_batch_flush(priv, batch);
+		/* held back by the spi bus lock */
+		if (batch->count)
+			return NETDEV_TX_BUSY;
+		ret = __mcp25xxfd_start_xmit(skb, net, batch);
+		if (ret == NETDEV_TX_OK && batch->count)
+			mcp25xxfd_tx_launch_stage(priv, queue, time);
+		return ret;
+	}
+
+	/* the shaper may hand the frame back with the queue stopped */
+	if (mcp25xxfd_tx_shaper_enabled(priv, queue)) {
+		if (!mcp25xxfd_tx_shaper_admit(priv, queue)) {
+			ret = NETDEV_TX_BUSY;
+			goto flush;
+		}
+		bus_ns = mcp25xxfd_tx_wire_time(priv, skb);
+	}
+
+	ret = __mcp25xxfd_start_xmit(skb, net,
+				     mcp25xxfd_tx_batch_get(priv, queue));
+	if (bus_ns && ret == NETDEV_TX_OK)
+		mcp25xxfd_tx_shaper_charge(priv, queue, bus_ns);
+
+flush:
+	/* send the staged frames unless the stack has more to come */
+	if (batch->count &&
+	    (!more || ret != NETDEV_TX_OK ||
+	     netif_xmit_stopped(netdev_get_tx_queue(net, queue))))
+		mcp25xxfd_tx_batch_flush(priv, batch);
+
+	return ret;
+}
+
+/* CAN RX Related */
+
+static int mcp25xxfd_can_transform_rx_fd(struct spi_device *spi,
+					 struct mcp25xxfd_obj_rx *rx)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct canfd_frame *frame;
+	struct sk_buff *skb;
+	u32 flags = rx->header.flags;
+	int dlc;
+
+	/* allocate the skb buffer */
+	skb = alloc_canfd_skb(priv->net, &frame);
+	if (!skb) {
+		dev_err(&spi->dev, "cannot allocate RX skb\n");
+		priv->net->stats.rx_dropped++;
+		return -ENOMEM;
+	}
+
+	mcp25xxfd_mcpid_to_canid(rx->header.id, flags, &frame->can_id);
+	frame->flags |= (flags & CAN_OBJ_FLAGS_BRS) ? CANFD_BRS : 0;
+	frame->flags |= (flags & CAN_OBJ_FLAGS_ESI) ? CANFD_ESI : 0;
+
+	dlc = (flags & CAN_OBJ_FLAGS_DLC_MASK) >> CAN_OBJ_FLAGS_DLC_SHIFT;
+	frame->len = can_dlc2len(dlc);
+
+	memcpy(frame->data, rx->data, frame->len);
+
+	priv->stats.rx_fd_count++;
+	priv->net->stats.rx_packets++;
+	priv->net->stats.rx_bytes += frame->len;
+	if (rx->header.flags & CAN_OBJ_FLAGS_BRS)
+		priv->stats.rx_brs_count++;
+	priv->stats.rx_dlc_usage[dlc]++;
+
+	can_led_event(priv->net, CAN_LED_EVENT_RX);
+
+	if (priv->ts.config.rx_filter != HWTSTAMP_FILTER_NONE)
+		skb_hwtstamps(skb)->hwtstamp =
+			mcp25xxfd_timestamp_to_ktime(priv, rx->header.ts);
+	netif_rx_ni(skb);
+
+	return 0;
+}
+
+static int mcp25xxfd_can_transform_rx_normal(struct spi_device *spi,
+					     struct mcp25xxfd_obj_rx *rx)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct sk_buff *skb;
+	struct can_frame *frame;
+	u32 flags = rx->header.flags;
+	int len;
+	int dlc;
+
+	/* allocate the skb buffer */
+	skb = alloc_can_skb(priv->net, &frame);
+	if (!skb) {
+		dev_err(&spi->dev, "cannot allocate RX skb\n");
+		priv->net->stats.rx_dropped++;
+		return -ENOMEM;
+	}
+
+	mcp25xxfd_mcpid_to_canid(rx->header.id, flags, &frame->can_id);
+
+	dlc = (flags & CAN_OBJ_FLAGS_DLC_MASK) >> CAN_OBJ_FLAGS_DLC_SHIFT;
+	frame->can_dlc = dlc;
+
+	len = can_dlc2len(frame->can_dlc);
+
+	memcpy(frame->data, rx->data, len);
+
+	priv->net->stats.rx_packets++;
+	priv->net->stats.rx_bytes += len;
+	priv->stats.rx_dlc_usage[dlc]++;
+
+	can_led_event(priv->net, CAN_LED_EVENT_RX);
+
+	if (priv->ts.config.rx_filter != HWTSTAMP_FILTER_NONE)
+		skb_hwtstamps(skb)->hwtstamp =
+			mcp25xxfd_timestamp_to_ktime(priv, rx->header.ts);
+	netif_rx_ni(skb);
+
+	return 0;
+}
+
+static int mcp25xxfd_process_queued_rx(struct spi_device *spi,
+				       struct mcp25xxfd_obj_ts *obj)
+{
+	struct mcp25xxfd_obj_rx *rx = container_of(obj,
+						   struct mcp25xxfd_obj_rx,
+						   header);
+
+	if (obj->flags & CAN_OBJ_FLAGS_FDF)
+		return mcp25xxfd_can_transform_rx_fd(spi, rx);
+	else
+		return mcp25xxfd_can_transform_rx_normal(spi, rx);
+}
+
+static int mcp25xxfd_normal_release_fifos(struct spi_device *spi,
+					  int start, int end)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	int ret;
+
+	/* release each fifo in a separate transfer */
+	for (; start < end ; start++) {
+		ret = mcp25xxfd_batch_write_message(
+			spi, &priv->irq_templates->release[start]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* unfortunately the CAN_FIFOCON are not directly consecutive
+ * so the optimization of "clearing all in one spi_transfer"
+ * would produce an overhead of 11 unnecessary bytes/fifo
+ * - transferring 14 (2 cmd + 12 data) bytes
+ * instead of just 3 (2 + 1).
+ * On some slower systems this may still be beneficial,
+ * but it is not good enough for the generic case.
+ * On a Raspberry Pi CM the timings for clearing 3 fifos
+ * (at 12.5MHz SPI clock speed) are:
+ * * normal:
+ *   * 3 spi transfers
+ *   * 9 bytes total
+ *   * 36.74us from first CS low to last CS high
+ *   * individual CS: 9.14us, 5.74us and 5.16us
+ *   * 77.02us from CS up of fifo transfer to last release CS up
+ * * bulk:
+ *   * 1 spi transfer
+ *   * 27 bytes total
+ *   * 29.06us CS Low
+ *   * 78.28us from CS up of fifo transfer to last release CS up
+ * this obviously varies with SPI_clock speed
+ * - the slower the clock the less efficient the optimization.
+ * similarly the faster the CPU (and bigger the code cache) the
+ * less effcient the optimization - the above case is border line.
+ */
+
+#define FIFOCON_SPACING (CAN_FIFOCON(1) - CAN_FIFOCON(0))
+#define FIFOCON_SPACINGW (FIFOCON_SPACING / sizeof(u32))
+
+static int mcp25xxfd_bulk_release_fifos(struct spi_device *spi,
+					int start, int end)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	int i;
+	int ret;
+
+	/* calculate start address and length */
+	int fifos = end - start;
+	int first_byte = mcp25xxfd_first_byte(CAN_FIFOCON_UINC);
+	int addr = CAN_FIFOCON(start);
+	int len = 1 + (fifos - 1) * FIFOCON_SPACING;
+
+	/* the worsted case buffer */
+	u32 buf[32 * FIFOCON_SPACINGW], base;
+
+	base = (priv->fifos.payload_mode << CAN_FIFOCON_PLSIZE_SHIFT) |
+		((priv->fifos.rx_fifo_depth - 1) << CAN_FIFOCON_FSIZE_SHIFT) |
+		CAN_FIFOCON_RXTSEN | /* RX timestamps */
+		CAN_FIFOCON_UINC |
+		CAN_FIFOCON_TFERFFIE | /* FIFO Full */
+		CAN_FIFOCON_TFHRFHIE | /* FIFO Half Full*/
+		CAN_FIFOCON_TFNRFNIE; /* FIFO not empty */
+
+	memset(buf, 0, sizeof(buf));
+	for (i = 0; i < end - start ; i++) {
+		if (i == priv->fifos.rx_fifos - 1)
+			base |= CAN_FIFOCON_RXOVIE;
+		buf[FIFOCON_SPACINGW * i] = cpu_to_le32(base);
+	}
+
+	ret = mcp25xxfd_cmd_writen(spi, addr + first_byte,
+				   (u8 *)buf + first_byte,
+				   len,
+				   priv->spi_speed_hz);
+	if (ret)
+		return ret;
+
+	return 0;
+}
+
+/* queued FIFO handling for release to system */
+
+static void mcp25xxfd_clear_queued_fifos(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+
+	/* prepare rfi - mostly used for sorting */
+	priv->queued_fifos.rx_count = 0;
+}
+
+static void mcp25xxfd_addto_queued_fifos(struct spi_device *spi,
+					 struct mcp25xxfd_obj_ts *obj)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct mcp25xxfd_read_fifo_info *rfi = &priv->queued_fifos;
+
+	/* the ts stays as read (the TBC in the lower 24 bits), as the
+	 * tx and rx time stamps get converted from it - the ordering
+	 * ignores the highest byte by itself (mcp25xxfd_compare_obj_ts)
+	 */
+
+	/* add pointer to queued array-list */
+	rfi->rxb[rfi->rx_count] = obj;
+	rfi->rx_count++;
+}
+
+static int mcp25xxfd_process_queued_tef(struct spi_device *spi,
+					struct mcp25xxfd_obj_ts *obj)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct mcp25xxfd_obj_tef *tef = container_of(obj,
+						     struct mcp25xxfd_obj_tef,
+						     header);
+	int dlc = (obj->flags & CAN_OBJ_FLAGS_DLC_MASK)
+		>> CAN_OBJ_FLAGS_DLC_SHIFT;
+	int seq = (tef->header.flags & CAN_OBJ_FLAGS_SEQ_MASK) >>
+		CAN_OBJ_FLAGS_SEQ_SHIFT;
+
+	/* update counters */
+	priv->net->stats.tx_packets++;
+	priv->net->stats.tx_bytes += can_dlc2len(dlc);
+	if (obj->flags & CAN_OBJ_FLAGS_FDF)
+		priv->stats.tx_fd_count++;
+	if (obj->flags & CAN_OBJ_FLAGS_BRS)
+		priv->stats.tx_brs_count++;
+	priv->stats.tx_dlc_usage[dlc]++;
+
+	/* release it */
+	if (seq & MCP25XXFD_TX_RING_SEQ_CYCLIC) {
+		mcp25xxfd_tx_cyclic_complete(priv, seq, obj->ts);
+	} else if (priv->tx_ring_count) {
+		mcp25xxfd_tx_ring_complete(priv, seq, obj->ts);
+	} else {
+		mcp25xxfd_tx_timestamp(priv, seq, obj->ts);
+		can_get_echo_skb(priv->net, seq);
+		mcp25xxfd_tx_bql_done(priv, seq);
+	}
+
+	can_led_event(priv->net, CAN_LED_EVENT_TX);
+
+	return 0;
+}
+
+static int mcp25xxfd_compare_obj_ts(const void *a, const void *b)
+{
+	const struct mcp25xxfd_obj_ts * const *rxa = a;
+	const struct mcp25xxfd_obj_ts * const *rxb = b;
+	/* timestamps must ignore the highest byte, so the difference
+	 * gets shifted - using signed here to handle rollover correctly
+	 */
+	s32 diff = (s32)(((*rxa)->ts - (*rxb)->ts) << 8);
+
+	if (diff < 0)
+		return -1;
+	if (diff > 0)
+		return 1;
+	return 0;
+}
+
+static int mcp25xxfd_process_queued_fifos(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct mcp25xxfd_read_fifo_info *rfi = &priv->queued_fifos;
+	int i;
+	int ret;
+
+	/* sort the fifos (rx and TEF) by receive timestamp */
+	sort(rfi->rxb, rfi->rx_count, sizeof(struct mcp25xxfd_obj_ts *),
+	     mcp25xxfd_compare_obj_ts, NULL);
+
+	/* process the recived fifos */
+	for (i = 0; i < rfi->rx_count ; i++) {
+		if (rfi->rxb[i]->flags & CAN_OBJ_FLAGS_CUSTOM_ISTEF)
+			ret = mcp25xxfd_process_queued_tef(spi, rfi->rxb[i]);
+		else
+			ret = mcp25xxfd_process_queued_rx(spi, rfi->rxb[i]);
+		if (ret)
+			return ret;
+	}
+
+	/* clear queued fifos */
+	mcp25xxfd_clear_queued_fifos(spi);
+
+	/* report the tx completions */
+	mcp25xxfd_tx_bql_completed(priv);
+
+	return 0;
+}
+
+static int mcp25xxfd_transform_rx(struct spi_device *spi,
+				  struct mcp25xxfd_obj_rx *rx)
+{
+	int dlc;
+
+	/* transform the data to system byte order */
+	mcp25xxfd_obj_ts_from_le(&rx->header);
+
+	/* add the object to the list */
+	mcp25xxfd_addto_queued_fifos(spi, &rx->header);
+
+	/* calc length and return it */
+	dlc = (rx->header.flags & CAN_OBJ_FLAGS_DLC_MASK)
+		>> CAN_OBJ_FLAGS_DLC_SHIFT;
+	return can_dlc2len(dlc);
+}
+
+/* read_fifo implementations
+ *
+ * read_fifos is a simple implementation, that:
+ *   * loops all fifos
+ *     * read header + some data-bytes (8)
+ *     * read rest of data-bytes bytes
+ *     * release fifo
+ *   for 3 can frames dlc<=8 to read here we have:
+ *     * 6 spi transfers
+ *     * 75 bytes (= 3 * (2 + 12 + 8) bytes + 3 * 3 bytes)
+ *   for 3 canfd frames dlc>8 to read here we have:
+ *     * 9 spi transfers
+ *     * 81 (= 3 * (2 + 12 + 8 + 2) bytes + 3 * 3 bytes) + 3 * extra payload
+ *     this only transfers the required size of bytes on the spi bus.
+ *
+ * bulk_read_fifos is an optimization that is most practical for
+ * Can2.0 busses, but may also be practical for CanFD busses that
+ * have a high average payload data size.
+ *
+ * It will read all of the fifo data in a single spi_transfer:
+ *   * read all fifos in one go (as long as these are ajacent to each other)
+ *   * loop all fifos
+ *     * release fifo
+ *   for 3 can2.0 frames to read here we have:
+ *     * 4 spi transfers
+ *     * 71 bytes (= 2 + 3 * (12 + 8) bytes + 3 * 3 bytes)
+ *   for 3 canfd frames to read here we have:
+ *     * 4 spi transfers
+ *     * 230 bytes (= 2 + 3 * (12 + 64) bytes)
+ *     obviously this reads way too many bytes for framesizes <=32 bytes,
+ *     but it avoids the overhead on the CPU side and may even trigger
+ *     DMA transfers due to the high byte count, which release CPU cycles.
+ *
+ * This optimization will also be efficient for cases where a high
+ * percentage of canFD frames has a dlc-size > 8.
+ * This mode is used for Can2.0 configured busses.
+ *
+ * For now this option can get forced for CanFD via a module parameter.
+ * In the future there may be some heuristics that could trigger a usage
+ * of this mode as well in some circumstances.
+ *
+ * Note: there is a second optimization for release fifo as well,
+ *       but it is not as efficient as this optimization for the
+ *       non-CanFD case - see mcp25xxfd_bulk_release_fifos
+ */
+
+static int mcp25xxfd_read_fifos(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	int fifo_header_size = sizeof(struct mcp25xxfd_obj_rx);
+	int fifo_min_payload_size = 8;
+	int fifo_min_size = fifo_header_size + fifo_min_payload_size;
+	int fifo_max_payload_size =
+		((priv->can.ctrlmode & CAN_CTRLMODE_FD) ? 64 : 8);
+	u32 mask = priv->status.rxif;
+	struct mcp25xxfd_obj_rx *rx;
+	int i, len;
+	int ret;
+	u32 fifo_address;
+
+	/* read all the "open" segments in big chunks */
+	for (i = priv->fifos.rx_fifo_start + priv->fifos.rx_fifos - 1;
+	     i >= priv->fifos.rx_fifo_start;
+	     i--) {
+		if (!(mask & BIT(i)))
+			continue;
+		/* the fifo to fill */
+		rx = (struct mcp25xxfd_obj_rx *)
+			(priv->fifos.fifo_data + priv->fifos.fifo_address[i]);
+		/* read the minimal payload */
+		fifo_address = priv->fifos.fifo_address[i];
+		ret = mcp25xxfd_read_fifo_image(spi, fifo_address,
+						fifo_min_size,
+						priv->spi_speed_hz);
+		if (ret)
+			return ret;
+		/* process fifo stats and get length */
+		len = min_t(int, mcp25xxfd_transform_rx(spi, rx),
+			    fifo_max_payload_size);
+
+		/* read extra payload if needed */
+		if (len > fifo_min_payload_size) {
+			ret = mcp25xxfd_read_fifo_image(spi,
+							fifo_address +
+							fifo_min_size,
+							len -
+							fifo_min_payload_size,
+							priv->spi_speed_hz);
+			if (ret)
+				return ret;
+		}
+		/* release fifo */
+		ret = mcp25xxfd_normal_release_fifos(spi, i, i + 1);
+		if (ret)
+			return ret;
+		/* increment fifo_usage */
+		priv->stats.fifo_usage[i]++;
+	}
+
+	return 0;
+}
+
+static int mcp25xxfd_bulk_read_fifo_range(struct spi_device *spi,
+					  int start, int end)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	const int fifo_header_size = sizeof(struct mcp25xxfd_obj_rx);
+	const int fifo_max_payload_size = priv->fifos.payload_size;
+	const int fifo_max_size = fifo_header_size + fifo_max_payload_size;
+	struct mcp25xxfd_obj_rx *rx;
+	int i;
+	int ret;
+
+	/* now we got start and end, so read the range */
+	ret = mcp25xxfd_read_fifo_image(spi,
+					priv->fifos.fifo_address[start],
+					(end - start) * fifo_max_size,
+					priv->spi_speed_hz);
+	if (ret)
+		return ret;
+
+	/* clear all the fifos in range */
+	if (use_bulk_release_fifos)
+		ret = mcp25xxfd_bulk_release_fifos(spi, start, end);
+	else
+		ret = mcp25xxfd_normal_release_fifos(spi, start, end);
+	if (ret)
+		return ret;
+
+	/* preprocess data */
+	for (i = start; i < end ; i++) {
+		/* store the fifo to process */
+		rx = (struct mcp25xxfd_obj_rx *)
+			(priv->fifos.fifo_data + priv->fifos.fifo_address[i]);
+		/* process fifo stats */
+		mcp25xxfd_transform_rx(spi, rx);
+		/* increment usage */
+		priv->stats.fifo_usage[i]++;
+	}
+
+	return 0;
+}
+
+static int mcp25xxfd_bulk_read_fifos(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	u32 mask = priv->status.rxif;
+	int i, start, end;
+	int ret;
+
+	/* find blocks of set bits top down */
+	for (i = priv->fifos.rx_fifo_start + priv->fifos.rx_fifos - 1;
+	     mask && (i >= priv->fifos.rx_fifo_start);
+	     i--) {
+		/* if the bit is 0 then continue loop to find a 1 */
+		if ((mask & BIT(i)) == 0)
+			continue;
+
+		/* so we found a non-0 bit - this is start and end */
+		start = i;
+		end = i;
+
+		/* find the first bit set */
+		for (; mask & BIT(i); i--) {
+			mask &= ~BIT(i);
+			start = i;
+		}
+
+		/* now process that range */
+		ret = mcp25xxfd_bulk_read_fifo_range(spi, start, end + 1);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int mcp25xxfd_can_ist_handle_rxif(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	u32 mask = priv->status.rxif;
+	int ret;
+
+	if (!mask)
+		return 0;
+
+	/* read all the fifos - for non-fd case use bulk read optimization */
+	if (((priv->can.ctrlmode & CAN_CTRLMODE_FD) == 0) ||
+	    use_complete_fdfifo_read)
+		ret = mcp25xxfd_bulk_read_fifos(spi);
+	else
+		ret = mcp25xxfd_read_fifos(spi);
+
+	return 0;
+}
+
+static void mcp25xxfd_mark_tx_processed(struct spi_device *spi,
+					int fifo)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+
+	/* set mask */
+	priv->fifos.tx_processed_mask |= BIT(fifo);
+
+	/* check if we should reenable the TX-queue */
+	if (mcp25xxfd_is_last_txfifo(spi, fifo))
+		priv->tx_queue_status = TX_QUEUE_STATUS_NEEDS_START;
+}
+
+static int mcp25xxfd_can_ist_handle_tefif_handle_single(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct mcp25xxfd_read_message *rm = &priv->irq_templates->tef;
+	struct mcp25xxfd_obj_tef *tef;
+	int fifo;
+	int ret;
+
+	/* calc address in address space */
+	tef = (struct mcp25xxfd_obj_tef *)(priv->fifos.fifo_data +
+					   priv->fifos.tef_address);
+
+	/* read all the object data - the template is prepared to skip
+	 * the last byte of the ts to avoid MAB issiues
+	 * (crc protected RAM reads need to be a multiple of 4 bytes,
+	 * so there the full object is read)
+	 */
+	mcp25xxfd_read_message_set_reg(rm, FIFO_DATA(priv->fifos.tef_address));
+	ret = mcp25xxfd_sync_read_message(spi, rm);
+	if (ret)
+		return ret;
+	memcpy(tef, mcp25xxfd_read_message_data(rm), sizeof(*tef) - 1);
+
+	/* increment the counter to read next */
+	ret = mcp25xxfd_batch_write_message(spi,
+					    &priv->irq_templates->tef_release);
+	if (ret)
+		return ret;
+
+	/* transform the data to system byte order */
+	mcp25xxfd_obj_ts_from_le(&tef->header);
+
+	fifo = (tef->header.flags & CAN_OBJ_FLAGS_SEQ_MASK) >>
+		CAN_OBJ_FLAGS_SEQ_SHIFT;
+
+	/* submit to queue */
+	tef->header.flags |= CAN_OBJ_FLAGS_CUSTOM_ISTEF;
+	mcp25xxfd_addto_queued_fifos(spi, &tef->header);
+
+	/* increment tef_address with rollover */
+	priv->fifos.tef_address += sizeof(*tef);
+	if (priv->fifos.tef_address > priv->fifos.tef_address_end)
+		priv->fifos.tef_address =
+			priv->fifos.tef_address_start;
+
+	/* and mark as processed right now - the tx ring (and the cyclic
+	 * tx fifo) frees its slots when processing the queued TEF
+	 */
+	if (!priv->tx_ring_count && !(fifo & MCP25XXFD_TX_RING_SEQ_CYCLIC))
+		mcp25xxfd_mark_tx_processed(spi, fifo);
+
+	return 0;
+}
+
+static int mcp25xxfd_can_ist_handle_tefif_conservative(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	u32 val[2];
+	int ret;
+
+	while (1) {
+		if (priv->tef_status.valid) {
+			/* use the values read together with the status */
+			priv->tef_status.valid = false;
+			val[0] = priv->tef_status.tefsta;
+			val[1] = priv->tef_status.tefua;
+		} else {
+			/* the queued TEFCON UINC has to reach the
+			 * controller first
+			 */
+			ret = mcp25xxfd_batch_flush(spi);
+			if (ret)
+				return ret;
+
+			/* get the current TEFSTA and TEFUA */
+			ret = mcp25xxfd_cmd_readn(priv->spi,
+						  CAN_TEFSTA,
+						  val,
+						  8,
+						  priv->spi_speed_hz);
+			if (ret)
+				return ret;
+			mcp25xxfd_convert_to_cpu(val, 2);
+		}
+
+		/* check for interrupt flags */
+		if (!(val[0] & CAN_TEFSTA_TEFNEIF))
+			return 0;
+
+		if (priv->fifos.tef_address != val[1]) {
+			dev_err(&spi->dev,
+				"TEF Address mismatch - read: %04x calculated: %04x\n",
+				val[1], priv->fifos.tef_address);
+			priv->fifos.tef_address = val[1];
+		}
+
+		ret = mcp25xxfd_can_ist_handle_tefif_handle_single(spi);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* read count TEF objects starting at the current tef_address in one go
+ * - the caller makes sure that they do not wrap around
+ */
+static int mcp25xxfd_can_ist_handle_tefif_read_bulk(struct spi_device *spi,
+						    int count)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct mcp25xxfd_obj_tef *tef;
+	int i, fifo;
+	int ret;
+
+	/* skip the last byte of the ts of the last object like the
+	 * single read does
+	 */
+	ret = mcp25xxfd_read_fifo_image(spi, priv->fifos.tef_address,
+					count * sizeof(*tef) - 1,
+					priv->spi_speed_hz);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < count; i++) {
+		tef = (struct mcp25xxfd_obj_tef *)(priv->fifos.fifo_data +
+						   priv->fifos.tef_address);
+
+		mcp25xxfd_obj_ts_from_le(&tef->header);
+		fifo = (tef->header.flags & CAN_OBJ_FLAGS_SEQ_MASK) >>
+			CAN_OBJ_FLAGS_SEQ_SHIFT;
+
+		tef->header.flags |= CAN_OBJ_FLAGS_CUSTOM_ISTEF;
+		mcp25xxfd_addto_queued_fifos(spi, &tef->header);
+
+		priv->fifos.tef_address += sizeof(*tef);
+		if (priv->fifos.tef_address > priv->fifos.tef_address_end)
+			priv->fifos.tef_address =
+				priv->fifos.tef_address_start;
+
+		if (!(fifo & MCP25XXFD_TX_RING_SEQ_CYCLIC))
+			mcp25xxfd_mark_tx_processed(spi, fifo);
+	}
+
+	return 0;
+}
+
+/* with the number of TEF objects known they get read with one transfer
+ * (two if they wrap around the end of the TEF) and released with one
+ * UINC write each - all of them in a single spi_message.
+ * only used without the tx ring.
+ */
+static int mcp25xxfd_can_ist_handle_tefif_count(struct spi_device *spi,
+						int count)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct mcp25xxfd_write_message *wm = &priv->irq_templates->tef_release;
+	const int size = sizeof(struct mcp25xxfd_obj_tef);
+	int i, n;
+	int ret;
+
+	for (i = count; i > 0; i -= n) {
+		/* the objects up to the end of the TEF */
+		n = min_t(int, i, (priv->fifos.tef_address_end -
+				   priv->fifos.tef_address) / size + 1);
+		ret = mcp25xxfd_can_ist_handle_tefif_read_bulk(spi, n);
+		if (ret)
+			return ret;
+	}
+	priv->stats.tef_bulk_reads++;
+	priv->stats.tef_bulk_objects += count;
+
+	/* the UINCs get queued in the write batch regardless, so they
+	 * get sent in one spi_message
+	 */
+	for (i = 0; i < count; i++) {
+		ret = mcp25xxfd_batch_add(spi, wm->tx, wm->xfer.len);
+		if (ret)
+			return ret;
+	}
+	if (!use_write_batching)
+		return mcp25xxfd_batch_flush(spi);
+
+	return 0;
+}
+
+static int mcp25xxfd_can_ist_handle_tefif(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	u32 pending = priv->fifos.tx_pending_mask_in_irq &
+		(~priv->fifos.tx_processed_mask);
+	int count;
+
+	/* calculate the number of fifos that have been processed */
+	count = hweight_long(pending);
+	count -= hweight_long(priv->status.txreq & pending);
+
+	/* in case of unexpected results handle "safely"
+	 * - as well as for the tx ring and the cyclic tx fifo, where the
+	 * masks do not apply
+	 */
+	if (count <= 0 || priv->tx_ring_count || priv->tx_cyclic.depth)
+		return mcp25xxfd_can_ist_handle_tefif_conservative(spi);
+
+	return mcp25xxfd_can_ist_handle_tefif_count(spi, count);
+}
+
+/* without the TEF a submitted fifo that is empty (TXIF) and has no
+ * TXREQ pending got transmitted - aborts got handled before and are
+ * not in TXIF any longer.
+ * the echo skbs get delivered right away, so there is no ordering
+ * against the rx frames and there are no tx time stamps.
+ * the fifo empty interrupt stays active until the fifo gets filled
+ * again, so it gets disabled until the next trigger enables it.
+ */
+static int mcp25xxfd_can_ist_handle_txif(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	u32 done = priv->fifos.tx_pending_mask_in_irq &
+		~priv->fifos.tx_processed_mask &
+		priv->status.txif & ~priv->status.txreq;
+	int fifo;
+	int ret;
+
+	for (fifo = priv->fifos.tx_fifo_start;
+	     fifo < priv->fifos.tx_fifo_start + priv->fifos.tx_fifos;
+	     fifo++) {
+		if (!(done & BIT(fifo)))
+			continue;
+
+		ret = mcp25xxfd_batch_write_mask(spi, CAN_FIFOCON(fifo),
+						 MCP25XXFD_TX_FIFOCON_IE,
+						 GENMASK(7, 0));
+		if (ret)
+			return ret;
+
+		priv->net->stats.tx_packets++;
+		priv->net->stats.tx_bytes +=
+			can_get_echo_skb(priv->net, fifo);
+		mcp25xxfd_tx_bql_done(priv, fifo);
+		mcp25xxfd_mark_tx_processed(spi, fifo);
+		can_led_event(priv->net, CAN_LED_EVENT_TX);
+	}
+
+	mcp25xxfd_tx_bql_completed(priv);
+
+	return 0;
+}
+
+/* the frame is still in the fifo after an abort, so requesting it
+ * again only takes a TXREQ write - that is done for lost arbitration
+ * (one-shot) and errors up to tx_retransmit_max times and/or until
+ * tx_retransmit_deadline_us after the first abort.
+ * returns 1 if the frame got requested again
+ */
+static int mcp25xxfd_tx_retransmit(struct spi_device *spi, int fifo,
+				   u32 val)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	ktime_t now = ktime_get();
+	u32 count = priv->tx_retransmit[fifo].count;
+	int ret;
+
+	if (!tx_retransmit_max && !tx_retransmit_deadline_us)
+		return 0;
+	if (!(val & (CAN_FIFOSTA_TXLARB | CAN_FIFOSTA_TXERR)))
+		return 0;
+
+	if (!count)
+		priv->tx_retransmit[fifo].first = now;
+	if ((tx_retransmit_max && count >= tx_retransmit_max) ||
+	    (tx_retransmit_deadline_us &&
+	     ktime_us_delta(now, priv->tx_retransmit[fifo].first) >
+	     tx_retransmit_deadline_us)) {
+		priv->tx_retransmit[fifo].count = 0;
+		priv->stats.tx_retransmit_exhausted++;
+		return 0;
+	}
+
+	ret = mcp25xxfd_batch_write_mask(spi, CAN_FIFOCON(fifo),
+					 CAN_FIFOCON_TXREQ,
+					 CAN_FIFOCON_TXREQ);
+	if (ret)
+		return ret;
+
+	priv->tx_retransmit[fifo].count = count + 1;
+	priv->stats.tx_retransmits++;
+
+	return 1;
+}
+
+static int mcp25xxfd_can_ist_handle_txatif_fifo(struct spi_device *spi,
+						int fifo, u32 val)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	int i;
+	int ret;
+
+	/* clear the relevant interrupt flags */
+	ret = mcp25xxfd_batch_write_mask(spi,
+					 CAN_FIFOSTA(fifo),
+					 0,
+					 CAN_FIFOSTA_TXABT |
+					 CAN_FIFOSTA_TXLARB |
+					 CAN_FIFOSTA_TXERR |
+					 CAN_FIFOSTA_TXATIF);
+	if (ret)
+		return ret;
+
+	if (val & CAN_FIFOSTA_TXLARB)
+		priv->stats.tx_abort_arbitration++;
+	else if (val & CAN_FIFOSTA_TXERR)
+		priv->stats.tx_abort_error++;
+	else
+		priv->stats.tx_abort_other++;
+
+	/* the frame is not done yet if it got requested again */
+	ret = mcp25xxfd_tx_retransmit(spi, fifo, val);
+	if (ret < 0)
+		return ret;
+	if (ret) {
+		priv->status.txif &= ~BIT(fifo);
+		return 0;
+	}
+
+	/* the tx ring gets reset after the TEF has been processed */
+	for (i = 0; i < priv->tx_ring_count; i++) {
+		if (fifo == priv->tx_rings[i].fifo) {
+			priv->tx_rings[i].reset_pending = true;
+			priv->status.txif &= ~BIT(fifo);
+			return 0;
+		}
+	}
+
+	/* and we release it from the echo_skb buffer
+	 * NOTE: this is one place where packet delivery will not
+	 * be ordered, as we do not have any timing information
+	 * when this occurred
+	 */
+	can_get_echo_skb(priv->net, fifo);
+	mcp25xxfd_tx_bql_done(priv, fifo);
+	mcp25xxfd_tx_bql_completed(priv);
+
+	/* but we need to run a bit of cleanup */
+	priv->status.txif &= ~BIT(fifo);
+	priv->net->stats.tx_aborted_errors++;
+
+	/* mark the fifo as processed */
+	 mcp25xxfd_mark_tx_processed(spi, fifo);
+
+	/* handle all the known cases accordingly - ignoring FIFO full */
+	val &= CAN_FIFOSTA_TXABT |
+		CAN_FIFOSTA_TXLARB |
+		CAN_FIFOSTA_TXERR;
+	switch (val) {
+	case CAN_FIFOSTA_TXERR:
+		break;
+	default:
+		dev_warn_ratelimited(&spi->dev,
+				     "Unknown TX-Fifo abort condition: %08x - stopping tx-queue\n",
+				     val);
+		break;
+	}
+
+	return 0;
+}
+
+/* read the CAN_FIFOSTA of all the aborted fifos in one spi_message */
+static int mcp25xxfd_can_ist_handle_txatif_gather(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct mcp25xxfd_gather_message *gm = &priv->irq_templates->txatif;
+	u32 val;
+	int i, fifo, seg;
+	int ret;
+
+	mcp25xxfd_init_gather_message(spi, gm, priv->spi_speed_hz);
+	for (i = 0, fifo = priv->fifos.tx_fifo_start;
+	    i < priv->fifos.tx_fifos; i++, fifo++) {
+		if (priv->status.txatif & BIT(fifo)) {
+			ret = mcp25xxfd_gather_message_add(spi, gm,
+							   CAN_FIFOSTA(fifo),
+							   4);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	ret = mcp25xxfd_sync_gather_message(spi, gm);
+	if (ret)
+		return ret;
+
+	for (i = 0, fifo = priv->fifos.tx_fifo_start, seg = 0;
+	    i < priv->fifos.tx_fifos; i++, fifo++) {
+		if (priv->status.txatif & BIT(fifo)) {
+			memcpy(&val, mcp25xxfd_gather_message_data(gm, seg++),
+			       sizeof(val));
+			mcp25xxfd_convert_to_cpu(&val, 1);
+			ret = mcp25xxfd_can_ist_handle_txatif_fifo(spi, fifo,
+								   val);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int mcp25xxfd_can_ist_handle_txatif(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	u32 val;
+	int i, fifo;
+	int ret;
+
+	if (priv->irq_templates->gather)
+		return mcp25xxfd_can_ist_handle_txatif_gather(spi);
+
+	/* process all the fifos with that flag set */
+	for (i = 0, fifo = priv->fifos.tx_fifo_start;
+	    i < priv->fifos.tx_fifos; i++, fifo++) {
+		if (priv->status.txatif & BIT(fifo)) {
+			/* read fifo status */
+			ret = mcp25xxfd_cmd_read(spi,
+						 CAN_FIFOSTA(fifo),
+						 &val,
+						 priv->spi_speed_hz);
+			if (ret)
+				return ret;
+
+			ret = mcp25xxfd_can_ist_handle_txatif_fifo(spi, fifo,
+								   val);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+static void mcp25xxfd_error_skb(struct net_device *net)
+{
+	struct mcp25xxfd_priv *priv = netdev_priv(net);
+	struct sk_buff *skb;
+	struct can_frame *frame;
+
+	skb = alloc_can_err_skb(net, &frame);
+	if (skb) {
+		frame->can_id = priv->can_err_id;
+		memcpy(frame->data, priv->can_err_data, 8);
+		netif_rx_ni(skb);
+	} else {
+		netdev_err(net, "cannot allocate error skb\n");
+	}
+}
+
+static int mcp25xxfd_can_ist_handle_rxovif(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	u32 mask = priv->status.rxovif;
+	int i;
+	int ret;
+
+	/* clear all fifos that have an overflow bit set */
+	for (i = 0; i < 32; i++) {
+		if (mask & BIT(i)) {
+			ret = mcp25xxfd_batch_write_mask(spi,
+							 CAN_FIFOSTA(i),
+							 0,
+							 CAN_FIFOSTA_RXOVIF);
+			if (ret)
+				return ret;
+			/* update statistics */
+			priv->net->stats.rx_over_errors++;
+			priv->net->stats.rx_errors++;
+			priv->stats.rx_overflow++;
+			priv->can_err_id |= CAN_ERR_CRTL;
+			priv->can_err_data[1] |= CAN_ERR_CRTL_RX_OVERFLOW;
+		}
+	}
+
+	return 0;
+}
+
+static int mcp25xxfd_can_ist_handle_modif(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	int omode = priv->active_can_mode;
+	int mode;
+	int ret;
+
+	/* Note that this irq does not get triggered in all situations
+	 * for example SERRIF will move to RESTICTED or LISTENONLY
+	 * but MODIF will not be raised!
+	 */
+
+	/* get the mode */
+	ret = mcp25xxfd_get_opmode(spi, &mode, priv->spi_speed_hz);
+	if (ret)
+		return ret;
+
+	/* if we are restricted, then return to "normal" mode */
+	if (mode == CAN_CON_MODE_RESTRICTED)
+		return mcp25xxfd_set_normal_opmode(spi);
+
+	/* the controller itself will transition to sleep, so we ignore it */
+	if (mode == CAN_CON_MODE_SLEEP)
+		return 0;
+
+	/* switches to the same mode as before are also ignored
+	 * - this typically happens if the driver is shortly
+	 *   switching to a different mode and then returning to the
+	 *   original mode
+	 */
+	if (mode == omode)
+		return 0;
+
+	/* these we need to handle correctly, so warn and give context */
+	dev_warn(&spi->dev,
+		 "Controller unexpectedly switched from mode %s(%u) to %s(%u)\n",
+		 mcp25xxfd_mode_names[omode], omode,
+		 mcp25xxfd_mode_names[mode], mode);
+
+	return 0;
+}
+
+static int mcp25xxfd_can_ist_handle_cerrif(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+
+	/* in principle we could also delay reading bdiag registers
+	 * until we get here - it would add some extra delay in the
+	 * error case, but be slightly faster in the "normal" case.
+	 * slightly faster would be saving 8 bytes of spi transfer.
+	 */
+
+	dev_err_ratelimited(&spi->dev, "CAN Bus error\n");
+	priv->can_err_id |= CAN_ERR_BUSERROR;
+
+	if (priv->status.bdiag1 &
+	    (CAN_BDIAG1_DBIT0ERR | CAN_BDIAG1_NBIT0ERR)) {
+		priv->can_err_id |= CAN_ERR_BUSERROR;
+		priv->can_err_data[2] |= CAN_ERR_PROT_BIT0;
+		priv->bdiag1_clear_mask |= CAN_BDIAG1_DBIT0ERR |
+			CAN_BDIAG1_NBIT0ERR;
+	}
+	if (priv->status.bdiag1 &
+	    (CAN_BDIAG1_DBIT1ERR | CAN_BDIAG1_NBIT1ERR)) {
+		priv->can_err_id |= CAN_ERR_BUSERROR;
+		priv->can_err_data[2] |= CAN_ERR_PROT_BIT1;
+		priv->bdiag1_clear_mask |= CAN_BDIAG1_DBIT1ERR |
+			CAN_BDIAG1_NBIT1ERR;
+	}
+	if (priv->status.bdiag1 &
+	    (CAN_BDIAG1_DSTUFERR | CAN_BDIAG1_NSTUFERR)) {
+		priv->can_err_id |= CAN_ERR_BUSERROR;
+		priv->can_err_data[2] |= CAN_ERR_PROT_STUFF;
+		priv->bdiag1_clear_mask |= CAN_BDIAG1_DSTUFERR |
+			CAN_BDIAG1_NSTUFERR;
+	}
+	if (priv->status.bdiag1 &
+	    (CAN_BDIAG1_DFORMERR | CAN_BDIAG1_NFORMERR)) {
+		priv->can_err_id |= CAN_ERR_BUSERROR;
+		priv->can_err_data[2] |= CAN_ERR_PROT_FORM;
+		priv->bdiag1_clear_mask |= CAN_BDIAG1_DFORMERR |
+			CAN_BDIAG1_NFORMERR;
+	}
+	if (priv->status.bdiag1 & CAN_BDIAG1_NACKERR) {
+		priv->can_err_id |= CAN_ERR_ACK;
+		priv->bdiag1_clear_mask |= CAN_BDIAG1_NACKERR;
+	}
+
+	return 0;
+}
+
+static int mcp25xxfd_can_ist_handle_eccif(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	int ret;
+	u32 val;
+	u32 addr;
+
+	priv->can_err_id |= CAN_ERR_CRTL;
+	priv->can_err_data[1] |= CAN_ERR_CRTL_UNSPEC;
+
+	/* read ECC status register */
+	ret = mcp25xxfd_cmd_read(spi, MCP25XXFD_ECCSTAT, &val,
+				 priv->spi_speed_hz);
+	if (ret)
+		return ret;
+
+	addr = (val & MCP25XXFD_ECCSTAT_ERRADDR_MASK) >>
+		MCP25XXFD_ECCSTAT_ERRADDR_SHIFT;
+
+	dev_err_ratelimited(&spi->dev,
+			    "ECC %s bit error at %03x\n",
+			    (val & MCP25XXFD_ECCSTAT_DEDIF) ?
+			    "double" : "single",
+			    addr);
+
+	return mcp25xxfd_cmd_write(spi, MCP25XXFD_ECCSTAT, 0,
+				 priv->spi_speed_hz);
+}
+
+static int mcp25xxfd_can_ist_handle_spicrcif(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	u32 val;
+	int ret;
+
+	/* read CRC register */
+	ret = mcp25xxfd_cmd_read(spi, MCP25XXFD_CRC, &val,
+				 priv->spi_speed_hz);
+	if (ret)
+		return ret;
+
+	dev_warn_ratelimited(&spi->dev,
+			     "SPI %s error - crc: %04x\n",
+			     (val & MCP25XXFD_CRC_FERRIF) ? "format" : "crc",
+			     val & MCP25XXFD_CRC_MASK);
+
+	/* clear the flags */
+	return mcp25xxfd_batch_write_mask(spi, MCP25XXFD_CRC, 0,
+					  MCP25XXFD_CRC_CRCERRIF |
+					  MCP25XXFD_CRC_FERRIF);
+}
+
+static int mcp25xxfd_can_ist_handle_serrif_txmab(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+
+	priv->net->stats.tx_fifo_errors++;
+	priv->net->stats.tx_errors++;
+	priv->stats.tx_mab++;
+
+	return 0;
+}
+
+static int mcp25xxfd_can_ist_handle_serrif_rxmab(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+
+	priv->net->stats.rx_dropped++;
+	priv->net->stats.rx_errors++;
+	priv->stats.rx_mab++;
+
+	return 0;
+}
+
+static int mcp25xxfd_can_ist_handle_serrif(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	u32 clear;
+	int ret;
+
+	/* clear some interrupts immediately,
+	 * so that we get notified if they happen again
+	 */
+	clear = CAN_INT_SERRIF | CAN_INT_MODIF | CAN_INT_IVMIF;
+	ret = mcp25xxfd_cmd_write_mask(spi, CAN_INT,
+				       priv->status.intf & (~clear),
+				       clear,
+				       priv->spi_speed_hz);
+	if (ret)
+		return ret;
+
+	/* Errors here are:
+	 * * Bus Bandwidth Error: when a RX Message Assembly Buffer
+	 *   is still full when the next message has already arrived
+	 *   the recived message shall be ignored
+	 * * TX MAB Underflow: when a TX Message is invalid
+	 *   due to ECC errors or TXMAB underflow
+	 *   in this situatioon the system will transition to
+	 *   Restricted or Listen Only mode
+	 */
+
+	priv->can_err_id |= CAN_ERR_CRTL;
+	priv->can_err_data[1] |= CAN_ERR_CRTL_UNSPEC;
+
+	/* a mode change + invalid message would indicate
+	 * TX MAB Underflow
+	 */
+	if ((priv->status.intf & CAN_INT_MODIF) &&
+	    (priv->status.intf & CAN_INT_IVMIF)) {
+		return mcp25xxfd_can_ist_handle_serrif_txmab(spi);
+	}
+
+	/* for RX there is only the RXIF an indicator
+	 * - surprizingly RX-MAB does not change mode or anything
+	 */
+	if (priv->status.intf & CAN_INT_RXIF)
+		return mcp25xxfd_can_ist_handle_serrif_rxmab(spi);
+
+	/* the final case */
+	dev_warn_ratelimited(&spi->dev,
+			     "unidentified system error - intf =  %08x\n",
+			     priv->status.intf);
+
+	return 0;
+}
+
+static int mcp25xxfd_can_ist_handle_ivmif(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+
+	/* if we have a systemerror as well, then ignore it */
+	if (priv->status.intf & CAN_INT_SERRIF)
+		return 0;
+
+	/* otherwise it is an RX issue, so account for it here */
+	priv->can_err_id |= CAN_ERR_PROT;
+	priv->can_err_data[2] |= CAN_ERR_PROT_FORM;
+	priv->net->stats.rx_frame_errors++;
+	priv->net->stats.rx_errors++;
+
+	return 0;
+}
+
+static int mcp25xxfd_disable_interrupts(struct spi_device *spi,
+					u32 speed_hz)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+
+	priv->status.intf = 0;
+	return mcp25xxfd_cmd_write(spi, CAN_INT, 0, speed_hz);
+}
+
+static int mcp25xxfd_enable_interrupts(struct spi_device *spi,
+				       u32 speed_hz)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	int ret;
+
+	priv->status.intf = (priv->config.no_tef ? CAN_INT_TXIE :
+			     CAN_INT_TEFIE) |
+		CAN_INT_RXIE |
+		CAN_INT_MODIE |
+		CAN_INT_SERRIE |
+		CAN_INT_IVMIE |
+		CAN_INT_CERRIE |
+		CAN_INT_RXOVIE |
+		CAN_INT_ECCIE;
+
+	/* get notified on crc errors of writes */
+	if (priv->spi_crc) {
+		ret = mcp25xxfd_cmd_write(spi, MCP25XXFD_CRC,
+					  MCP25XXFD_CRC_CRCERRIE |
+					  MCP25XXFD_CRC_FERRIE,
+					  speed_hz);
+		if (ret)
+			return ret;
+		priv->status.intf |= CAN_INT_SPICRCIE;
+	}
+
+	return mcp25xxfd_cmd_write(spi, CAN_INT,
+				   priv->status.intf,
+				   speed_hz);
+}
+
+static int mcp25xxfd_hw_wake(struct spi_device *spi)
+{
+	return mcp25xxfd_start_clock(spi, MCP25XXFD_CLK_USER_CAN);
+}
+
+static void mcp25xxfd_hw_sleep(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+
+	/* disable interrupts */
+	mcp25xxfd_disable_interrupts(spi, priv->spi_setup_speed_hz);
+
+	/* stop the clocks */
+	mcp25xxfd_stop_clock(spi, MCP25XXFD_CLK_USER_CAN);
+}
+
+/* wait for bits of a FIFOCON to clear */
+static int mcp25xxfd_tx_ring_wait_fifocon(struct spi_device *spi,
+					  int fifo, u32 mask)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	u32 val;
+	int i;
+	int ret;
+
+	for (i = 0; i < MCP25XXFD_TX_RING_RESET_POLLS; i++) {
+		ret = mcp25xxfd_cmd_read(spi, CAN_FIFOCON(fifo),
+					 &val, priv->spi_speed_hz);
+		if (ret)
+			return ret;
+		if (!(val & mask))
+			return 0;
+	}
+
+	return -ETIMEDOUT;
+}
+
+/* after an abort the remaining frames of the tx ring do not get
+ * transmitted, so abort all of them and start over with an empty fifo
+ */
+static int mcp25xxfd_tx_ring_reset(struct spi_device *spi,
+				   struct mcp25xxfd_tx_ring *ring)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct netdev_queue *txq = netdev_get_tx_queue(priv->net, ring->queue);
+	int i;
+	int ret;
+
+	ring->reset_pending = false;
+	priv->stats.tx_ring_resets++;
+
+	/* no more submissions to this ring until the fifo is reset */
+	__netif_tx_lock_bh(txq);
+	netif_tx_stop_queue(txq);
+	__netif_tx_unlock_bh(txq);
+
+	/* a staged frame gets aborted with the others */
+	mcp25xxfd_tx_launch_cancel(priv, ring->queue);
+
+	/* abort the pending frames and reset the fifo */
+	ret = mcp25xxfd_cmd_write_mask(spi, CAN_FIFOCON(ring->fifo), 0,
+				       CAN_FIFOCON_TXREQ, priv->spi_speed_hz);
+	if (ret)
+		return ret;
+	ret = mcp25xxfd_tx_ring_wait_fifocon(spi, ring->fifo, CAN_FIFOCON_TXREQ);
+	if (ret)
+		return ret;
+	ret = mcp25xxfd_cmd_write_mask(spi, CAN_FIFOCON(ring->fifo),
+				       CAN_FIFOCON_FRESET, CAN_FIFOCON_FRESET,
+				       priv->spi_speed_hz);
+	if (ret)
+		return ret;
+	ret = mcp25xxfd_tx_ring_wait_fifocon(spi, ring->fifo,
+					     CAN_FIFOCON_FRESET);
+	if (ret)
+		return ret;
+
+	/* the frames that made it onto the bus are in the TEF */
+	priv->tef_status.valid = false;
+	ret = mcp25xxfd_can_ist_handle_tefif_conservative(spi);
+	if (ret)
+		return ret;
+	ret = mcp25xxfd_batch_flush(spi);
+	if (ret)
+		return ret;
+	ret = mcp25xxfd_process_queued_fifos(spi);
+	if (ret)
+		return ret;
+
+	/* all the others got aborted */
+	for (i = 0; i < ring->depth; i++)
+		if (test_bit(i, &ring->inflight))
+			mcp25xxfd_tx_ring_free_slot(priv, ring, i, false);
+
+	mcp25xxfd_tx_bql_completed(priv);
+
+	/* the fifo starts with its first slot again */
+	ring->head = 0;
+	ring->tail = 0;
+	priv->tx_retransmit[ring->fifo].count = 0;
+
+	if (mcp25xxfd_tx_queue_may_wake(priv, ring->queue))
+		netif_tx_wake_queue(txq);
+
+	return 0;
+}
+
+static int mcp25xxfd_can_ist_handle_status(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	const u32 clear_irq = CAN_INT_TBCIF |
+		CAN_INT_MODIF |
+		CAN_INT_SERRIF |
+		CAN_INT_CERRIF |
+		CAN_INT_WAKIF |
+		CAN_INT_IVMIF;
+	int i;
+	int ret;
+
+	/* clear the interrupts - only the flags we have seen get cleared
+	 * (writing 1 has no effect), so that the clearing may get
+	 * queued without losing events that happen in the meantime
+	 */
+	mcp25xxfd_write_message_set(&priv->irq_templates->int_clear,
+				    ~(priv->status.intf & clear_irq));
+	ret = mcp25xxfd_batch_write_message(spi,
+					    &priv->irq_templates->int_clear);
+	if (ret)
+		return ret;
+
+	/* interrupt clearing info */
+	priv->bdiag1_clear_value = 0;
+	priv->bdiag1_clear_mask = 0;
+	priv->can_err_id = 0;
+	memset(priv->can_err_data, 0, 8);
+
+	/* state changes */
+	priv->new_state = priv->can.state;
+
+	/* clear queued fifos */
+	mcp25xxfd_clear_queued_fifos(spi);
+
+	/* system error interrupt needs to get handled first
+	 * to get us out of restricted mode
+	 */
+	if (priv->status.intf & CAN_INT_SERRIF) {
+		priv->stats.int_serr_count++;
+		ret = mcp25xxfd_can_ist_handle_serrif(spi);
+		if (ret)
+			return ret;
+	}
+
+	/* mode change interrupt */
+	if (priv->status.intf & CAN_INT_MODIF) {
+		priv->stats.int_mod_count++;
+		ret = mcp25xxfd_can_ist_handle_modif(spi);
+		if (ret)
+			return ret;
+	}
+
+	/* handle the rx */
+	if (priv->status.intf & CAN_INT_RXIF) {
+		priv->stats.int_rx_count++;
+		ret = mcp25xxfd_can_ist_handle_rxif(spi);
+		if (ret)
+			return ret;
+	}
+
+	/* handle aborted TX FIFOs */
+	if (priv->status.txatif) {
+		priv->stats.int_txat_count++;
+		ret = mcp25xxfd_can_ist_handle_txatif(spi);
+		if (ret)
+			return ret;
+	}
+
+	/* handle the transmitted frames without the TEF */
+	if (priv->config.no_tef && (priv->status.intf & CAN_INT_TXIF)) {
+		priv->stats.int_tx_count++;
+		ret = mcp25xxfd_can_ist_handle_txif(spi);
+		if (ret)
+			return ret;
+	}
+
+	/* handle the tef */
+	if (priv->status.intf & CAN_INT_TEFIF) {
+		priv->stats.int_tef_count++;
+		ret = mcp25xxfd_can_ist_handle_tefif(spi);
+		if (ret)
+			return ret;
+	}
+
+	/* submit the queued writes to release the fifos asap */
+	ret = mcp25xxfd_batch_flush(spi);
+	if (ret)
+		return ret;
+
+	/* process the queued fifos */
+	ret = mcp25xxfd_process_queued_fifos(spi);
+
+	/* reset the tx rings after an abort */
+	for (i = 0; i < priv->tx_ring_count; i++) {
+		if (!priv->tx_rings[i].reset_pending)
+			continue;
+		ret = mcp25xxfd_tx_ring_reset(spi, &priv->tx_rings[i]);
+		if (ret)
+			return ret;
+	}
+
+	/* handle error interrupt flags */
+	if (priv->status.rxovif) {
+		priv->stats.int_rxov_count++;
+		ret = mcp25xxfd_can_ist_handle_rxovif(spi);
+		if (ret)
+			return ret;
+	}
+
+	/* sram ECC error interrupt */
+	if (priv->status.intf & CAN_INT_ECCIF) {
+		priv->stats.int_ecc_count++;
+		ret = mcp25xxfd_can_ist_handle_eccif(spi);
+		if (ret)
+			return ret;
+	}
+
+	/* spi crc error interrupt */
+	if (priv->status.intf & CAN_INT_SPICRCIF) {
+		priv->stats.int_spicrc_count++;
+		ret = mcp25xxfd_can_ist_handle_spicrcif(spi);
+		if (ret)
+			return ret;
+	}
+
+	/* message format interrupt */
+	if (priv->status.intf & CAN_INT_IVMIF) {
+		priv->stats.int_ivm_count++;
+		ret = mcp25xxfd_can_ist_handle_ivmif(spi);
+		if (ret)
+			return ret;
+	}
+
+	/* handle bus errors in more detail */
+	if (priv->status.intf & CAN_INT_CERRIF) {
+		priv->stats.int_cerr_count++;
+		ret = mcp25xxfd_can_ist_handle_cerrif(spi);
+		if (ret)
+			return ret;
+	}
+
+	/* Error counter handling */
+	if (priv->status.trec & CAN_TREC_TXWARN) {
+		priv->new_state = CAN_STATE_ERROR_WARNING;
+		priv->can_err_id |= CAN_ERR_CRTL;
+		priv->can_err_data[1] |= CAN_ERR_CRTL_TX_WARNING;
+	}
+	if (priv->status.trec & CAN_TREC_RXWARN) {
+		priv->new_state = CAN_STATE_ERROR_WARNING;
+		priv->can_err_id |= CAN_ERR_CRTL;
+		priv->can_err_data[1] |= CAN_ERR_CRTL_RX_WARNING;
+	}
+	if (priv->status.trec & CAN_TREC_TXBP) {
+		priv->new_state = CAN_STATE_ERROR_PASSIVE;
+		priv->can_err_id |= CAN_ERR_CRTL;
+		priv->can_err_data[1] |= CAN_ERR_CRTL_TX_PASSIVE;
+	}
+	if (priv->status.trec & CAN_TREC_RXBP) {
+		priv->new_state = CAN_STATE_ERROR_PASSIVE;
+		priv->can_err_id |= CAN_ERR_CRTL;
+		priv->can_err_data[1] |= CAN_ERR_CRTL_RX_PASSIVE;
+	}
+	if (priv->status.trec & CAN_TREC_TXBO) {
+		priv->new_state = CAN_STATE_BUS_OFF;
+		priv->can_err_id |= CAN_ERR_BUSOFF;
+	}
+
+	/* based on the last state state check the new state */
+	switch (priv->can.state) {
+	case CAN_STATE_ERROR_ACTIVE:
+		if (priv->new_state >= CAN_STATE_ERROR_WARNING &&
+		    priv->new_state <= CAN_STATE_BUS_OFF)
+			priv->can.can_stats.error_warning++;
+		/* fallthrough */
+	case CAN_STATE_ERROR_WARNING:
+		if (priv->new_state >= CAN_STATE_ERROR_PASSIVE &&
+		    priv->new_state <= CAN_STATE_BUS_OFF)
+			priv->can.can_stats.error_passive++;
+		break;
+	default:
+		break;
+	}
+	priv->can.state = priv->new_state;
+
+	/* and send error packet */
+	if (priv->can_err_id)
+		mcp25xxfd_error_skb(priv->net);
+
+	/* handle BUS OFF */
+	if (priv->can.state == CAN_STATE_BUS_OFF) {
+		if (priv->can.restart_ms == 0) {
+			mcp25xxfd_stop_queue(priv->net);
+			priv->force_quit = 1;
+			priv->can.can_stats.bus_off++;
+			can_bus_off(priv->net);
+			mcp25xxfd_hw_sleep(spi);
+		}
 	}
 
 	/* clear bdiag flags */
 	if (priv->bdiag1_clear_mask) {
-		ret = mcp25xxfd_cmd_write_mask(spi,
-					       CAN_BDIAG1,
-					       priv->bdiag1_clear_value,
-					       priv->bdiag1_clear_mask,
-					       priv->spi_speed_hz);
+		ret = mcp25xxfd_batch_write_mask(spi,
+						 CAN_BDIAG1,
+						 priv->bdiag1_clear_value,
+						 priv->bdiag1_clear_mask);
+		if (ret)
+			return ret;
+	}
+
+	/* and submit all the queued writes - before the tx queue gets
+	 * restarted, as they may disable the interrupts of the tx fifos
+	 * (see mcp25xxfd_can_ist_handle_txif) the next trigger enables
+	 */
+	ret = mcp25xxfd_batch_flush(spi);
+	if (ret)
+		return ret;
+
+	/* restart the tx queue if needed */
+	if (priv->can.state != CAN_STATE_BUS_OFF && !priv->tx_ring_count &&
+	    priv->fifos.tx_processed_mask == priv->fifos.tx_fifo_mask)
+		mcp25xxfd_wake_queue(spi);
+
+	return 0;
+}
+
+/* register the device with the other devices on its spi controller */
+static int mcp25xxfd_bus_join(struct mcp25xxfd_priv *priv)
+{
+	struct spi_master *master = priv->spi->master;
+	struct mcp25xxfd_bus *bus;
+
+	mutex_lock(&mcp25xxfd_buses_mutex);
+	list_for_each_entry(bus, &mcp25xxfd_buses, list)
+		if (bus->master == master)
+			goto join;
+
+	bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+	if (!bus) {
+		mutex_unlock(&mcp25xxfd_buses_mutex);
+		return -ENOMEM;
+	}
+	bus->master = master;
+	INIT_LIST_HEAD(&bus->devices);
+	list_add_tail(&bus->list, &mcp25xxfd_buses);
+
+join:
+	priv->bus_lock.bus = bus;
+	list_add_tail(&priv->bus_lock.node, &bus->devices);
+	mutex_unlock(&mcp25xxfd_buses_mutex);
+
+	return 0;
+}
+
+static void mcp25xxfd_bus_leave(struct mcp25xxfd_priv *priv)
+{
+	struct mcp25xxfd_bus *bus = priv->bus_lock.bus;
+
+	mutex_lock(&mcp25xxfd_buses_mutex);
+	list_del(&priv->bus_lock.node);
+	if (list_empty(&bus->devices)) {
+		list_del(&bus->list);
+		kfree(bus);
+	}
+	priv->bus_lock.bus = NULL;
+	mutex_unlock(&mcp25xxfd_buses_mutex);
+}
+
+/* the spi bus lock of the irq thread
+ * while the lock is held no other device on the bus (typically the
+ * sibling controller) can interleave its transfers with the service
+ * pass - the lock gets released when the time or byte budget is used
+ * up, so that the other devices get their turn.
+ * other contexts block in spi_sync until it is released, spi_async
+ * fails with -EBUSY for all the devices on the controller - this one
+ * and its siblings alike, so start_xmit of each of them stops the queue
+ * until the lock is released. the async irq handler of a sibling hands
+ * over to its irq thread, which blocks in spi_sync, while the launch
+ * timer retries and the cyclic flush counts a miss.
+ */
+static void mcp25xxfd_bus_lock(struct mcp25xxfd_priv *priv)
+{
+	if (priv->bus_lock.locked || !use_spi_bus_lock)
+		return;
+
+	spi_bus_lock(priv->spi->master);
+	WRITE_ONCE(priv->bus_lock.locked, true);
+	WRITE_ONCE(priv->bus_lock.bus->locked, true);
+	priv->bus_lock.start = ktime_get();
+	priv->bus_lock.bytes = 0;
+	priv->stats.bus_lock_count++;
+}
+
+/* restart the queues of a device that ran into the spi bus lock
+ * called with mcp25xxfd_buses_mutex held
+ */
+static void mcp25xxfd_bus_lock_resume(struct mcp25xxfd_priv *priv)
+{
+	int i;
+
+	for (i = 0; i < priv->net->real_num_tx_queues; i++) {
+		if (!test_and_clear_bit(i, &priv->bus_lock.tx_stopped))
+			continue;
+		mcp25xxfd_tx_batch_resume(priv, i);
+		if (mcp25xxfd_tx_queue_may_wake(priv, i))
+			netif_wake_subqueue(priv->net, i);
+	}
+}
+
+static void mcp25xxfd_bus_unlock(struct mcp25xxfd_priv *priv)
+{
+	struct mcp25xxfd_bus *bus = priv->bus_lock.bus;
+	struct mcp25xxfd_priv *dev;
+	u64 held;
+
+	if (!priv->bus_lock.locked)
+		return;
+
+	spi_bus_unlock(priv->spi->master);
+	WRITE_ONCE(bus->locked, false);
+	WRITE_ONCE(priv->bus_lock.locked, false);
+
+	held = ktime_to_ns(ktime_sub(ktime_get(), priv->bus_lock.start));
+	priv->stats.bus_lock_hold_ns += held;
+	if (held > priv->stats.bus_lock_hold_max_ns)
+		priv->stats.bus_lock_hold_max_ns = held;
+
+	/* wake the queues of all the devices on the controller that ran
+	 * into the lock - pairs with the barrier in
+	 * mcp25xxfd_bus_lock_stop_queue
+	 */
+	smp_mb();
+	mutex_lock(&mcp25xxfd_buses_mutex);
+	list_for_each_entry(dev, &bus->devices, bus_lock.node)
+		mcp25xxfd_bus_lock_resume(dev);
+	mutex_unlock(&mcp25xxfd_buses_mutex);
+}
+
+/* release the spi bus lock when the budget is used up */
+static void mcp25xxfd_bus_lock_check_budget(struct mcp25xxfd_priv *priv)
+{
+	u32 budget_us = spi_bus_lock_budget_us ?
+		spi_bus_lock_budget_us : MCP25XXFD_BUS_LOCK_BUDGET_US;
+	u32 budget_bytes = spi_bus_lock_budget_bytes ?
+		spi_bus_lock_budget_bytes : MCP25XXFD_BUS_LOCK_BUDGET_BYTES;
+
+	if (!priv->bus_lock.locked)
+		return;
+
+	if (priv->bus_lock.bytes < budget_bytes &&
+	    ktime_us_delta(ktime_get(), priv->bus_lock.start) < budget_us)
+		return;
+
+	priv->stats.bus_lock_budget_exceeded++;
+	mcp25xxfd_bus_unlock(priv);
+}
+
+/* read the interrupt status flags - with gather also TEFSTA and TEFUA */
+static int mcp25xxfd_can_ist_read_status(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct mcp25xxfd_irq_templates *t = priv->irq_templates;
+	u32 val[2];
+	int ret;
+
+	if (!t->gather) {
+		ret = mcp25xxfd_sync_read_message(spi, &t->status);
+		if (ret)
+			return ret;
+		memcpy(&priv->status, mcp25xxfd_read_message_data(&t->status),
+		       sizeof(priv->status));
+		return 0;
+	}
+
+	ret = mcp25xxfd_sync_gather_message(spi, &t->status_gather);
+	if (ret)
+		return ret;
+	memcpy(&priv->status,
+	       mcp25xxfd_gather_message_data(&t->status_gather, 0),
+	       sizeof(priv->status));
+	memcpy(val, mcp25xxfd_gather_message_data(&t->status_gather, 1),
+	       sizeof(val));
+	mcp25xxfd_convert_to_cpu(val, 2);
+	priv->tef_status.tefsta = val[0];
+	priv->tef_status.tefua = val[1];
+	priv->tef_status.valid = true;
+
+	return 0;
+}
+
+static irqreturn_t mcp25xxfd_can_ist_loop_locked(struct mcp25xxfd_priv *priv)
+{
+	struct spi_device *spi = priv->spi;
+	int ret;
+
+	while (!priv->force_quit) {
+		/* count irq loops */
+		priv->stats.irq_loops++;
+
+		/* (re)take the spi bus lock for this pass */
+		mcp25xxfd_bus_lock(priv);
+
+		/* copy pending to in_irq - any
+		 * updates that happen asyncronously
+		 * are not taken into account here
+		 */
+		priv->fifos.tx_pending_mask_in_irq =
+			priv->fifos.tx_pending_mask;
+
+		/* read interrupt status flags */
+		ret = mcp25xxfd_can_ist_read_status(spi);
 		if (ret)
 			return ret;
+
+		/* only act if the mask is applied */
+		if ((priv->status.intf &
+		     (priv->status.intf >> CAN_INT_IE_SHIFT)) == 0)
+			break;
+
+		/* handle the status */
+		ret = mcp25xxfd_can_ist_handle_status(spi);
+		if (ret) {
+			/* still submit whatever got queued */
+			mcp25xxfd_batch_flush(spi);
+			return ret;
+		}
+
+		/* give the other devices on the bus their turn */
+		mcp25xxfd_bus_lock_check_budget(priv);
+	}
+
+	return IRQ_HANDLED;
+}
+
+static irqreturn_t mcp25xxfd_can_ist_loop(struct mcp25xxfd_priv *priv)
+{
+	irqreturn_t ret;
+
+	ret = mcp25xxfd_can_ist_loop_locked(priv);
+	mcp25xxfd_bus_unlock(priv);
+
+	return ret;
+}
+
+/* spi_async driven interrupt handling
+ *
+ * the state machine looks like this:
+ *   * hard irq: disable the irq and submit the status read
+ *   * status read complete:
+ *     * nothing pending: enable the irq again - done
+ *     * only RX pending: submit the read of all pending RX fifos
+ *       including the release of those fifos in one spi_message
+ *       (with crc the release is a separate spi_message that only
+ *       gets submitted when all the crcs match)
+ *     * anything else: hand over to the irq thread, which runs the
+ *       normal (spi_sync based) loop and enables the irq when done
+ *   * rx read complete: wake the irq thread, which checks the crc,
+ *     queues the frames to the network stack and submits the status
+ *     read again - the completion may run in hard irq context, so it
+ *     does nothing else
+ *
+ * the RX fifos are always read in full (see bulk_read_fifos)
+ * to keep it to a single spi_message.
+ *
+ * while the spi_messages are in flight the irq stays disabled,
+ * so there is never more than one context handling the controller.
+ */
+
+static void mcp25xxfd_async_ist_finish(struct mcp25xxfd_priv *priv)
+{
+	struct mcp25xxfd_async_ist *ist = priv->async_ist;
+
+	ist->handoff = false;
+	enable_irq(priv->spi->irq);
+	complete_all(&ist->done);
+}
+
+static void mcp25xxfd_async_ist_handoff(struct mcp25xxfd_priv *priv)
+{
+	priv->stats.irq_async_handoff++;
+	priv->async_ist->handoff = true;
+	irq_wake_thread(priv->spi->irq, priv);
+}
+
+static void mcp25xxfd_async_ist_read_status(struct mcp25xxfd_priv *priv)
+{
+	struct mcp25xxfd_async_ist *ist = priv->async_ist;
+
+	/* fall back to the irq thread if we can not submit */
+	if (spi_async(priv->spi, &ist->status.msg))
+		mcp25xxfd_async_ist_handoff(priv);
+}
+
+/* continue after the rx fifos have been read and released */
+static void mcp25xxfd_async_ist_rx_done(struct mcp25xxfd_priv *priv)
+{
+	struct mcp25xxfd_async_ist *ist = priv->async_ist;
+
+	/* feed the frames to the network stack */
+	if (mcp25xxfd_process_queued_fifos(priv->spi)) {
+		mcp25xxfd_async_ist_handoff(priv);
+		return;
+	}
+
+	if (priv->force_quit) {
+		mcp25xxfd_async_ist_finish(priv);
+		return;
+	}
+
+	ist->crc_retries = mcp25xxfd_crc_retries();
+	mcp25xxfd_async_ist_read_status(priv);
+}
+
+/* continue in the irq thread */
+static void mcp25xxfd_async_ist_rx_wake(struct mcp25xxfd_priv *priv,
+					int stage)
+{
+	priv->async_ist->rx_stage = stage;
+	irq_wake_thread(priv->spi->irq, priv);
+}
+
+static void mcp25xxfd_async_ist_release_complete(void *context)
+{
+	mcp25xxfd_async_ist_rx_wake(context, MCP25XXFD_ASYNC_IST_RX_RELEASED);
+}
+
+/* check the crc of all the blocks read - on errors either retry
+ * or hand over to the irq thread, which reads the fifos again
+ * as they have not been released yet
+ */
+static bool mcp25xxfd_async_ist_rx_crc_ok(struct mcp25xxfd_priv *priv)
+{
+	struct mcp25xxfd_async_ist *ist = priv->async_ist;
+	int i;
+
+	for (i = 0; i < ist->rx_blocks; i++) {
+		if (mcp25xxfd_crc_check(ist->rx_cmd[i],
+					priv->fifos.fifo_data +
+					ist->rx_block_addr[i],
+					ist->rx_block_len[i],
+					ist->rx_crc[i]))
+			continue;
+
+		mcp25xxfd_crc_error(priv, FIFO_DATA(ist->rx_block_addr[i]));
+		if (ist->crc_retries--) {
+			if (spi_async(priv->spi, &ist->rx_msg))
+				mcp25xxfd_async_ist_handoff(priv);
+		} else {
+			priv->stats.spi_crc_err_exhausted++;
+			mcp25xxfd_async_ist_handoff(priv);
+		}
+		return false;
+	}
+
+	return true;
+}
+
+static void mcp25xxfd_async_ist_rx_complete(void *context)
+{
+	mcp25xxfd_async_ist_rx_wake(context, MCP25XXFD_ASYNC_IST_RX_READ);
+}
+
+/* the rx fifos have been read - runs in the irq thread */
+static void mcp25xxfd_async_ist_rx_read(struct mcp25xxfd_priv *priv)
+{
+	struct mcp25xxfd_async_ist *ist = priv->async_ist;
+	struct spi_device *spi = priv->spi;
+	struct mcp25xxfd_obj_rx *rx;
+	int i;
+
+	if (ist->rx_msg.status) {
+		mcp25xxfd_async_ist_handoff(priv);
+		return;
+	}
+
+	if (priv->spi_crc && !mcp25xxfd_async_ist_rx_crc_ok(priv))
+		return;
+
+	/* preprocess data */
+	for (i = 0; i < 32; i++) {
+		if (!(ist->rx_mask & BIT(i)))
+			continue;
+		rx = (struct mcp25xxfd_obj_rx *)
+			(priv->fifos.fifo_data + priv->fifos.fifo_address[i]);
+		mcp25xxfd_transform_rx(spi, rx);
+		priv->stats.fifo_usage[i]++;
+	}
+
+	/* with crc release the fifos now */
+	if (priv->spi_crc) {
+		if (spi_async(spi, &ist->release_msg))
+			mcp25xxfd_async_ist_handoff(priv);
+		return;
+	}
+
+	mcp25xxfd_async_ist_rx_done(priv);
+}
+
+static void mcp25xxfd_async_ist_read_rx(struct mcp25xxfd_priv *priv)
+{
+	struct mcp25xxfd_async_ist *ist = priv->async_ist;
+	const int fifo_size = sizeof(struct mcp25xxfd_obj_rx) +
+		priv->fifos.payload_size;
+	/* the maximum number of fifos per block */
+	const int max = priv->spi_crc ?
+		MCP25XXFD_SPI_CRC_MAX_RAM_LEN / fifo_size : 32;
+	struct spi_message *release_msg;
+	struct spi_transfer *xfer = ist->rx_xfer;
+	u32 mask = priv->status.rxif & priv->fifos.rx_fifo_mask;
+	u32 addr;
+	int len;
+	int i, start;
+
+	ist->rx_mask = mask;
+	ist->rx_blocks = 0;
+	memset(ist->rx_xfer, 0, sizeof(ist->rx_xfer));
+	spi_message_init(&ist->rx_msg);
+	ist->rx_msg.complete = mcp25xxfd_async_ist_rx_complete;
+	ist->rx_msg.context = priv;
+
+	/* read blocks of adjacent fifos in one transfer each */
+	i = 0;
+	while (i < 32) {
+		if (!(mask & BIT(i))) {
+			i++;
+			continue;
+		}
+		for (start = i; i < 32 && (mask & BIT(i)) && i - start < max;
+		     i++)
+			;
+
+		addr = priv->fifos.fifo_address[start];
+		len = (i - start) * fifo_size;
+		ist->rx_block_addr[ist->rx_blocks] = addr;
+		ist->rx_block_len[ist->rx_blocks] = len;
+
+		if (priv->spi_crc) {
+			mcp25xxfd_calc_cmd_addr(INSTRUCTION_READ_CRC,
+						FIFO_DATA(addr),
+						ist->rx_cmd[ist->rx_blocks]);
+			ist->rx_cmd[ist->rx_blocks][2] =
+				mcp25xxfd_crc_len(FIFO_DATA(addr), len);
+		} else {
+			mcp25xxfd_calc_cmd_addr(INSTRUCTION_READ,
+						FIFO_DATA(addr),
+						ist->rx_cmd[ist->rx_blocks]);
+		}
+		xfer->tx_buf = ist->rx_cmd[ist->rx_blocks];
+		xfer->len = priv->spi_crc ? 3 : 2;
+		xfer->speed_hz = priv->spi_speed_hz;
+		spi_message_add_tail(xfer, &ist->rx_msg);
+		xfer++;
+
+		xfer->rx_buf = priv->fifos.fifo_data + addr;
+		xfer->len = len;
+		xfer->speed_hz = priv->spi_speed_hz;
+		xfer->cs_change = 1;
+		spi_message_add_tail(xfer, &ist->rx_msg);
+
+		/* the crc trails the data */
+		if (priv->spi_crc) {
+			xfer->cs_change = 0;
+			xfer++;
+			xfer->rx_buf = ist->rx_crc[ist->rx_blocks];
+			xfer->len = 2;
+			xfer->speed_hz = priv->spi_speed_hz;
+			xfer->cs_change = 1;
+			spi_message_add_tail(xfer, &ist->rx_msg);
+		}
+		xfer++;
+
+		ist->rx_blocks++;
+	}
+
+	/* release the fifos - reusing the buffers of the templates
+	 * with crc this happens in a separate message after the check
+	 */
+	if (priv->spi_crc) {
+		/* no cs_change on the last transfer */
+		xfer[-1].cs_change = 0;
+
+		release_msg = &ist->release_msg;
+		xfer = ist->release_xfer;
+		memset(ist->release_xfer, 0, sizeof(ist->release_xfer));
+		spi_message_init(release_msg);
+		release_msg->complete = mcp25xxfd_async_ist_release_complete;
+		release_msg->context = priv;
+	} else {
+		release_msg = &ist->rx_msg;
+	}
+
+	for (i = 0; i < 32; i++) {
+		if (!(mask & BIT(i)))
+			continue;
+		xfer->tx_buf = priv->irq_templates->release[i].tx;
+		xfer->len = priv->irq_templates->release[i].xfer.len;
+		xfer->speed_hz = priv->spi_speed_hz;
+		xfer->cs_change = 1;
+		spi_message_add_tail(xfer, release_msg);
+		xfer++;
+	}
+
+	/* no cs_change on the last transfer */
+	xfer[-1].cs_change = 0;
+
+	if (spi_async(priv->spi, &ist->rx_msg))
+		mcp25xxfd_async_ist_handoff(priv);
+}
+
+static void mcp25xxfd_async_ist_status_complete(void *context)
+{
+	struct mcp25xxfd_priv *priv = context;
+	struct mcp25xxfd_async_ist *ist = priv->async_ist;
+	const u32 trec_mask = CAN_TREC_TXWARN | CAN_TREC_RXWARN |
+		CAN_TREC_TXBP | CAN_TREC_RXBP | CAN_TREC_TXBO;
+	u32 active;
+
+	if (ist->status.msg.status) {
+		mcp25xxfd_async_ist_handoff(priv);
+		return;
+	}
+
+	if (priv->force_quit) {
+		mcp25xxfd_async_ist_finish(priv);
+		return;
+	}
+
+	/* retry the status read on crc errors */
+	if (!mcp25xxfd_read_message_crc_ok(&ist->status)) {
+		mcp25xxfd_crc_error(priv, CAN_INT);
+		if (ist->crc_retries--) {
+			mcp25xxfd_async_ist_read_status(priv);
+		} else {
+			priv->stats.spi_crc_err_exhausted++;
+			mcp25xxfd_async_ist_handoff(priv);
+		}
+		return;
+	}
+	ist->crc_retries = mcp25xxfd_crc_retries();
+
+	/* count irq loops */
+	priv->stats.irq_loops++;
+
+	/* copy the status */
+	memcpy(&priv->status, mcp25xxfd_read_message_data(&ist->status),
+	       sizeof(priv->status));
+
+	/* only act if the mask is applied */
+	active = priv->status.intf & (priv->status.intf >> CAN_INT_IE_SHIFT);
+	if (!active) {
+		mcp25xxfd_async_ist_finish(priv);
+		return;
+	}
+
+	/* anything but RX is handled by the irq thread */
+	if ((active & ~CAN_INT_RXIF) ||
+	    priv->status.rxovif || priv->status.txatif ||
+	    (priv->status.trec & trec_mask)) {
+		mcp25xxfd_async_ist_handoff(priv);
+		return;
+	}
+
+	priv->stats.int_rx_count++;
+	mcp25xxfd_clear_queued_fifos(priv->spi);
+	mcp25xxfd_async_ist_read_rx(priv);
+}
+
+static irqreturn_t mcp25xxfd_can_isr(int irq, void *dev_id)
+{
+	struct mcp25xxfd_priv *priv = dev_id;
+	struct mcp25xxfd_async_ist *ist = priv->async_ist;
+
+	if (!ist || priv->force_quit)
+		return IRQ_WAKE_THREAD;
+
+	priv->stats.irq_calls++;
+	priv->stats.irq_state = IRQ_STATE_RUNNING;
+
+	/* the irq stays disabled until the state machine is finished */
+	disable_irq_nosync(irq);
+	reinit_completion(&ist->done);
+	ist->crc_retries = mcp25xxfd_crc_retries();
+
+	mcp25xxfd_async_ist_read_status(priv);
+
+	return IRQ_HANDLED;
+}
+
+static irqreturn_t mcp25xxfd_async_ist_rx_thread(struct mcp25xxfd_priv *priv)
+{
+	struct mcp25xxfd_async_ist *ist = priv->async_ist;
+	int stage = ist->rx_stage;
+
+	ist->rx_stage = MCP25XXFD_ASYNC_IST_RX_IDLE;
+
+	if (stage == MCP25XXFD_ASYNC_IST_RX_READ) {
+		mcp25xxfd_async_ist_rx_read(priv);
+		return IRQ_HANDLED;
+	}
+
+	if (ist->release_msg.status)
+		mcp25xxfd_async_ist_handoff(priv);
+	else
+		mcp25xxfd_async_ist_rx_done(priv);
+
+	return IRQ_HANDLED;
+}
+
+static irqreturn_t mcp25xxfd_can_ist(int irq, void *dev_id)
+{
+	struct mcp25xxfd_priv *priv = dev_id;
+	struct mcp25xxfd_async_ist *ist = priv->async_ist;
+	irqreturn_t ret;
+
+	/* this thread owns the irq spi buffer */
+	priv->spi_ist_task = current;
+
+	/* handle the handoff from the spi_async state machine */
+	if (ist && ist->handoff) {
+		ret = mcp25xxfd_can_ist_loop(priv);
+		mcp25xxfd_async_ist_finish(priv);
+		return ret;
 	}
 
+	/* continue the rx of the spi_async state machine */
+	if (ist && ist->rx_stage != MCP25XXFD_ASYNC_IST_RX_IDLE)
+		return mcp25xxfd_async_ist_rx_thread(priv);
+
+	priv->stats.irq_calls++;
+	priv->stats.irq_state = IRQ_STATE_RUNNING;
+
+	return mcp25xxfd_can_ist_loop(priv);
+}
+
+static int mcp25xxfd_async_ist_alloc(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct mcp25xxfd_async_ist *ist;
+
+	ist = kzalloc(sizeof(*ist), GFP_KERNEL | GFP_DMA);
+	if (!ist)
+		return -ENOMEM;
+
+	/* the status read */
+	mcp25xxfd_init_read_message(spi, &ist->status, CAN_INT,
+				    sizeof(priv->status), priv->spi_speed_hz);
+	ist->status.msg.complete = mcp25xxfd_async_ist_status_complete;
+	ist->status.msg.context = priv;
+
+	/* nothing is in flight */
+	init_completion(&ist->done);
+	complete_all(&ist->done);
+
+	priv->async_ist = ist;
+
 	return 0;
 }
 
-static irqreturn_t mcp25xxfd_can_ist(int irq, void *dev_id)
+/* wait for the spi_async state machine to finish - force_quit
+ * needs to be set before to avoid it getting restarted
+ */
+static void mcp25xxfd_async_ist_sync(struct spi_device *spi)
 {
-	struct mcp25xxfd_priv *priv = dev_id;
-	struct spi_device *spi = priv->spi;
-	int ret;
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
 
-	priv->stats.irq_calls++;
-	priv->stats.irq_state = IRQ_STATE_RUNNING;
+	if (!priv->async_ist)
+		return;
 
-	while (!priv->force_quit) {
-		/* count irq loops */
-		priv->stats.irq_loops++;
+	synchronize_irq(spi->irq);
+	wait_for_completion(&priv->async_ist->done);
+}
 
-		/* copy pending to in_irq - any
-		 * updates that happen asyncronously
-		 * are not taken into account here
-		 */
-		priv->fifos.tx_pending_mask_in_irq =
-			priv->fifos.tx_pending_mask;
+static void mcp25xxfd_async_ist_free(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
 
-		/* read interrupt status flags */
-		ret = mcp25xxfd_cmd_readn(spi, CAN_INT,
-					  &priv->status,
-					  sizeof(priv->status),
-					  priv->spi_speed_hz);
-		if (ret)
-			return ret;
+	kfree(priv->async_ist);
+	priv->async_ist = NULL;
+}
 
-		/* only act if the mask is applied */
-		if ((priv->status.intf &
-		     (priv->status.intf >> CAN_INT_IE_SHIFT)) == 0)
-			break;
+static int mcp25xxfd_irq_templates_alloc(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	struct mcp25xxfd_irq_templates *t;
+	const u32 clear_irq = CAN_INT_TBCIF |
+		CAN_INT_MODIF |
+		CAN_INT_SERRIF |
+		CAN_INT_CERRIF |
+		CAN_INT_WAKIF |
+		CAN_INT_IVMIF;
+	int i;
 
-		/* handle the status */
-		ret = mcp25xxfd_can_ist_handle_status(spi);
-		if (ret)
-			return ret;
-	}
+	t = kzalloc(sizeof(*t), GFP_KERNEL | GFP_DMA);
+	if (!t)
+		return -ENOMEM;
 
-	return IRQ_HANDLED;
+	/* the status read */
+	mcp25xxfd_init_read_message(spi, &t->status, CAN_INT,
+				    sizeof(priv->status), priv->spi_speed_hz);
+
+	/* the status read including TEFSTA/TEFUA */
+	t->gather = use_status_gather;
+	mcp25xxfd_init_gather_message(spi, &t->status_gather,
+				      priv->spi_speed_hz);
+	mcp25xxfd_gather_message_add(spi, &t->status_gather, CAN_INT,
+				     sizeof(priv->status));
+	mcp25xxfd_gather_message_add(spi, &t->status_gather, CAN_TEFSTA, 8);
+
+	/* the TEF read - the address gets set on use */
+	mcp25xxfd_init_read_message(spi, &t->tef, FIFO_DATA(0),
+				    sizeof(struct mcp25xxfd_obj_tef) - 1,
+				    priv->spi_speed_hz);
+	mcp25xxfd_init_write_message(spi, &t->tef_release, CAN_TEFCON,
+				     CAN_TEFCON_UINC, CAN_TEFCON_UINC,
+				     priv->spi_speed_hz);
+
+	/* the interrupt clearing - the data gets set on use */
+	mcp25xxfd_init_write_message(spi, &t->int_clear, CAN_INT, 0,
+				     clear_irq, priv->spi_speed_hz);
+
+	/* the fifo releases */
+	for (i = 0; i < 32; i++)
+		mcp25xxfd_init_write_message(spi, &t->release[i],
+					     CAN_FIFOCON(i),
+					     CAN_FIFOCON_UINC,
+					     CAN_FIFOCON_UINC,
+					     priv->spi_speed_hz);
+
+	spi_message_init(&t->batch.msg);
+
+	priv->irq_templates = t;
+
+	return 0;
+}
+
+static void mcp25xxfd_irq_templates_free(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+
+	kfree(priv->irq_templates);
+	priv->irq_templates = NULL;
 }
 
 static int mcp25xxfd_get_berr_counter(const struct net_device *net,
@@ -3483,13 +8197,136 @@ static int mcp25xxfd_setup_osc(struct spi_device *spi)
 	return -ENODEV;
 }
 
+/* spi clock calibration
+ *
+ * the spi clock is stepped up in MCP25XXFD_CALIBRATION_STEPS steps to the
+ * maximum allowed (SYSCLK/2 and the limit of the spi device) and at each
+ * step write/read-back patterns over the fifo SRAM and crc protected
+ * register reads are run.
+ * When all the steps pass the limit itself is kept - the spi core does
+ * not clock a device above its spi-max-frequency, so there is nothing
+ * to test beyond it. Otherwise the clock rate chosen is one step below
+ * the highest step that passed, as the margin is not known.
+ * Without a step to fall back to, or when the test itself fails, the
+ * (conservative) setup clock rate is used.
+ */
+#define MCP25XXFD_CALIBRATION_STEPS		8
+#define MCP25XXFD_CALIBRATION_ITERATIONS	16
+#define MCP25XXFD_CALIBRATION_SRAM_SIZE		256
+
+static const u32 mcp25xxfd_calibration_patterns[] = {
+	0x00000000, 0xffffffff, 0x55555555, 0xaaaaaaaa,
+	0x0f0f0f0f, 0xf0f0f0f0, 0x33333333, 0xcccccccc,
+};
+
+static int mcp25xxfd_calibrate_spi_test(struct spi_device *spi,
+					u32 speed_hz)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	/* the fifo memory image is not in use yet, so use it as buffer */
+	u32 *wbuf = (u32 *)priv->fifos.fifo_data;
+	u32 *rbuf = wbuf + MCP25XXFD_CALIBRATION_SRAM_SIZE / 4;
+	u32 pattern, val;
+	int i, j;
+	int ret;
+
+	for (i = 0; i < MCP25XXFD_CALIBRATION_ITERATIONS; i++) {
+		/* alternate between fixed patterns and address dependent */
+		pattern = mcp25xxfd_calibration_patterns[
+			(i / 2) % ARRAY_SIZE(mcp25xxfd_calibration_patterns)];
+		for (j = 0; j < MCP25XXFD_CALIBRATION_SRAM_SIZE / 4; j++)
+			wbuf[j] = (i & 1) ? pattern ^ (j * 0x9e3779b9) :
+				pattern;
+
+		/* write and read back SRAM */
+		ret = mcp25xxfd_cmd_writen(spi, FIFO_DATA(0), wbuf,
+					   MCP25XXFD_CALIBRATION_SRAM_SIZE,
+					   speed_hz);
+		if (ret)
+			return ret;
+		ret = mcp25xxfd_cmd_readn(spi, FIFO_DATA(0), rbuf,
+					  MCP25XXFD_CALIBRATION_SRAM_SIZE,
+					  speed_hz);
+		if (ret)
+			return ret;
+		if (memcmp(wbuf, rbuf, MCP25XXFD_CALIBRATION_SRAM_SIZE))
+			return -EIO;
+
+		/* crc protected read of a known register */
+		ret = mcp25xxfd_cmd_readn_crc_single(spi, MCP25XXFD_OSC,
+						     &val, sizeof(val),
+						     speed_hz);
+		if (ret)
+			return ret;
+		if (le32_to_cpu(val) != priv->regs.osc)
+			return -EIO;
+	}
+
+	return 0;
+}
+
+static int mcp25xxfd_calibrate_spi(struct spi_device *spi)
+{
+	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
+	u32 max_hz = priv->spi_speed_hz;
+	u32 speed_hz, good_hz = 0, chosen_hz = 0;
+	int step;
+	int ret;
+
+	/* calibrate with the system clock we will run with */
+	ret = mcp25xxfd_setup_osc(spi);
+	if (ret)
+		return ret;
+
+	for (step = 1; step <= MCP25XXFD_CALIBRATION_STEPS; step++) {
+		speed_hz = div_u64((u64)max_hz * step,
+				   MCP25XXFD_CALIBRATION_STEPS);
+		ret = mcp25xxfd_calibrate_spi_test(spi, speed_hz);
+		if (ret == -EIO || ret == -EBADMSG)
+			break;
+		if (ret) {
+			dev_warn(&spi->dev,
+				 "spi clock calibration at %u Hz failed: %i\n",
+				 speed_hz, ret);
+			chosen_hz = 0;
+			break;
+		}
+		/* keep one step of margin */
+		chosen_hz = good_hz;
+		good_hz = speed_hz;
+	}
+
+	/* the limit verified cleanly */
+	if (step > MCP25XXFD_CALIBRATION_STEPS)
+		chosen_hz = max_hz;
+
+	if (!chosen_hz) {
+		priv->spi_speed_hz = min(priv->spi_speed_hz,
+					 priv->spi_setup_speed_hz);
+		dev_warn(&spi->dev,
+			 "spi clock calibration found no speed with margin - using %u Hz\n",
+			 priv->spi_speed_hz);
+		return 0;
+	}
+
+	priv->spi_calibrated_speed_hz = chosen_hz;
+	priv->spi_speed_hz = chosen_hz;
+	priv->spi_setup_speed_hz = min(priv->spi_setup_speed_hz, chosen_hz);
+
+	dev_info(&spi->dev, "calibrated spi clock: %u Hz (limit %u Hz)\n",
+		 chosen_hz, max_hz);
+
+	return 0;
+}
+
 static int mcp25xxfd_setup_fifo(struct net_device *net,
 				struct mcp25xxfd_priv *priv,
 				struct spi_device *spi)
 {
-	u32 val, available_memory, tx_memory_used;
+	struct mcp25xxfd_tx_cyclic *cyclic = &priv->tx_cyclic;
+	u32 val, available_memory, tx_memory_used, prio;
 	int ret;
-	int i, fifo;
+	int i, fifo, depth, queues, cyclic_fifos;
 
 	/* clear all filter */
 	for (i = 0; i < 32; i++) {
@@ -3554,15 +8391,93 @@ static int mcp25xxfd_setup_fifo(struct net_device *net,
 		priv->fifos.tx_fifos = tx_fifos;
 	}
 
+	/* the cyclic tx fifo is a ring of its own, its frames need TEF
+	 * entries as well
+	 */
+	cyclic->fifo = 0;
+	cyclic->depth = IS_ENABLED(CONFIG_DEBUG_FS) ? tx_cyclic_depth : 0;
+	if (cyclic->depth) {
+		if (!is_power_of_2(cyclic->depth) || cyclic->depth < 2 ||
+		    cyclic->depth > MCP25XXFD_TX_RING_MAX_DEPTH) {
+			dev_err(&spi->dev,
+				"cyclic tx depth has to be a power of 2 between 2 and %i\n",
+				MCP25XXFD_TX_RING_MAX_DEPTH);
+			return -EINVAL;
+		}
+		if (priv->config.no_tef) {
+			dev_err(&spi->dev,
+				"The cyclic tx fifo needs the TEF\n");
+			return -EINVAL;
+		}
+		/* the batch is written without crc, as for tx batching */
+		if (priv->spi_crc) {
+			dev_err(&spi->dev,
+				"The cyclic tx fifo does not support spi crc\n");
+			return -EINVAL;
+		}
+	}
+	cyclic_fifos = cyclic->depth ? 1 : 0;
+
+	/* the tx ring is a single tx-fifo with multiple slots
+	 * - the TXQ is always used as a ring
+	 * - with multiple netdev tx queues each queue gets its own ring
+	 * by default the rings share the maximum depth the memory allows
+	 * (besides the cyclic tx fifo)
+	 */
+	priv->fifos.tx_fifo_depth = 1;
+	priv->tx_ring_count = 0;
+	queues = net->real_num_tx_queues;
+	if (tx_ring_depth || priv->config.use_txq || queues > 1) {
+		depth = tx_ring_depth;
+		if (!depth)
+			depth = rounddown_pow_of_two(
+				max_t(int, ((priv->fifos.payload_size == 8) ?
+					    MCP25XXFD_TX_RING_MAX_DEPTH :
+					    MCP25XXFD_TX_RING_MAX_DEPTH / 2) -
+				      cyclic->depth, queues) / queues);
+		if (!is_power_of_2(depth) || depth < 2 ||
+		    depth > MCP25XXFD_TX_RING_MAX_DEPTH) {
+			dev_err(&spi->dev,
+				"tx ring depth has to be a power of 2 between 2 and %i\n",
+				MCP25XXFD_TX_RING_MAX_DEPTH);
+			return -EINVAL;
+		}
+		/* the echo skbs get shared by the rings */
+		if (queues * depth > TX_ECHO_SKB_MAX) {
+			dev_err(&spi->dev,
+				"%i tx queues with a ring depth of %i exceed the %i echo skbs\n",
+				queues, depth, TX_ECHO_SKB_MAX);
+			return -EINVAL;
+		}
+		if (priv->config.no_tef) {
+			dev_err(&spi->dev,
+				"The tx ring needs the TEF\n");
+			return -EINVAL;
+		}
+		priv->fifos.tx_fifos = queues;
+		priv->fifos.tx_fifo_depth = depth;
+	}
+
 	/* check range - we need 1 RX-fifo and one tef-fifo, hence 30 */
-	if (priv->fifos.tx_fifos > 30) {
+	if (priv->fifos.tx_fifos + cyclic_fifos > 30) {
 		dev_err(&spi->dev,
 			"There is an absolute maximum of 30 tx-fifos\n");
 		return -EINVAL;
 	}
 
-	tx_memory_used = priv->fifos.tx_fifos *
-		(sizeof(struct mcp25xxfd_obj_tef) +
+	/* the TEF has at most 32 entries */
+	if (cyclic->depth &&
+	    priv->fifos.tx_fifos * priv->fifos.tx_fifo_depth +
+	    cyclic->depth > 32) {
+		dev_err(&spi->dev,
+			"The tx-fifos and the cyclic tx fifo exceed the 32 TEF entries\n");
+		return -EINVAL;
+	}
+
+	/* without the TEF its memory is available for rx fifos */
+	tx_memory_used = (priv->fifos.tx_fifos * priv->fifos.tx_fifo_depth +
+			  cyclic->depth) *
+		((priv->config.no_tef ? 0 : sizeof(struct mcp25xxfd_obj_tef)) +
 		 sizeof(struct mcp25xxfd_obj_tx) +
 		 priv->fifos.payload_size);
 	/* check that we are not exceeding memory limits with 1 RX buffer */
@@ -3582,11 +8497,17 @@ static int mcp25xxfd_setup_fifo(struct net_device *net,
 		 priv->fifos.payload_size) /
 		priv->fifos.rx_fifo_depth;
 
-	/* we only support 31 FIFOS in total (TEF = FIFO0),
+	/* we only support 31 FIFOS in total (FIFO0 is the TXQ),
 	 * so modify rx accordingly
 	 */
-	if (priv->fifos.tx_fifos + priv->fifos.rx_fifos > 31)
-		priv->fifos.rx_fifos = 31 - priv->fifos.tx_fifos;
+	if (priv->config.use_txq) {
+		if (priv->fifos.rx_fifos + cyclic_fifos > 31)
+			priv->fifos.rx_fifos = 31 - cyclic_fifos;
+	} else if (priv->fifos.tx_fifos + cyclic_fifos +
+		   priv->fifos.rx_fifos > 31) {
+		priv->fifos.rx_fifos = 31 - priv->fifos.tx_fifos -
+			cyclic_fifos;
+	}
 
 	/* calculate effective memory used */
 	available_memory -= priv->fifos.rx_fifos *
@@ -3595,37 +8516,52 @@ static int mcp25xxfd_setup_fifo(struct net_device *net,
 		priv->fifos.rx_fifo_depth;
 
 	/* calcluate tef size */
-	priv->fifos.tef_fifos = priv->fifos.tx_fifos;
+	priv->fifos.tef_fifos = priv->fifos.tx_fifos *
+		priv->fifos.tx_fifo_depth + cyclic->depth;
 	fifo = available_memory / sizeof(struct mcp25xxfd_obj_tef);
 	if (fifo > 0) {
 		priv->fifos.tef_fifos += fifo;
 		if (priv->fifos.tef_fifos > 32)
 			priv->fifos.tef_fifos = 32;
 	}
+	if (priv->config.no_tef)
+		priv->fifos.tef_fifos = 0;
 
-	/* calculate rx/tx fifo start */
+	/* calculate rx/tx fifo start - the TXQ is FIFO0 */
 	priv->fifos.rx_fifo_start = 1;
-	priv->fifos.tx_fifo_start =
-		priv->fifos.rx_fifo_start + priv->fifos.rx_fifos;
+	if (priv->config.use_txq)
+		priv->fifos.tx_fifo_start = 0;
+	else
+		priv->fifos.tx_fifo_start =
+			priv->fifos.rx_fifo_start + priv->fifos.rx_fifos;
 
-	/* set up TEF SIZE to the number of tx_fifos and IRQ */
-	priv->regs.tefcon = CAN_TEFCON_FRESET |
-		CAN_TEFCON_TEFNEIE |
-		CAN_TEFCON_TEFTSEN |
-		((priv->fifos.tef_fifos - 1) << CAN_TEFCON_FSIZE_SHIFT);
+	/* the cyclic tx fifo is the last one */
+	if (cyclic->depth)
+		cyclic->fifo = priv->config.use_txq ?
+			priv->fifos.rx_fifo_start + priv->fifos.rx_fifos :
+			priv->fifos.tx_fifo_start + priv->fifos.tx_fifos;
 
-	ret = mcp25xxfd_cmd_write(spi, CAN_TEFCON,
-				  priv->regs.tefcon,
-				  priv->spi_setup_speed_hz);
-	if (ret)
-		return ret;
+	/* set up TEF SIZE to the number of tx_fifos and IRQ */
+	if (!priv->config.no_tef) {
+		priv->regs.tefcon = CAN_TEFCON_FRESET |
+			CAN_TEFCON_TEFNEIE |
+			CAN_TEFCON_TEFTSEN |
+			((priv->fifos.tef_fifos - 1) <<
+			 CAN_TEFCON_FSIZE_SHIFT);
+
+		ret = mcp25xxfd_cmd_write(spi, CAN_TEFCON,
+					  priv->regs.tefcon,
+					  priv->spi_setup_speed_hz);
+		if (ret)
+			return ret;
+	}
 
 	/* set up tx fifos */
-	val = CAN_FIFOCON_TXEN |
-		CAN_FIFOCON_TXATIE | /* show up txatie flags in txatif reg */
+	val = MCP25XXFD_TX_FIFOCON_IE |
 		CAN_FIFOCON_FRESET | /* reset FIFO */
 		(priv->fifos.payload_mode << CAN_FIFOCON_PLSIZE_SHIFT) |
-		(0 << CAN_FIFOCON_FSIZE_SHIFT); /* 1 FIFO only */
+		/* 1 FIFO only unless used as tx ring */
+		((priv->fifos.tx_fifo_depth - 1) << CAN_FIFOCON_FSIZE_SHIFT);
 
 	if (priv->can.ctrlmode & CAN_CTRLMODE_ONE_SHOT)
 		if (three_shot)
@@ -3640,12 +8576,16 @@ static int mcp25xxfd_setup_fifo(struct net_device *net,
 
 	for (i = 0; i < priv->fifos.tx_fifos; i++) {
 		fifo = priv->fifos.tx_fifo_start + i;
+		/* the prioriy needs to be inverted
+		 * we need to run from lowest to highest to avoid MAB errors
+		 * - the tx rings use the priority of their netdev tx queue
+		 */
+		if (priv->fifos.tx_fifo_depth > 1)
+			prio = priv->tx_queue_txpri[i];
+		else
+			prio = 31 - fifo;
 		ret = mcp25xxfd_cmd_write(spi, CAN_FIFOCON(fifo),
-					  /* the prioriy needs to be inverted
-					   * we need to run from lowest to
-					   * highest to avoid MAB errors
-					   */
-					  val | ((31 - fifo) <<
+					  val | (prio <<
 						 CAN_FIFOCON_TXPRI_SHIFT),
 					  priv->spi_setup_speed_hz);
 		if (ret)
@@ -3653,6 +8593,27 @@ static int mcp25xxfd_setup_fifo(struct net_device *net,
 		priv->fifos.tx_fifo_mask |= BIT(fifo);
 	}
 
+	/* the cyclic tx fifo - always with unlimited attempts, as an
+	 * aborted frame would never free its slot, and without the abort
+	 * interrupt. its priority follows the individual tx fifos.
+	 */
+	if (cyclic->fifo) {
+		ret = mcp25xxfd_cmd_write(spi, CAN_FIFOCON(cyclic->fifo),
+					  CAN_FIFOCON_TXEN |
+					  CAN_FIFOCON_FRESET |
+					  (priv->fifos.payload_mode <<
+					   CAN_FIFOCON_PLSIZE_SHIFT) |
+					  ((cyclic->depth - 1) <<
+					   CAN_FIFOCON_FSIZE_SHIFT) |
+					  (CAN_FIFOCON_TXAT_UNLIMITED <<
+					   CAN_FIFOCON_TXAT_SHIFT) |
+					  ((31 - cyclic->fifo) <<
+					   CAN_FIFOCON_TXPRI_SHIFT),
+					  priv->spi_setup_speed_hz);
+		if (ret)
+			return ret;
+	}
+
 	/* now set up RX FIFO */
 	for (i = 0,
 	     fifo = priv->fifos.rx_fifo_start + priv->fifos.rx_fifos - 1;
@@ -3701,15 +8662,18 @@ static int mcp25xxfd_setup_fifo(struct net_device *net,
 		return ret;
 
 	/* for the TEF fifo */
-	ret = mcp25xxfd_cmd_read(spi, CAN_TEFUA, &val,
-				 priv->spi_setup_speed_hz);
-	if (ret)
-		return ret;
-	priv->fifos.tef_address = val;
-	priv->fifos.tef_address_start = val;
-	priv->fifos.tef_address_end = priv->fifos.tef_address_start +
-		priv->fifos.tef_fifos * sizeof(struct mcp25xxfd_obj_tef) -
-		1;
+	if (!priv->config.no_tef) {
+		ret = mcp25xxfd_cmd_read(spi, CAN_TEFUA, &val,
+					 priv->spi_setup_speed_hz);
+		if (ret)
+			return ret;
+		priv->fifos.tef_address = val;
+		priv->fifos.tef_address_start = val;
+		priv->fifos.tef_address_end =
+			priv->fifos.tef_address_start +
+			priv->fifos.tef_fifos *
+			sizeof(struct mcp25xxfd_obj_tef) - 1;
+	}
 
 	/* get all the relevant addresses for the transmit fifos */
 	for (i = 0; i < priv->fifos.tx_fifos; i++) {
@@ -3720,12 +8684,39 @@ static int mcp25xxfd_setup_fifo(struct net_device *net,
 			return ret;
 		priv->fifos.fifo_address[fifo] = val;
 	}
+	if (cyclic->fifo) {
+		ret = mcp25xxfd_cmd_read(spi, CAN_FIFOUA(cyclic->fifo),
+					 &val, priv->spi_setup_speed_hz);
+		if (ret)
+			return ret;
+		priv->fifos.fifo_address[cyclic->fifo] = val;
+	}
 
 	/* and prepare the spi_messages */
 	ret = mcp25xxfd_fill_spi_transmit_fifos(priv);
 	if (ret)
 		return ret;
 
+	/* the tx rings start at the first slot of the (reset) fifos */
+	if (priv->fifos.tx_fifo_depth > 1) {
+		depth = priv->fifos.tx_fifo_depth;
+		for (i = 0; i < priv->fifos.tx_fifos; i++) {
+			struct mcp25xxfd_tx_ring *ring = &priv->tx_rings[i];
+
+			ring->depth = depth;
+			ring->fifo = priv->fifos.tx_fifo_start + i;
+			ring->queue = i;
+			ring->echo_base = i * depth;
+			ring->ordered = !priv->config.use_txq;
+			ring->head = 0;
+			ring->tail = 0;
+			ring->inflight = 0;
+			ring->reset_pending = false;
+			ring->txm = priv->spi_transmit_fifos + i * depth;
+		}
+		priv->tx_ring_count = priv->fifos.tx_fifos;
+	}
+
 	/* get all the relevant addresses for the rx fifos */
 	for (i = 0; i < priv->fifos.rx_fifos; i++) {
 		fifo = priv->fifos.rx_fifo_start + i;
@@ -3774,7 +8765,9 @@ static int mcp25xxfd_setup(struct net_device *net,
 	if (ret)
 		return ret;
 
-	/* time stamp control register - 1ns resolution, but disabled */
+	/* time stamp control register - 1us resolution
+	 * (the prescaler divides by TBCPRE + 1, so slightly less)
+	 */
 	ret = mcp25xxfd_cmd_write(spi, CAN_TBC, 0,
 				  priv->spi_setup_speed_hz);
 	if (ret)
@@ -3789,12 +8782,20 @@ static int mcp25xxfd_setup(struct net_device *net,
 		return ret;
 
 	/* setup value of con_register */
-	priv->regs.con = CAN_CON_STEF /* enable TEF */;
-
-	/* transmission bandwidth sharing bits */
+	priv->regs.con = 0;
+	if (!priv->config.no_tef)
+		priv->regs.con |= CAN_CON_STEF; /* enable TEF */
+	if (priv->config.use_txq)
+		priv->regs.con |= CAN_CON_TXQEN;
+
+	/* transmission bandwidth sharing bits - the tx shaper of the
+	 * interface may ask for more
+	 */
 	if (bw_sharing_log2bits > 12)
 		bw_sharing_log2bits = 12;
-	priv->regs.con |= bw_sharing_log2bits << CAN_CON_TXBWS_SHIFT;
+	priv->regs.con |= max_t(u32, bw_sharing_log2bits,
+				min_t(u32, priv->tx_shaper.txbws, 12))
+		<< CAN_CON_TXBWS_SHIFT;
 	/* non iso FD mode */
 	if (!(priv->can.ctrlmode & CAN_CTRLMODE_FD_NON_ISO))
 		priv->regs.con |= CAN_CON_ISOCRCEN;
@@ -3818,6 +8819,7 @@ static int mcp25xxfd_open(struct net_device *net)
 {
 	struct mcp25xxfd_priv *priv = netdev_priv(net);
 	struct spi_device *spi = priv->spi;
+	int i;
 	int ret;
 
 	ret = open_candev(net);
@@ -3830,16 +8832,40 @@ static int mcp25xxfd_open(struct net_device *net)
 
 	priv->force_quit = 0;
 
+	/* decide on crc protected spi transfers */
+	priv->spi_crc = use_spi_crc;
+
 	/* clear those statistics */
 	memset(&priv->stats, 0, sizeof(priv->stats));
 
-	ret = request_threaded_irq(spi->irq, NULL,
+	/* prepare the spi_messages for the interrupt handler */
+	ret = mcp25xxfd_irq_templates_alloc(spi);
+	if (ret) {
+		mcp25xxfd_power_enable(priv->transceiver, 0);
+		close_candev(net);
+		return ret;
+	}
+
+	/* prepare the spi_async driven interrupt handling */
+	if (use_async_ist) {
+		ret = mcp25xxfd_async_ist_alloc(spi);
+		if (ret) {
+			mcp25xxfd_irq_templates_free(spi);
+			mcp25xxfd_power_enable(priv->transceiver, 0);
+			close_candev(net);
+			return ret;
+		}
+	}
+
+	ret = request_threaded_irq(spi->irq, mcp25xxfd_can_isr,
 				   mcp25xxfd_can_ist,
 				   IRQF_ONESHOT | IRQF_TRIGGER_LOW,
 				   DEVICE_NAME, priv);
 	if (ret) {
 		dev_err(&spi->dev, "failed to acquire irq %d - %i\n",
 			spi->irq, ret);
+		mcp25xxfd_async_ist_free(spi);
+		mcp25xxfd_irq_templates_free(spi);
 		mcp25xxfd_power_enable(priv->transceiver, 0);
 		close_candev(net);
 		return ret;
@@ -3863,25 +8889,56 @@ static int mcp25xxfd_open(struct net_device *net)
 	/* setting up default state */
 	priv->can.state = CAN_STATE_ERROR_ACTIVE;
 
+	/* the rx path converts the time stamps as soon as the interrupts
+	 * are enabled
+	 */
+	ret = mcp25xxfd_timestamp_start(priv);
+	if (ret)
+		goto open_clean;
+
 	/* only now enable the interrupt on the controller */
 	ret =  mcp25xxfd_enable_interrupts(spi,
 					   priv->spi_setup_speed_hz);
 	if (ret)
-		goto open_clean;
+		goto open_timestamp;
 
 	can_led_event(net, CAN_LED_EVENT_OPEN);
 
+	/* nothing is in flight any longer */
+	for (i = 0; i < net->real_num_tx_queues; i++) {
+		netdev_tx_reset_queue(netdev_get_tx_queue(net, i));
+		priv->tx_bql_pkts[i] = 0;
+		priv->tx_bql_bits[i] = 0;
+		priv->tx_batch[i].count = 0;
+		priv->tx_batch[i].wire_bits = 0;
+		priv->tx_launch[i].held = 0;
+	}
+	priv->bus_lock.tx_stopped = 0;
+	memset(priv->tx_launch_time, 0, sizeof(priv->tx_launch_time));
+	priv->tx_shaper.tokens = (s64)priv->tx_shaper.burst_us * NSEC_PER_USEC;
+	priv->tx_shaper.last = ktime_get();
+	priv->tx_shaper.stopped = 0;
+	mcp25xxfd_tx_cyclic_start(priv);
+
 	priv->tx_queue_status = TX_QUEUE_STATUS_RUNNING;
-	netif_wake_queue(net);
+	netif_tx_wake_all_queues(net);
 
 	return 0;
 
+open_timestamp:
+	mcp25xxfd_timestamp_stop(priv);
 open_clean:
 	mcp25xxfd_disable_interrupts(spi, priv->spi_setup_speed_hz);
+	priv->force_quit = 1;
+	mcp25xxfd_async_ist_sync(spi);
 	free_irq(spi->irq, priv);
+	priv->spi_ist_task = NULL;
+	mcp25xxfd_async_ist_free(spi);
+	mcp25xxfd_irq_templates_free(spi);
 	mcp25xxfd_hw_sleep(spi);
 	mcp25xxfd_power_enable(priv->transceiver, 0);
 	close_candev(net);
+	priv->spi_crc = false;
 
 	return ret;
 }
@@ -3905,14 +8962,34 @@ static int mcp25xxfd_stop(struct net_device *net)
 {
 	struct mcp25xxfd_priv *priv = netdev_priv(net);
 	struct spi_device *spi = priv->spi;
+	int i;
+
+	mcp25xxfd_timestamp_stop(priv);
+
+	for (i = 0; i < MCP25XXFD_TX_QUEUES_MAX; i++)
+		mcp25xxfd_tx_launch_cancel(priv, i);
+	hrtimer_cancel(&priv->tx_shaper.timer);
+	mcp25xxfd_tx_cyclic_stop(priv);
 
 	close_candev(net);
 
+	/* no sibling may resume the queues once the fifos are gone */
+	mutex_lock(&mcp25xxfd_buses_mutex);
+	priv->bus_lock.tx_stopped = 0;
+	mutex_unlock(&mcp25xxfd_buses_mutex);
+
 	kfree(priv->spi_transmit_fifos);
 	priv->spi_transmit_fifos = NULL;
+	priv->tx_ring_count = 0;
+	for (i = 0; i < MCP25XXFD_TX_QUEUES_MAX; i++)
+		priv->tx_rings[i].txm = NULL;
 
 	priv->force_quit = 1;
+	mcp25xxfd_async_ist_sync(spi);
 	free_irq(spi->irq, priv);
+	priv->spi_ist_task = NULL;
+	mcp25xxfd_async_ist_free(spi);
+	mcp25xxfd_irq_templates_free(spi);
 
 	/* Disable and clear pending interrupts */
 	mcp25xxfd_disable_interrupts(spi, priv->spi_setup_speed_hz);
@@ -3923,6 +9000,7 @@ static int mcp25xxfd_stop(struct net_device *net)
 
 	mcp25xxfd_power_enable(priv->transceiver, 0);
 
+	priv->spi_crc = false;
 	priv->can.state = CAN_STATE_STOPPED;
 
 	can_led_event(net, CAN_LED_EVENT_STOP);
@@ -3934,9 +9012,16 @@ static const struct net_device_ops mcp25xxfd_netdev_ops = {
 	.ndo_open = mcp25xxfd_open,
 	.ndo_stop = mcp25xxfd_stop,
 	.ndo_start_xmit = mcp25xxfd_start_xmit,
+	.ndo_select_queue = mcp25xxfd_select_queue,
+	.ndo_setup_tc = mcp25xxfd_setup_tc,
+	.ndo_do_ioctl = mcp25xxfd_do_ioctl,
 	.ndo_change_mtu = can_change_mtu,
 };
 
+static const struct ethtool_ops mcp25xxfd_ethtool_ops = {
+	.get_ts_info = mcp25xxfd_get_ts_info,
+};
+
 static const struct of_device_id mcp25xxfd_of_match[] = {
 	{
 		.compatible	= "microchip,mcp2517fd",
@@ -3964,11 +9049,13 @@ static int mcp25xxfd_dump_regs(struct seq_file *file, void *offset)
 	int count;
 	int ret;
 
+	mcp25xxfd_spi_debug_enter(priv);
+
 	count = (CAN_TXQUA - CAN_CON) / 4 + 1;
 	ret = mcp25xxfd_cmd_readn(spi, CAN_CON, data, 4 * count,
 				  priv->spi_setup_speed_hz);
 	if (ret)
-		return ret;
+		goto out;
 
 	mcp25xxfd_convert_to_cpu((u32 *)data, 4 * count);
 
@@ -3982,7 +9069,7 @@ static int mcp25xxfd_dump_regs(struct seq_file *file, void *offset)
 	ret = mcp25xxfd_cmd_readn(spi, MCP25XXFD_OSC, data, 4 * count,
 				  priv->spi_setup_speed_hz);
 	if (ret)
-		return ret;
+		goto out;
 	mcp25xxfd_convert_to_cpu((u32 *)data, 4 * count);
 
 	for (i = 0; i < count; i++) {
@@ -3991,14 +9078,97 @@ static int mcp25xxfd_dump_regs(struct seq_file *file, void *offset)
 			   ((u32 *)data)[i]);
 	}
 
-	return 0;
+out:
+	mcp25xxfd_spi_debug_exit(priv);
+
+	return ret;
 }
 
 #if defined(CONFIG_DEBUG_FS)
+/* the cyclic tx table - the entries ever set, with their stats */
+static int mcp25xxfd_tx_cyclic_show(struct seq_file *file, void *offset)
+{
+	struct mcp25xxfd_priv *priv = file->private;
+	struct mcp25xxfd_tx_cyclic *cyclic = &priv->tx_cyclic;
+	struct mcp25xxfd_tx_cyclic_entry copy, *entry = &copy;
+	struct canfd_frame *frame = &copy.frame;
+	unsigned long flags;
+	int i, j;
+
+	seq_puts(file,
+		 "# index state period_us count frames missed jitter_max_ns jitter_avg_ns frame\n");
+
+	for (i = 0; i < MCP25XXFD_TX_CYCLIC_MAX; i++) {
+		/* print a copy, not with the lock held */
+		spin_lock_irqsave(&cyclic->lock, flags);
+		copy = cyclic->entries[i];
+		spin_unlock_irqrestore(&cyclic->lock, flags);
+		if (!entry->period_us)
+			continue;
+
+		seq_printf(file, "%3i %3s %8u %6u %10llu %6llu %8llu %8llu ",
+			   i, entry->active ? "on" : "off", entry->period_us,
+			   entry->count, entry->frames, entry->missed,
+			   entry->jitter_max_ns,
+			   entry->jitter_samples ?
+			   div64_u64(entry->jitter_sum_ns,
+				     entry->jitter_samples) : 0);
+		if (frame->can_id & CAN_EFF_FLAG)
+			seq_printf(file, "%08X#",
+				   frame->can_id & CAN_EFF_MASK);
+		else
+			seq_printf(file, "%03X#",
+				   frame->can_id & CAN_SFF_MASK);
+		if (frame->can_id & CAN_RTR_FLAG)
+			seq_printf(file, "R%u", frame->len);
+		else if (entry->fd)
+			seq_printf(file, "#%X", frame->flags);
+		for (j = 0; j < frame->len && !(frame->can_id & CAN_RTR_FLAG);
+		     j++)
+			seq_printf(file, "%02X", frame->data[j]);
+		seq_puts(file, "\n");
+	}
+
+	return 0;
+}
+
+static int mcp25xxfd_tx_cyclic_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mcp25xxfd_tx_cyclic_show, inode->i_private);
+}
+
+static ssize_t mcp25xxfd_tx_cyclic_write(struct file *file,
+					 const char __user *buf,
+					 size_t len, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	char line[256];
+	int ret;
+
+	if (len >= sizeof(line))
+		return -EINVAL;
+	if (copy_from_user(line, buf, len))
+		return -EFAULT;
+	line[len] = 0;
+
+	ret = mcp25xxfd_tx_cyclic_parse(m->private, line);
+
+	return ret ? ret : len;
+}
+
+static const struct file_operations mcp25xxfd_tx_cyclic_fops = {
+	.owner = THIS_MODULE,
+	.open = mcp25xxfd_tx_cyclic_open,
+	.read = seq_read,
+	.write = mcp25xxfd_tx_cyclic_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static void mcp25xxfd_debugfs_add(struct mcp25xxfd_priv *priv)
 {
 	struct dentry *root, *fifousage, *fifoaddr, *rx, *tx, *status,
-		*regs, *stats, *rxdlc, *txdlc;
+		*regs, *stats, *rxdlc, *txdlc, *ring, *shaper;
 	char name[32];
 	int i;
 
@@ -4022,6 +9192,8 @@ static void mcp25xxfd_debugfs_add(struct mcp25xxfd_priv *priv)
 			   &priv->spi_setup_speed_hz);
 	debugfs_create_u32("spi_speed_hz", 0444, root,
 			   &priv->spi_speed_hz);
+	debugfs_create_u32("spi_calibrated_speed_hz", 0444, root,
+			   &priv->spi_calibrated_speed_hz);
 
 	/* add irq state info */
 	debugfs_create_u32("irq_state", 0444, root, &priv->stats.irq_state);
@@ -4092,6 +9264,58 @@ static void mcp25xxfd_debugfs_add(struct mcp25xxfd_priv *priv)
 	debugfs_create_u32("tef_count", 0444, tx,
 			   &priv->fifos.tef_fifos);
 
+	debugfs_create_u32("ring_count", 0444, tx,
+			   &priv->tx_ring_count);
+	debugfs_create_u32("ring_depth", 0444, tx,
+			   &priv->fifos.tx_fifo_depth);
+	for (i = 0; i < priv->net->num_tx_queues; i++) {
+		snprintf(name, sizeof(name), "ring%i", i);
+		ring = debugfs_create_dir(name, tx);
+		debugfs_create_u32("head", 0444, ring,
+				   &priv->tx_rings[i].head);
+		debugfs_create_u32("tail", 0444, ring,
+				   &priv->tx_rings[i].tail);
+		debugfs_create_ulong("inflight", 0444, ring,
+				     &priv->tx_rings[i].inflight);
+		debugfs_create_u8("txpri", 0444, ring,
+				  &priv->tx_queue_txpri[i]);
+	}
+
+	/* the tx shaper gets configured here at runtime */
+	shaper = debugfs_create_dir("shaper", tx);
+	debugfs_create_u32("share_permille", 0644, shaper,
+			   &priv->tx_shaper.share);
+	debugfs_create_u32("burst_us", 0644, shaper,
+			   &priv->tx_shaper.burst_us);
+	debugfs_create_x32("queues", 0644, shaper,
+			   &priv->tx_shaper.queues);
+	debugfs_create_u32("txbws", 0644, shaper,
+			   &priv->tx_shaper.txbws);
+
+	/* the cyclic tx table gets configured by writing lines to it */
+	debugfs_create_file("cyclic", 0644, tx, priv,
+			    &mcp25xxfd_tx_cyclic_fops);
+	debugfs_create_u32("cyclic_fifo", 0444, tx,
+			   &priv->tx_cyclic.fifo);
+	debugfs_create_u32("cyclic_depth", 0444, tx,
+			   &priv->tx_cyclic.depth);
+	debugfs_create_u64("ring_full", 0444, tx,
+			   &priv->stats.tx_ring_full);
+	debugfs_create_u64("ring_resets", 0444, tx,
+			   &priv->stats.tx_ring_resets);
+	debugfs_create_u64("ring_seq_errors", 0444, tx,
+			   &priv->stats.tx_ring_seq_errors);
+	debugfs_create_u64("abort_arbitration", 0444, tx,
+			   &priv->stats.tx_abort_arbitration);
+	debugfs_create_u64("abort_error", 0444, tx,
+			   &priv->stats.tx_abort_error);
+	debugfs_create_u64("abort_other", 0444, tx,
+			   &priv->stats.tx_abort_other);
+	debugfs_create_u64("retransmits", 0444, tx,
+			   &priv->stats.tx_retransmits);
+	debugfs_create_u64("retransmit_exhausted", 0444, tx,
+			   &priv->stats.tx_retransmit_exhausted);
+
 	debugfs_create_u32("fifo_max_payload_size", 0444, root,
 			   &priv->fifos.payload_size);
 
@@ -4100,6 +9324,84 @@ static void mcp25xxfd_debugfs_add(struct mcp25xxfd_priv *priv)
 			   &priv->stats.irq_calls);
 	debugfs_create_u64("int_loops", 0444, stats,
 			   &priv->stats.irq_loops);
+	debugfs_create_u64("int_async_handoff", 0444, stats,
+			   &priv->stats.irq_async_handoff);
+	debugfs_create_u64("write_batch_writes", 0444, stats,
+			   &priv->stats.write_batch_writes);
+	debugfs_create_u64("write_batch_flushes", 0444, stats,
+			   &priv->stats.write_batch_flushes);
+	debugfs_create_u64("write_batch_merged", 0444, stats,
+			   &priv->stats.write_batch_merged);
+	debugfs_create_u64("tef_bulk_reads", 0444, stats,
+			   &priv->stats.tef_bulk_reads);
+	debugfs_create_u64("tef_bulk_objects", 0444, stats,
+			   &priv->stats.tef_bulk_objects);
+	debugfs_create_u64("spi_crc_err_sfr", 0444, stats,
+			   &priv->stats.spi_crc_err_sfr);
+	debugfs_create_u64("spi_crc_err_ram", 0444, stats,
+			   &priv->stats.spi_crc_err_ram);
+	debugfs_create_u64("spi_crc_err_exhausted", 0444, stats,
+			   &priv->stats.spi_crc_err_exhausted);
+	debugfs_create_u64("spi_buffer_irq_uses", 0444, stats,
+			   &priv->stats.spi_buffer_uses[MCP25XXFD_SPI_CTX_IRQ]);
+	debugfs_create_u64("spi_buffer_irq_waits", 0444, stats,
+			   &priv->stats.spi_buffer_waits[MCP25XXFD_SPI_CTX_IRQ]);
+	debugfs_create_u64("spi_buffer_config_uses", 0444, stats,
+			   &priv->stats.spi_buffer_uses[MCP25XXFD_SPI_CTX_CONFIG]);
+	debugfs_create_u64("spi_buffer_config_waits", 0444, stats,
+			   &priv->stats.spi_buffer_waits[MCP25XXFD_SPI_CTX_CONFIG]);
+	debugfs_create_u64("spi_buffer_debug_uses", 0444, stats,
+			   &priv->stats.spi_buffer_uses[MCP25XXFD_SPI_CTX_DEBUG]);
+	debugfs_create_u64("spi_buffer_debug_waits", 0444, stats,
+			   &priv->stats.spi_buffer_waits[MCP25XXFD_SPI_CTX_DEBUG]);
+	debugfs_create_u64("bus_lock_count", 0444, stats,
+			   &priv->stats.bus_lock_count);
+	debugfs_create_u64("bus_lock_budget_exceeded", 0444, stats,
+			   &priv->stats.bus_lock_budget_exceeded);
+	debugfs_create_u64("bus_lock_hold_ns", 0444, stats,
+			   &priv->stats.bus_lock_hold_ns);
+	debugfs_create_u64("bus_lock_hold_max_ns", 0444, stats,
+			   &priv->stats.bus_lock_hold_max_ns);
+	debugfs_create_u64("tx_spi_busy", 0444, stats,
+			   &priv->stats.tx_spi_busy);
+	debugfs_create_u64("tx_batches", 0444, stats,
+			   &priv->stats.tx_batches);
+	debugfs_create_u64("tx_batch_frames", 0444, stats,
+			   &priv->stats.tx_batch_frames);
+	debugfs_create_u64("tx_batch_drops", 0444, stats,
+			   &priv->stats.tx_batch_drops);
+	debugfs_create_u64("tx_launch_frames", 0444, stats,
+			   &priv->stats.tx_launch_frames);
+	debugfs_create_u64("tx_launch_late", 0444, stats,
+			   &priv->stats.tx_launch_late);
+	debugfs_create_u64("tx_launch_early", 0444, stats,
+			   &priv->stats.tx_launch_early);
+	debugfs_create_u64("tx_launch_retries", 0444, stats,
+			   &priv->stats.tx_launch_retries);
+	debugfs_create_u64("tx_launch_error_max_ns", 0444, stats,
+			   &priv->stats.tx_launch_error_max_ns);
+	debugfs_create_u64("tx_launch_error_sum_ns", 0444, stats,
+			   &priv->stats.tx_launch_error_sum_ns);
+	debugfs_create_u64("tx_shaper_frames", 0444, stats,
+			   &priv->stats.tx_shaper_frames);
+	debugfs_create_u64("tx_shaper_bus_ns", 0444, stats,
+			   &priv->stats.tx_shaper_bus_ns);
+	debugfs_create_u64("tx_shaper_throttled", 0444, stats,
+			   &priv->stats.tx_shaper_throttled);
+	debugfs_create_u64("tx_shaper_requeued", 0444, stats,
+			   &priv->stats.tx_shaper_requeued);
+	debugfs_create_u64("tx_cyclic_frames", 0444, stats,
+			   &priv->stats.tx_cyclic_frames);
+	debugfs_create_u64("tx_cyclic_missed", 0444, stats,
+			   &priv->stats.tx_cyclic_missed);
+	debugfs_create_u64("tx_cyclic_jitter_max_ns", 0444, stats,
+			   &priv->stats.tx_cyclic_jitter_max_ns);
+	debugfs_create_u64("tx_cyclic_jitter_sum_ns", 0444, stats,
+			   &priv->stats.tx_cyclic_jitter_sum_ns);
+	debugfs_create_u64("tx_cyclic_jitter_samples", 0444, stats,
+			   &priv->stats.tx_cyclic_jitter_samples);
+	debugfs_create_u64("ts_resync_steps", 0444, stats,
+			   &priv->stats.ts_resync_steps);
 	debugfs_create_u64("int_ivm", 0444, stats,
 			   &priv->stats.int_ivm_count);
 	debugfs_create_u64("int_wake", 0444, stats,
@@ -4199,6 +9501,12 @@ int mcp25xxfd_of_parse(struct mcp25xxfd_priv *priv)
 	priv->config.gpio_opendrain =
 		of_property_read_bool(np, "microchip,gpio-open-drain");
 
+	priv->config.use_txq =
+		of_property_read_bool(np, "microchip,use-txq");
+
+	priv->config.no_tef =
+		of_property_read_bool(np, "microchip,no-tef");
+
 	return 0;
 }
 #else
@@ -4214,8 +9522,9 @@ static int mcp25xxfd_can_probe(struct spi_device *spi)
 		of_match_device(mcp25xxfd_of_match, &spi->dev);
 	struct net_device *net;
 	struct mcp25xxfd_priv *priv;
+	struct mcp25xxfd_dma_buffers *dma_buffers;
 	struct clk *clk;
-	int ret, freq;
+	int ret, freq, i, queues;
 
 	/* as irq_create_fwspec_mapping() can return 0, check for it */
 	if (spi->irq <= 0) {
@@ -4239,12 +9548,22 @@ static int mcp25xxfd_can_probe(struct spi_device *spi)
 		return -ERANGE;
 	}
 
+	/* the number of netdev tx queues */
+	queues = tx_queues ? tx_queues : 1;
+	if (queues > MCP25XXFD_TX_QUEUES_MAX) {
+		dev_err(&spi->dev,
+			"There is an absolute maximum of %i tx queues\n",
+			MCP25XXFD_TX_QUEUES_MAX);
+		return -EINVAL;
+	}
+
 	/* Allocate can/net device */
-	net = alloc_candev(sizeof(*priv), TX_ECHO_SKB_MAX);
+	net = alloc_candev_mqs(sizeof(*priv), TX_ECHO_SKB_MAX, queues, 1);
 	if (!net)
 		return -ENOMEM;
 
 	net->netdev_ops = &mcp25xxfd_netdev_ops;
+	net->ethtool_ops = &mcp25xxfd_ethtool_ops;
 	net->flags |= IFF_ECHO;
 
 	priv = netdev_priv(net);
@@ -4276,7 +9595,33 @@ static int mcp25xxfd_can_probe(struct spi_device *spi)
 	priv->clk_user_mask = MCP25XXFD_CLK_USER_CAN;
 
 	mutex_init(&priv->clk_user_lock);
-	mutex_init(&priv->spi_rxtx_lock);
+	mutex_init(&priv->spi_debug_lock);
+	spin_lock_init(&priv->ts.lock);
+	mutex_init(&priv->ts.mutex);
+	INIT_DELAYED_WORK(&priv->ts.work, mcp25xxfd_timestamp_work);
+	for (i = 0; i < MCP25XXFD_SPI_CTX_COUNT; i++)
+		mutex_init(&priv->spi_buffers[i].lock);
+
+	/* allocate the buffers for spi transfers */
+	dma_buffers = devm_kzalloc(&spi->dev, sizeof(*dma_buffers),
+				   GFP_KERNEL | GFP_DMA);
+	if (!dma_buffers) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	priv->tx_cyclic.entries =
+		devm_kcalloc(&spi->dev, MCP25XXFD_TX_CYCLIC_MAX,
+			     sizeof(*priv->tx_cyclic.entries), GFP_KERNEL);
+	if (!priv->tx_cyclic.entries) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	for (i = 0; i < MCP25XXFD_SPI_CTX_COUNT; i++) {
+		priv->spi_buffers[i].tx = dma_buffers->spi[i].tx;
+		priv->spi_buffers[i].rx = dma_buffers->spi[i].rx;
+	}
+	priv->fifos.fifo_data = dma_buffers->fifo_data;
+	priv->spi_fifo_cmd = dma_buffers->fifo_cmd;
 
 	/* enable the clock and mark as enabled */
 	priv->clk_user_mask = MCP25XXFD_CLK_USER_CAN;
@@ -4312,6 +9657,36 @@ static int mcp25xxfd_can_probe(struct spi_device *spi)
 	if (ret)
 		return ret;
 
+	/* the TXQ is a single fifo, so there is only one tx queue
+	 * - by default a higher queue gets a higher TXPRI
+	 */
+	if (priv->config.use_txq && queues > 1) {
+		dev_warn(&spi->dev,
+			 "Using a single tx queue with the TXQ\n");
+		netif_set_real_num_tx_queues(net, 1);
+	}
+	for (i = 0; i < MCP25XXFD_TX_QUEUES_MAX; i++) {
+		priv->tx_queue_txpri[i] = i;
+		priv->tx_launch[i].priv = priv;
+		priv->tx_launch[i].queue = i;
+		hrtimer_init(&priv->tx_launch[i].timer, CLOCK_TAI,
+			     HRTIMER_MODE_ABS);
+		priv->tx_launch[i].timer.function = mcp25xxfd_tx_launch_timer;
+	}
+	priv->tx_shaper.priv = priv;
+	priv->tx_shaper.burst_us = 1000;
+	priv->tx_shaper.queues = GENMASK(MCP25XXFD_TX_QUEUES_MAX - 1, 0);
+	spin_lock_init(&priv->tx_shaper.lock);
+	hrtimer_init(&priv->tx_shaper.timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL);
+	priv->tx_shaper.timer.function = mcp25xxfd_tx_shaper_timer;
+	priv->tx_cyclic.priv = priv;
+	mutex_init(&priv->tx_cyclic.mutex);
+	spin_lock_init(&priv->tx_cyclic.lock);
+	hrtimer_init(&priv->tx_cyclic.timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_ABS);
+	priv->tx_cyclic.timer.function = mcp25xxfd_tx_cyclic_timer;
+
 	/* decide on real can clock rate */
 	priv->can.clock.freq = freq;
 	if (priv->config.clock_pll) {
@@ -4380,6 +9755,13 @@ static int mcp25xxfd_can_probe(struct spi_device *spi)
 		goto error_probe;
 	}
 
+	/* calibrate the spi clock for this device */
+	if (use_spi_calibration) {
+		ret = mcp25xxfd_calibrate_spi(spi);
+		if (ret)
+			goto error_probe;
+	}
+
 	/* setting up GPIO+INT as PUSHPULL , TXCAN PUSH/PULL, no Standby */
 	priv->regs.iocon = 0;
 
@@ -4399,18 +9781,27 @@ static int mcp25xxfd_can_probe(struct spi_device *spi)
 	/* and put controller to sleep */
 	mcp25xxfd_hw_sleep(spi);
 
-	ret = register_candev(net);
+	ret = mcp25xxfd_bus_join(priv);
 	if (ret)
 		goto error_probe;
 
+	ret = register_candev(net);
+	if (ret)
+		goto error_bus;
+
 	/* register debugfs */
 	mcp25xxfd_debugfs_add(priv);
 
+	mcp25xxfd_ptp_register(priv);
+
 	devm_can_led_init(net);
 
 	netdev_info(net, "MCP%x successfully initialized.\n", priv->model);
 	return 0;
 
+error_bus:
+	mcp25xxfd_bus_leave(priv);
+
 error_probe:
 	mcp25xxfd_power_enable(priv->power, 0);
 
@@ -4428,10 +9819,14 @@ static int mcp25xxfd_can_remove(struct spi_device *spi)
 	struct mcp25xxfd_priv *priv = spi_get_drvdata(spi);
 	struct net_device *net = priv->net;
 
+	mcp25xxfd_ptp_unregister(priv);
+
 	mcp25xxfd_debugfs_remove(priv);
 
 	unregister_candev(net);
 
+	mcp25xxfd_bus_leave(priv);
+
 	mcp25xxfd_power_enable(priv->power, 0);
 
 	if (!IS_ERR(priv->clk))
@@ -4449,6 +9844,7 @@ static int __maybe_unused mcp25xxfd_can_suspend(struct device *dev)
 	struct net_device *net = priv->net;
 
 	priv->force_quit = 1;
+	mcp25xxfd_async_ist_sync(spi);
 	disable_irq(spi->irq);
 
 	if (netif_running(net)) {